@@ -0,0 +1,74 @@
+#include "bench.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> allocated_bytes{0};
+}  // namespace
+
+// Replaces the global allocator so that benchmarks can report allocations per operation. This
+// also counts allocations made inside libdd_opentracing, since the replacement is process-wide.
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return ptr;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+
+namespace datadog {
+namespace opentracing {
+namespace bench {
+
+uint64_t allocationCount() { return allocation_count.load(std::memory_order_relaxed); }
+
+uint64_t allocatedBytes() { return allocated_bytes.load(std::memory_order_relaxed); }
+
+void printHeader() {
+  std::printf("%-48s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op",
+              "bytes/op");
+}
+
+void report(const BenchmarkResult &result) {
+  std::printf("%-48s %12llu %12.1f %12.2f %12.1f\n", result.name.c_str(),
+              static_cast<unsigned long long>(result.iterations), result.ns_per_op,
+              result.allocs_per_op, result.bytes_per_op);
+  std::fflush(stdout);
+}
+
+bool parseArgs(int argc, char **argv, uint64_t &iterations, std::string &filter) {
+  if (argc > 3) {
+    return false;
+  }
+  if (argc > 1) {
+    char *end = nullptr;
+    iterations = std::strtoull(argv[1], &end, 10);
+    if (end == argv[1] || *end != '\0' || iterations == 0) {
+      return false;
+    }
+  }
+  if (argc > 2) {
+    filter = argv[2];
+  }
+  return true;
+}
+
+}  // namespace bench
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,60 @@
+#ifndef DD_OPENTRACING_BENCH_BENCH_H
+#define DD_OPENTRACING_BENCH_BENCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace datadog {
+namespace opentracing {
+namespace bench {
+
+// The number of allocations (calls to global operator new) and bytes allocated so far by the
+// whole process. Counted by the operator new replacement in bench.cpp.
+uint64_t allocationCount();
+uint64_t allocatedBytes();
+
+// The result of timing a single benchmark.
+struct BenchmarkResult {
+  std::string name;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+};
+
+// Prints the column headings for report().
+void printHeader();
+
+// Prints a single benchmark result as a row.
+void report(const BenchmarkResult &result);
+
+// Parses the common benchmark arguments: "[iterations] [name filter]". Returns false if the
+// arguments are invalid.
+bool parseArgs(int argc, char **argv, uint64_t &iterations, std::string &filter);
+
+// Calls op(i) for i in [0, iterations), and reports the time and allocations per call. Any setup
+// that shouldn't be measured must be done before calling this.
+template <typename Op>
+BenchmarkResult measure(const std::string &name, uint64_t iterations, Op op) {
+  auto allocs_before = allocationCount();
+  auto bytes_before = allocatedBytes();
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < iterations; i++) {
+    op(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  auto allocs = allocationCount() - allocs_before;
+  auto bytes = allocatedBytes() - bytes_before;
+  double n = iterations == 0 ? 1 : iterations;
+  return {name, iterations,
+          std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(elapsed).count() /
+              n,
+          allocs / n, bytes / n};
+}
+
+}  // namespace bench
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_BENCH_BENCH_H
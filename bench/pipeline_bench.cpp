@@ -0,0 +1,151 @@
+// End-to-end benchmark of the whole pipeline: spans are created through a tracer from
+// makeTracer(), and sent over HTTP to a stand-in agent running in this process. Reports sustained
+// throughput, dropped traces, bytes on the wire and the CPU cost of tracing.
+//
+// Usage: pipeline_bench [spans/s] [seconds] [spans per trace] [agent latency ms] [agent status]
+//                       [compression level] [concurrent requests]
+#include <datadog/opentracing.h>
+#include "../test/stub_agent.h"
+
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace datadog::opentracing;
+namespace ot = opentracing;
+
+namespace {
+
+int64_t toNanoseconds(const timeval &time) {
+  return int64_t(time.tv_sec) * 1000000000 + int64_t(time.tv_usec) * 1000;
+}
+
+// CPU time (user and system) used by the whole process so far.
+int64_t processCpuTime() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return toNanoseconds(usage.ru_utime) + toNanoseconds(usage.ru_stime);
+}
+
+int64_t threadCpuTime() {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+bool parseNumber(const char *arg, double &value) {
+  char *end = nullptr;
+  value = std::strtod(arg, &end);
+  return end != arg && *end == '\0' && value >= 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  double rate = 20000;
+  double seconds = 10;
+  double depth = 4;
+  double latency_ms = 0;
+  double status = 200;
+  double compression_level = 0;
+  double concurrent_requests = 1;
+  if (argc > 8 || (argc > 1 && !parseNumber(argv[1], rate)) ||
+      (argc > 2 && !parseNumber(argv[2], seconds)) || (argc > 3 && !parseNumber(argv[3], depth)) ||
+      (argc > 4 && !parseNumber(argv[4], latency_ms)) ||
+      (argc > 5 && !parseNumber(argv[5], status)) ||
+      (argc > 6 && !parseNumber(argv[6], compression_level)) ||
+      (argc > 7 && !parseNumber(argv[7], concurrent_requests)) || rate <= 0 || depth < 1 ||
+      compression_level > 9) {
+    std::fprintf(stderr,
+                 "usage: %s [spans/s] [seconds] [spans per trace] [agent latency ms] "
+                 "[agent status] [compression level] [concurrent requests]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  StubAgent agent;
+  StubAgentBehaviour behaviour;
+  behaviour.latency = std::chrono::milliseconds(int64_t(latency_ms));
+  behaviour.status = int(status);
+  agent.setBehaviour(behaviour);
+
+  TracerOptions options;
+  options.agent_host = "127.0.0.1";
+  options.agent_port = agent.port();
+  options.service = "bench";
+  options.payload_compression_level = int32_t(compression_level);
+  options.agent_max_concurrent_requests = uint32_t(concurrent_requests);
+  auto tracer = makeTracer(options);
+
+  std::printf("target %.0f spans/s for %.0fs, %.0f spans per trace, agent latency %.0fms, "
+              "agent status %.0f, compression level %.0f, %.0f concurrent requests\n",
+              rate, seconds, depth, latency_ms, status, compression_level, concurrent_requests);
+
+  // Produce traces at the target rate, from a single thread.
+  uint64_t traces_sent = 0;
+  int64_t producer_cpu_ns = 0;
+  auto cpu_start = processCpuTime();
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                         std::chrono::duration<double>(seconds));
+  auto trace_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(depth / rate));
+  std::thread producer([&]() {
+    auto thread_cpu_start = threadCpuTime();
+    std::vector<std::unique_ptr<ot::Span>> spans(static_cast<size_t>(depth));
+    auto next = start;
+    while (std::chrono::steady_clock::now() < end) {
+      spans[0] = tracer->StartSpan("bench.request");
+      spans[0]->SetTag("http.url", "/api/v1/users/12345");
+      spans[0]->SetTag("http.method", "GET");
+      for (size_t i = 1; i < spans.size(); i++) {
+        spans[i] = tracer->StartSpan("bench.child", {ot::ChildOf(&spans[i - 1]->context())});
+        spans[i]->SetTag("component", "bench");
+      }
+      for (size_t i = spans.size(); i-- > 0;) {
+        spans[i]->Finish();
+        spans[i].reset();
+      }
+      traces_sent++;
+      next += trace_interval;
+      std::this_thread::sleep_until(next);
+    }
+    producer_cpu_ns = threadCpuTime() - thread_cpu_start;
+  });
+  producer.join();
+  auto producing = std::chrono::steady_clock::now() - start;
+
+  // Give the writer a chance to send everything that it's going to.
+  agent.waitForTraces(traces_sent, std::chrono::seconds(5));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  auto tracer_cpu_ns = processCpuTime() - cpu_start - agent.cpuTime().count();
+  tracer->Close();
+  tracer.reset();
+  agent.stop();
+
+  double producing_s = std::chrono::duration<double>(producing).count();
+  double elapsed_ns = std::chrono::duration<double, std::nano>(elapsed).count();
+  uint64_t spans_sent = traces_sent * uint64_t(depth);
+  uint64_t traces_received = agent.traces();
+  uint64_t spans_received = agent.spans();
+  std::printf("spans sent:                 %llu (%.0f/s)\n",
+              static_cast<unsigned long long>(spans_sent), spans_sent / producing_s);
+  std::printf("spans received by agent:    %llu (%.0f/s sustained)\n",
+              static_cast<unsigned long long>(spans_received), spans_received / producing_s);
+  std::printf("traces dropped:             %llu of %llu\n",
+              static_cast<unsigned long long>(traces_sent - std::min(traces_sent, traces_received)),
+              static_cast<unsigned long long>(traces_sent));
+  std::printf("requests to agent:          %llu (%llu undecodable)\n",
+              static_cast<unsigned long long>(agent.requests()),
+              static_cast<unsigned long long>(agent.decodeErrors()));
+  std::printf("bytes on the wire:          %llu (%.1f/span)\n",
+              static_cast<unsigned long long>(agent.bytes()),
+              spans_received == 0 ? 0.0 : double(agent.bytes()) / spans_received);
+  std::printf("tracer CPU per span:        %.0fns (%.0fns on the producer thread)\n",
+              double(tracer_cpu_ns) / spans_sent, double(producer_cpu_ns) / spans_sent);
+  // Everything that isn't the producer or the agent is the writer thread.
+  std::printf("writer thread utilisation:  %.1f%%\n",
+              100.0 * (tracer_cpu_ns - producer_cpu_ns) / elapsed_ns);
+  return 0;
+}
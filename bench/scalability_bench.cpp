@@ -0,0 +1,245 @@
+// Measures how span creation and completion scale with the number of threads, through a real
+// WritingSpanBuffer and AgentWriter (sending to a MockHandle). For each thread count, reports
+// throughput, per-operation latency percentiles and how long threads spent waiting for locks.
+//
+// By default the writer sends traces once a second, dropping any more than 7000. If a max batch
+// size is given, the writer is instead flushed continuously while the workload runs, sending
+// batches of up to that many traces, so that the effect of encoding large batches on the threads
+// creating spans can be seen.
+//
+// Usage: scalability_bench [max threads] [trace depth] [traces per thread] [span buffer shards]
+//                          [max batch size]
+#include "../src/sample.h"
+#include "../src/span_buffer.h"
+#include "../src/tracer.h"
+#include "../src/writer.h"
+#include "../test/mocks.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace datadog::opentracing;
+namespace ot = opentracing;
+
+namespace {
+// Only threads running the workload record their lock waits.
+thread_local bool record_lock_waits = false;
+thread_local uint64_t lock_wait_ns = 0;
+thread_local uint64_t contended_locks = 0;
+}  // namespace
+
+#ifdef __GLIBC__
+namespace {
+using MutexLockFunction = int (*)(pthread_mutex_t *);
+MutexLockFunction real_mutex_lock = nullptr;
+
+__attribute__((constructor)) void findRealMutexLock() {
+  real_mutex_lock = reinterpret_cast<MutexLockFunction>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+}
+}  // namespace
+
+// Interposes pthread_mutex_lock, and therefore std::mutex::lock (including inside
+// libdd_opentracing), so that the time workload threads spend blocked on a contended lock can be
+// measured without instrumenting the library.
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  if (real_mutex_lock == nullptr) {
+    // Still being looked up (dlsym may lock mutexes itself), spin instead.
+    int result;
+    while ((result = pthread_mutex_trylock(mutex)) == EBUSY) {
+    }
+    return result;
+  }
+  if (!record_lock_waits) {
+    return real_mutex_lock(mutex);
+  }
+  if (pthread_mutex_trylock(mutex) == 0) {
+    return 0;  // Uncontended.
+  }
+  auto start = std::chrono::steady_clock::now();
+  int result = real_mutex_lock(mutex);
+  lock_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  contended_locks++;
+  return result;
+}
+const bool lock_waits_measured = true;
+#else
+const bool lock_waits_measured = false;
+#endif
+
+namespace {
+
+struct ThreadResult {
+  // Latency of each StartSpan and Finish call, in ns.
+  std::vector<uint64_t> latencies;
+  uint64_t lock_wait_ns = 0;
+  uint64_t contended_locks = 0;
+  uint64_t elapsed_ns = 0;
+};
+
+uint64_t since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                              start)
+      .count();
+}
+
+// Creates traces of the given depth (a root span plus depth-1 nested children), finishing the
+// children before their parents.
+void runWorkload(const std::shared_ptr<Tracer> &tracer, size_t depth, size_t num_traces,
+                 ThreadResult &result) {
+  result.latencies.reserve(num_traces * depth * 2);
+  std::vector<std::unique_ptr<ot::Span>> spans(depth);
+  const ot::FinishSpanOptions finish_options;
+  record_lock_waits = true;
+  auto thread_start = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < num_traces; t++) {
+    for (size_t d = 0; d < depth; d++) {
+      ot::StartSpanOptions options;
+      if (d > 0) {
+        options.references.emplace_back(ot::SpanReferenceType::ChildOfRef,
+                                        &spans[d - 1]->context());
+      }
+      auto start = std::chrono::steady_clock::now();
+      spans[d] = tracer->StartSpanWithOptions("bench.operation", options);
+      result.latencies.push_back(since(start));
+    }
+    for (size_t d = depth; d-- > 0;) {
+      auto start = std::chrono::steady_clock::now();
+      spans[d]->FinishWithOptions(finish_options);
+      result.latencies.push_back(since(start));
+    }
+    for (auto &span : spans) {
+      span.reset();
+    }
+  }
+  result.elapsed_ns = since(thread_start);
+  record_lock_waits = false;
+  result.lock_wait_ns = lock_wait_ns;
+  result.contended_locks = contended_locks;
+  lock_wait_ns = 0;
+  contended_locks = 0;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void runThreads(size_t num_threads, size_t depth, size_t traces_per_thread, size_t num_shards,
+                size_t max_batch_size) {
+  // A fresh writer per run, so that queued traces from one run don't affect the next.
+  auto writer = std::make_shared<AgentWriter>(
+      std::unique_ptr<Handle>{new MockHandle{}}, "bench", std::chrono::seconds(1),
+      max_batch_size == 0 ? 7000 : max_batch_size, std::vector<std::chrono::milliseconds>{},
+      "localhost", 8126);
+  WritingSpanBufferOptions buffer_options;
+  buffer_options.num_shards = num_shards;
+  auto buffer = std::make_shared<WritingSpanBuffer>(writer, buffer_options);
+  TracerOptions tracer_options;
+  tracer_options.service = "bench";
+  auto tracer = std::make_shared<Tracer>(tracer_options, buffer, getRealTime, getId,
+                                         ConstantRateSampler(1.0));
+
+  std::vector<ThreadResult> results(num_threads);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_threads; i++) {
+    threads.emplace_back(
+        [&](size_t i) { runWorkload(tracer, depth, traces_per_thread, results[i]); }, i);
+  }
+  std::atomic<bool> running{true};
+  std::thread flusher;
+  if (max_batch_size != 0) {
+    flusher = std::thread{[&]() {
+      while (running) {
+        writer->flush();
+      }
+    }};
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto elapsed_ns = since(start);
+  running = false;
+  if (flusher.joinable()) {
+    flusher.join();
+  }
+  writer->stop();
+
+  std::vector<uint64_t> latencies;
+  uint64_t total_wait_ns = 0;
+  uint64_t total_thread_ns = 0;
+  uint64_t total_contended = 0;
+  for (auto &result : results) {
+    latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    total_wait_ns += result.lock_wait_ns;
+    total_thread_ns += result.elapsed_ns;
+    total_contended += result.contended_locks;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  double total_spans = double(num_threads) * traces_per_thread * depth;
+  double ops = latencies.empty() ? 1 : latencies.size();
+  std::printf("%8zu %14.0f %10llu %10llu %10llu %16.3f %10.1f %14.3f\n", num_threads,
+              total_spans / (elapsed_ns / 1e9),
+              static_cast<unsigned long long>(percentile(latencies, 0.5)),
+              static_cast<unsigned long long>(percentile(latencies, 0.99)),
+              static_cast<unsigned long long>(percentile(latencies, 0.999)),
+              total_wait_ns / 1e6 / num_threads,
+              total_thread_ns == 0 ? 0.0 : 100.0 * total_wait_ns / total_thread_ns,
+              total_contended / ops);
+  std::fflush(stdout);
+}
+
+bool parseSize(const char *arg, size_t &value, size_t min_value = 1) {
+  char *end = nullptr;
+  value = std::strtoull(arg, &end, 10);
+  return end != arg && *end == '\0' && value >= min_value;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t max_threads = std::max(2u, std::thread::hardware_concurrency());
+  size_t depth = 4;
+  size_t traces_per_thread = 20000;
+  size_t num_shards = 0;
+  size_t max_batch_size = 0;
+  if (argc > 6 || (argc > 1 && !parseSize(argv[1], max_threads)) ||
+      (argc > 2 && !parseSize(argv[2], depth)) ||
+      (argc > 3 && !parseSize(argv[3], traces_per_thread)) ||
+      (argc > 4 && !parseSize(argv[4], num_shards, 0)) ||
+      (argc > 5 && !parseSize(argv[5], max_batch_size, 0))) {
+    std::fprintf(stderr,
+                 "usage: %s [max threads] [trace depth] [traces per thread] [span buffer shards] "
+                 "[max batch size]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  std::printf("trace depth %zu, %zu traces per thread, %s span buffer shards, %s\n", depth,
+              traces_per_thread, num_shards == 0 ? "default" : std::to_string(num_shards).c_str(),
+              max_batch_size == 0
+                  ? "periodic writes"
+                  : ("continuous writes of up to " + std::to_string(max_batch_size) + " traces")
+                        .c_str());
+  if (!lock_waits_measured) {
+    std::printf("lock wait times are not measured on this platform\n");
+  }
+  std::printf("%8s %14s %10s %10s %10s %16s %10s %14s\n", "threads", "spans/s", "p50 ns",
+              "p99 ns", "p999 ns", "lock wait ms/thr", "wait %", "contended/op");
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    runThreads(threads, depth, traces_per_thread, num_shards, max_batch_size);
+    if (threads < max_threads && threads * 2 > max_threads) {
+      runThreads(max_threads, depth, traces_per_thread, num_shards, max_batch_size);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,229 @@
+// Microbenchmarks for the per-span hot path: starting spans, setting tags, finishing spans,
+// propagation and encoding. Runs offline; traces are "sent" to a MockHandle.
+//
+// Usage: span_bench [iterations] [name filter]
+#include "../src/encoder.h"
+#include "../src/payload_buffer.h"
+#include "../src/propagation.h"
+#include "../src/sample.h"
+#include "../src/span.h"
+#include "../src/span_buffer.h"
+#include "../src/tracer.h"
+#include "../src/writer.h"
+#include "../test/mocks.h"
+#include "bench.h"
+
+#include <cstdio>
+
+using namespace datadog::opentracing;
+using namespace datadog::opentracing::bench;
+namespace ot = opentracing;
+
+namespace {
+
+// A TextMapReader and TextMapWriter that keeps its contents between calls, so that repeated
+// serialization doesn't measure carrier construction.
+struct BenchTextMapCarrier : ot::TextMapReader, ot::TextMapWriter {
+  ot::expected<void> Set(ot::string_view key, ot::string_view value) const override {
+    text_map[key] = value;
+    return {};
+  }
+
+  ot::expected<void> ForeachKey(
+      std::function<ot::expected<void>(ot::string_view key, ot::string_view value)> f)
+      const override {
+    for (const auto& key_value : text_map) {
+      auto result = f(key_value.first, key_value.second);
+      if (!result) return result;
+    }
+    return {};
+  }
+
+  mutable std::unordered_map<std::string, std::string> text_map;
+};
+
+// Makes a Trace that looks like a typical nginx request: a root span and some children, each with
+// a handful of tags.
+Trace makeTypicalTrace(uint64_t trace_id, size_t num_spans) {
+  Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+  for (uint64_t i = 0; i < num_spans; i++) {
+    auto span = std::unique_ptr<TestSpanData>{
+        new TestSpanData{"web", "nginx", "GET /api/v1/users/?", "nginx.handle", trace_id,
+                         trace_id + i, i == 0 ? 0 : trace_id, 1525385478000000000, 2500000, 0}};
+    span->meta["http.method"] = "GET";
+    span->meta["http.url"] = "/api/v1/users/?";
+    span->meta["http.status_code"] = "200";
+    span->meta["component"] = "nginx";
+    span->meta["nginx.worker_pid"] = "12345";
+    span->meta["peer.hostname"] = "frontend-7d9c6b5f4-x2x9z";
+    span->meta["span.kind"] = "server";
+    span->meta["_sample_rate"] = "1.000000";
+    trace->emplace_back(std::move(span));
+  }
+  return trace;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  uint64_t iterations = 100000;
+  std::string filter;
+  if (!parseArgs(argc, argv, iterations, filter)) {
+    std::fprintf(stderr, "usage: %s [iterations] [name filter]\n", argv[0]);
+    return 1;
+  }
+
+  // Fixed clock and sequential ids, so that the measurements don't include the real clock or
+  // random number generation.
+  TimePoint time = getRealTime();
+  TimeProvider get_time = [&time]() { return time; };
+  uint64_t id = 1;
+  IdProvider get_id = [&id]() { return id++; };
+  auto writer = std::make_shared<AgentWriter>(
+      std::unique_ptr<Handle>{new MockHandle{}}, "bench", std::chrono::hours(1),
+      std::max<size_t>(iterations, 7000), std::vector<std::chrono::milliseconds>{}, "localhost",
+      8126);
+  auto buffer = std::make_shared<WritingSpanBuffer>(writer);
+  TracerOptions tracer_options;
+  tracer_options.service = "bench";
+  auto tracer = std::make_shared<Tracer>(tracer_options, buffer, get_time, get_id,
+                                         ConstantRateSampler(1.0));
+
+  const ot::StartSpanOptions root_options;
+  const ot::FinishSpanOptions finish_options;
+  std::vector<std::unique_ptr<ot::Span>> spans(iterations);
+  auto run = [&](const std::string& name, uint64_t n, std::function<void(uint64_t)> op) {
+    if (name.find(filter) == std::string::npos) {
+      return;
+    }
+    report(measure(name, n, op));
+  };
+  // Finishes any outstanding spans and sends everything to the MockHandle, outside of any
+  // measurement.
+  auto reset = [&]() {
+    for (auto& span : spans) {
+      span.reset();
+    }
+    writer->flush();
+  };
+
+  printHeader();
+
+  run("Tracer::StartSpanWithOptions(root)", iterations, [&](uint64_t i) {
+    spans[i] = tracer->StartSpanWithOptions("bench.operation", root_options);
+  });
+  reset();
+
+  {
+    auto parent = tracer->StartSpan("bench.parent");
+    ot::StartSpanOptions child_options;
+    child_options.references.emplace_back(ot::SpanReferenceType::ChildOfRef, &parent->context());
+    run("Tracer::StartSpanWithOptions(child)", iterations, [&](uint64_t i) {
+      spans[i] = tracer->StartSpanWithOptions("bench.child", child_options);
+    });
+    reset();
+    parent->FinishWithOptions(finish_options);
+    writer->flush();
+  }
+
+  {
+    auto span = tracer->StartSpan("bench.tags");
+    std::vector<std::pair<std::string, ot::Value>> values{
+        {"bool", ot::Value{true}},
+        {"double", ot::Value{0.5}},
+        {"int64_t", ot::Value{int64_t{-42}}},
+        {"uint64_t", ot::Value{uint64_t{42}}},
+        {"std::string", ot::Value{std::string{"a typical tag value"}}},
+        {"nullptr", ot::Value{nullptr}},
+        {"const char*", ot::Value{"a typical tag value"}},
+        {"Values", ot::Value{ot::Values{ot::Value{"a"}, ot::Value{int64_t{1}}, ot::Value{true}}}},
+        {"Dictionary", ot::Value{ot::Dictionary{{"key", ot::Value{"value"}},
+                                                {"number", ot::Value{int64_t{1}}}}}}};
+    for (auto& value : values) {
+      run("Span::SetTag(" + value.first + ")", iterations,
+          [&](uint64_t) { span->SetTag("bench.tag", value.second); });
+    }
+    run("Span::SetTag(http.url)", iterations,
+        [&](uint64_t) { span->SetTag("http.url", "/api/v1/users/12345"); });
+    span->FinishWithOptions(finish_options);
+    writer->flush();
+  }
+
+  for (auto& span : spans) {
+    span = tracer->StartSpanWithOptions("bench.operation", root_options);
+  }
+  run("Span::FinishWithOptions(root)", iterations,
+      [&](uint64_t i) { spans[i]->FinishWithOptions(finish_options); });
+  reset();
+
+  {
+    auto parent = tracer->StartSpan("bench.parent");
+    ot::StartSpanOptions child_options;
+    child_options.references.emplace_back(ot::SpanReferenceType::ChildOfRef, &parent->context());
+    for (auto& span : spans) {
+      span = tracer->StartSpanWithOptions("bench.child", child_options);
+    }
+    run("Span::FinishWithOptions(child)", iterations,
+        [&](uint64_t i) { spans[i]->FinishWithOptions(finish_options); });
+    reset();
+    parent->FinishWithOptions(finish_options);
+    writer->flush();
+  }
+
+  {
+    auto span = tracer->StartSpan("bench.propagation");
+    span->SetBaggageItem("user", "12345");
+    auto& context = static_cast<const SpanContext&>(span->context());
+    BenchTextMapCarrier carrier;
+    run("SpanContext::serialize", iterations, [&](uint64_t) { context.serialize(carrier); });
+    run("SpanContext::deserialize", iterations,
+        [&](uint64_t) { SpanContext::deserialize(carrier); });
+    span->FinishWithOptions(finish_options);
+    writer->flush();
+  }
+
+  {
+    // AgentWriter encodes with encodeTraces, msgpack::pack is the generic encoder it replaced.
+    PayloadBuffer payload;
+    std::vector<Trace> single;
+    single.push_back(makeTypicalTrace(1, 10));
+    run("msgpack::pack(Trace, 10 spans)", iterations, [&](uint64_t) {
+      payload.clear();
+      msgpack::pack(payload, single);
+    });
+    run("encodeTraces(Trace, 10 spans)", iterations, [&](uint64_t) {
+      payload.clear();
+      encodeTraces(payload, single);
+    });
+
+    std::vector<Trace> batch;
+    for (uint64_t i = 0; i < 100; i++) {
+      batch.push_back(makeTypicalTrace(i * 100, 10));
+    }
+    run("msgpack::pack(100 Traces, 10 spans each)", std::max<uint64_t>(iterations / 100, 1),
+        [&](uint64_t) {
+          payload.clear();
+          msgpack::pack(payload, batch);
+        });
+    run("encodeTraces(100 Traces, 10 spans each)", std::max<uint64_t>(iterations / 100, 1),
+        [&](uint64_t) {
+          payload.clear();
+          encodeTraces(payload, batch);
+        });
+    StringTableEncoder string_table_encoder;
+    run("StringTableEncoder(100 Traces, 10 spans each)", std::max<uint64_t>(iterations / 100, 1),
+        [&](uint64_t) {
+          payload.clear();
+          string_table_encoder.encode(payload, batch);
+        });
+    payload.clear();
+    encodeTraces(payload, batch);
+    size_t v0_3_size = payload.size();
+    payload.clear();
+    string_table_encoder.encode(payload, batch);
+    std::printf("payload of 100 Traces, 10 spans each: %zu bytes for v0.3, %zu bytes for v0.5\n",
+                v0_3_size, payload.size());
+  }
+
+  return 0;
+}
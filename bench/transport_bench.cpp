@@ -0,0 +1,80 @@
+// Benchmarks the cost of each flush to the agent in the transport alone: CurlHandle sending a
+// typical payload to a stand-in agent on localhost, with the connection kept open (as the writer
+// does) and, for comparison, with a new connection for every request. The agent runs in this
+// process, so its allocations are counted too; setting the per-request header is measured on its
+// own.
+//
+// Usage: transport_bench [iterations] [name filter]
+#include "../src/transport.h"
+#include "../test/stub_agent.h"
+#include "bench.h"
+
+#include <cstdio>
+
+using namespace datadog::opentracing;
+using namespace datadog::opentracing::bench;
+
+namespace {
+
+// Sets a handle up the way that AgentWriter does.
+std::unique_ptr<CurlHandle> makeHandle(const std::string &url, const std::string &body) {
+  std::unique_ptr<CurlHandle> handle{new CurlHandle{}};
+  handle->setopt(CURLOPT_URL, url.c_str());
+  handle->setopt(CURLOPT_TIMEOUT_MS, 2000L);
+  handle->setHeaders({{"Content-Type", "application/msgpack"},
+                      {"Datadog-Meta-Lang", "cpp"},
+                      {"Datadog-Meta-Tracer-Version", "bench"}});
+  handle->setopt(CURLOPT_POSTFIELDSIZE, long(body.size()));
+  handle->setopt(CURLOPT_POSTFIELDS, body.data());
+  return handle;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  uint64_t iterations = 2000;
+  std::string filter;
+  if (!parseArgs(argc, argv, iterations, filter)) {
+    std::fprintf(stderr, "usage: %s [iterations] [name filter]\n", argv[0]);
+    return 1;
+  }
+
+  StubAgent agent;
+  std::string url = "http://127.0.0.1:" + std::to_string(agent.port()) + "/v0.3/traces";
+  // The size of a typical flush. The agent doesn't need to decode it.
+  std::string body(16 * 1024, '\x90');
+  const std::string trace_count_header = "X-Datadog-Trace-Count";
+
+  printHeader();
+  if (std::string("CurlHandle::setHeader(trace count)").find(filter) != std::string::npos) {
+    auto handle = makeHandle(url, body);
+    report(measure("CurlHandle::setHeader(trace count)", iterations * 100, [&](uint64_t i) {
+      handle->setHeader(trace_count_header, std::to_string(i % 100 + 1));
+    }));
+  }
+
+  auto run = [&](const std::string &name, CurlHandle &handle) {
+    if (name.find(filter) == std::string::npos) {
+      return;
+    }
+    uint64_t connections_before = agent.connections();
+    report(measure(name, iterations, [&](uint64_t i) {
+      handle.setHeader(trace_count_header, std::to_string(i % 100 + 1));
+      if (handle.perform() != CURLE_OK) {
+        std::fprintf(stderr, "request failed: %s\n", handle.getError().c_str());
+        std::exit(1);
+      }
+    }));
+    std::printf("  connections opened: %llu\n",
+                static_cast<unsigned long long>(agent.connections() - connections_before));
+  };
+
+  auto kept_alive = makeHandle(url, body);
+  run("CurlHandle::perform(16KB, kept-alive connection)", *kept_alive);
+
+  auto reconnecting = makeHandle(url, body);
+  reconnecting->setopt(CURLOPT_FORBID_REUSE, 1L);
+  run("CurlHandle::perform(16KB, new connection)", *reconnecting);
+
+  return 0;
+}
@@ -30,10 +30,127 @@ struct TracerOptions {
   // If not empty, the given string overrides the operation name (and the overridden operation name
   // is recorded in the tag "operation").
   std::string operation_name_override = "";
+  // Number of shards that unfinished traces are split between. Each shard has its own lock, so
+  // more shards means less contention between threads finishing spans. 0 picks a number based on
+  // the number of CPUs.
+  uint32_t span_buffer_shards = 0;
+  // If not 0, the finished spans of a trace are sent once there are this many of them, even if
+  // the trace has unfinished spans. Bounds the memory used by very large traces.
+  uint64_t partial_flush_min_spans = 0;
+  // If not 0, the finished spans of a trace are sent once the trace has been unfinished for this
+  // long, in ms (and then again each time this long passes). Bounds the memory used by
+  // long-running traces.
+  int64_t partial_flush_max_age_ms = 0;
+  // If not 0, traces that are still unfinished this long after they started, in ms, are expired.
+  // Stops a span that is never finished (eg. leaked) from keeping its trace in memory forever.
+  int64_t pending_trace_ttl_ms = 0;
+  // If true, the finished spans of an expired trace are sent, as are its spans that finish later.
+  // Otherwise they are dropped.
+  bool flush_expired_traces = true;
+  // The version of the agent's traces endpoint to send to, "v0.3" or "v0.5". v0.5 payloads don't
+  // repeat strings, so are much smaller, but need a newer agent. If the agent doesn't support
+  // v0.5, v0.3 is used instead.
+  std::string agent_api_version = "v0.3";
+  // If not 0, payloads sent to the agent are compressed with gzip, at this zlib compression level
+  // (1 is fastest, 9 is smallest). Uses less network, at the cost of CPU on the writer's thread.
+  int32_t payload_compression_level = 0;
+  // Payloads smaller than this many bytes aren't compressed.
+  uint64_t payload_compression_min_bytes = 1024;
+  // If not empty, the path of a Unix domain socket on which the agent listens. Traces are sent
+  // there instead of to agent_host and agent_port.
+  std::string agent_socket_path = "";
+  // How many requests to the agent may be in progress at once. If more than 1, requests don't
+  // block the writer's thread, so a slow agent doesn't hold up sending later traces.
+  uint32_t agent_max_concurrent_requests = 1;
+  // If not 0, traces are split into payloads of at most this many bytes (before compression), so
+  // that the agent doesn't reject them for being too big. The agent's default limit is 10MiB.
+  uint64_t payload_max_bytes = 0;
+  // If not empty, payloads that can't be sent to the agent are kept in this directory, and sent
+  // once the agent is back (even by a later process). Only one tracer uses a directory at a time,
+  // so if several processes share the configuration (eg. nginx workers), only the first spills.
+  std::string spill_directory = "";
+  // The most disk space that payloads kept in spill_directory may take up. The oldest are deleted
+  // to make room for new ones.
+  uint64_t spill_max_bytes = 64 * 1024 * 1024;
+  // If not 0, traces that are waiting to be sent may take up about this many bytes of memory at
+  // most. Beyond that, unfinished traces are sent in parts and new traces are dropped.
+  uint64_t memory_budget_bytes = 0;
+  // If more than 0, and the process's cgroup has a memory limit, the memory budget is this
+  // fraction of the limit instead (eg. 0.05 for 5%).
+  double memory_budget_cgroup_fraction = 0;
+  // If not 0, after this many requests to the agent fail in a row, traces are dropped without
+  // being encoded until the agent (which is probed with backoff) can be reached again.
+  uint32_t agent_circuit_breaker_failures = 0;
+  // If true, fewer new traces are started while the writer can't keep up with them (its queue is
+  // filling up, or traces are being dropped), and the sample rate recovers once it can.
+  bool load_shedding = false;
+  // If not 0, traces waiting to be sent are sent as soon as they have this many spans between
+  // them, or take up about this many bytes, rather than at the end of the write period. Keeps
+  // the memory they use, and the size of payloads, bounded when there are a lot of traces.
+  uint64_t write_threshold_spans = 0;
+  uint64_t write_threshold_bytes = 0;
+  // Which traces are dropped when more are waiting to be sent than there's room for:
+  // "drop_newest" (the new ones), "drop_oldest", or "priority" (traces without errors make room
+  // for traces with them, or that are tagged to be kept).
+  std::string queue_drop_policy = "drop_newest";
+};
+
+// What a tracer has done since it was made, for monitoring the tracer itself. Everything but
+// pending_traces, queued_traces and agent_circuit_breaker_open only ever goes up. The counts may
+// be a little behind while spans are being started and finished.
+struct TracerTelemetry {
+  // Spans started, including those that weren't recorded because their trace was sampled out
+  // (or shed, while the tracer couldn't keep up).
+  uint64_t spans_started = 0;
+  uint64_t spans_sampled_out = 0;
+  // Recorded spans that have finished.
+  uint64_t spans_finished = 0;
+  // Traces whose spans had all finished when they were sent, and traces that were expired with
+  // spans still unfinished (see pending_trace_ttl_ms).
+  uint64_t traces_completed = 0;
+  uint64_t traces_expired = 0;
+  // Traces with unfinished spans.
+  uint64_t pending_traces = 0;
+  // Traces waiting to be sent to the agent.
+  uint64_t queued_traces = 0;
+  // Traces dropped rather than sent: new traces that there wasn't room for in the queue or the
+  // memory budget, queued traces dropped to make room for others (see queue_drop_policy), and
+  // traces dropped while the agent was down (see agent_circuit_breaker_failures).
+  uint64_t traces_dropped_queue_full = 0;
+  uint64_t traces_dropped_memory_budget = 0;
+  uint64_t traces_evicted_oldest = 0;
+  uint64_t traces_evicted_low_priority = 0;
+  uint64_t traces_dropped_agent_down = 0;
+  // Whether traces are being dropped because the agent is down (see
+  // agent_circuit_breaker_failures), and how many times that has started.
+  bool agent_circuit_breaker_open = false;
+  uint64_t agent_circuit_breaker_times_opened = 0;
+  // Bytes of payloads encoded, before compression.
+  uint64_t bytes_encoded = 0;
+  // Payloads that were gzipped (see payload_compression_level), and that were sent uncompressed
+  // since they were too small. The bytes of the gzipped payloads before and after compression,
+  // and the CPU time spent compressing them, in nanoseconds.
+  uint64_t payloads_compressed = 0;
+  uint64_t payloads_compression_skipped = 0;
+  uint64_t compression_input_bytes = 0;
+  uint64_t compression_output_bytes = 0;
+  uint64_t compression_time_ns = 0;
+  // Requests to the agent that succeeded and failed, and how many of them were retries.
+  uint64_t posts_succeeded = 0;
+  uint64_t posts_failed = 0;
+  uint64_t post_retries = 0;
+  // Time spent encoding (and compressing) payloads, and waiting for the agent to respond to them,
+  // in nanoseconds.
+  uint64_t encode_time_ns = 0;
+  uint64_t post_time_ns = 0;
 };
 
 std::shared_ptr<ot::Tracer> makeTracer(const TracerOptions &options);
 
+// Returns what the given tracer has done so far. Cheap enough to call on every scrape of a metrics
+// endpoint. Everything is 0 unless the tracer was made by makeTracer (or the tracer factory).
+TracerTelemetry snapshot(const ot::Tracer &tracer);
+
 }  // namespace opentracing
 }  // namespace datadog
 
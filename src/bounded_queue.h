@@ -0,0 +1,117 @@
+#ifndef DD_OPENTRACING_BOUNDED_QUEUE_H
+#define DD_OPENTRACING_BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace datadog {
+namespace opentracing {
+
+// A fixed-capacity FIFO queue that can be used from multiple threads without locks. Any number of
+// threads may push and pop concurrently. Push and pop never block; they fail instead if the queue
+// is full or empty.
+//
+// This is Dmitry Vyukov's bounded MPMC queue: each cell has a sequence number that tells
+// producers and consumers whether it's their turn to use it, so the only contended operation is
+// a compare-and-swap on the enqueue (or dequeue) position.
+// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity), cells_(new Cell[capacity]) {
+    for (size_t i = 0; i < capacity_; i++) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // Adds the item to the back of the queue. Returns false, and leaves the item alone, if the queue
+  // is full.
+  bool push(T &&item) {
+    if (capacity_ == 0) {
+      return false;
+    }
+    size_t position = enqueue_position_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[position % capacity_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      if (sequence == position) {
+        // The cell is free, try to claim it.
+        if (enqueue_position_.compare_exchange_weak(position, position + 1,
+                                                    std::memory_order_relaxed)) {
+          cell.value = std::move(item);
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+        // Another producer claimed it, position now has the new enqueue position.
+      } else if (sequence < position) {
+        return false;  // The cell hasn't been consumed since the last time round, so we're full.
+      } else {
+        position = enqueue_position_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Removes the item at the front of the queue, moving it into item. Returns false if the queue is
+  // empty.
+  bool pop(T &item) {
+    if (capacity_ == 0) {
+      return false;
+    }
+    size_t position = dequeue_position_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[position % capacity_];
+      size_t sequence = cell.sequence.load(std::memory_order_acquire);
+      if (sequence == position + 1) {
+        // The cell has been filled, try to claim it.
+        if (dequeue_position_.compare_exchange_weak(position, position + 1,
+                                                    std::memory_order_relaxed)) {
+          item = std::move(cell.value);
+          cell.value = T{};
+          // Free for the producer that's next round.
+          cell.sequence.store(position + capacity_, std::memory_order_release);
+          return true;
+        }
+      } else if (sequence < position + 1) {
+        return false;  // Empty.
+      } else {
+        position = dequeue_position_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  // The number of items in the queue. Only approximate while other threads are using the queue.
+  size_t size() const {
+    size_t enqueued = enqueue_position_.load(std::memory_order_relaxed);
+    size_t dequeued = dequeue_position_.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+ private:
+  // Assumed size of a cache line.
+  static const size_t cache_line_size = 64;
+
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  const size_t capacity_;
+  std::unique_ptr<Cell[]> cells_;
+  // The positions are padded so that producers and consumers don't share a cache line.
+  char padding0_[cache_line_size];
+  std::atomic<size_t> enqueue_position_{0};
+  char padding1_[cache_line_size];
+  std::atomic<size_t> dequeue_position_{0};
+  char padding2_[cache_line_size];
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_BOUNDED_QUEUE_H
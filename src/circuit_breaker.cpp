@@ -0,0 +1,55 @@
+#include "circuit_breaker.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace datadog {
+namespace opentracing {
+
+void CircuitBreaker::recordSuccess() {
+  consecutive_failures_ = 0;
+  if (state_.exchange(CircuitBreakerState::closed) != CircuitBreakerState::closed) {
+    std::cerr << "Agent is reachable again, sending traces" << std::endl;
+  }
+}
+
+void CircuitBreaker::recordFailure(std::chrono::steady_clock::time_point now) {
+  switch (state_.load()) {
+    case CircuitBreakerState::closed:
+      if (options_.failure_threshold == 0 ||
+          ++consecutive_failures_ < options_.failure_threshold) {
+        return;
+      }
+      probe_interval_ = options_.min_probe_interval;
+      times_opened_++;
+      std::cerr << "Agent is unreachable after " << consecutive_failures_
+                << " failed requests, dropping traces until it's back" << std::endl;
+      break;
+    case CircuitBreakerState::half_open:
+      probe_interval_ = std::min(probe_interval_ * 2, options_.max_probe_interval);
+      break;
+    case CircuitBreakerState::open:
+      return;  // A request from before it opened.
+  }
+  next_probe_ = now + probe_interval_;
+  state_ = CircuitBreakerState::open;
+}
+
+bool CircuitBreaker::startProbe(std::chrono::steady_clock::time_point now) {
+  if (state_.load() != CircuitBreakerState::open || now < next_probe_) {
+    return false;
+  }
+  state_ = CircuitBreakerState::half_open;
+  return true;
+}
+
+CircuitBreakerStats CircuitBreaker::stats() const {
+  CircuitBreakerStats stats;
+  stats.state = state_;
+  stats.times_opened = times_opened_;
+  stats.dropped_traces = dropped_traces_;
+  return stats;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,78 @@
+#ifndef DD_OPENTRACING_CIRCUIT_BREAKER_H
+#define DD_OPENTRACING_CIRCUIT_BREAKER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace datadog {
+namespace opentracing {
+
+struct CircuitBreakerOptions {
+  // After this many requests to the agent fail in a row, the breaker opens. 0 means it never does.
+  size_t failure_threshold = 0;
+  // While it's open, the agent is probed after this long, and then after twice as long each time
+  // a probe fails, up to max_probe_interval.
+  std::chrono::milliseconds min_probe_interval{1000};
+  std::chrono::milliseconds max_probe_interval{60000};
+};
+
+enum class CircuitBreakerState {
+  // Traces are sent.
+  closed,
+  // The agent is down, traces are dropped.
+  open,
+  // The agent is down, traces are dropped, and a probe is being sent to see if it's back.
+  half_open
+};
+
+// What a CircuitBreaker is doing, and has done.
+struct CircuitBreakerStats {
+  CircuitBreakerState state = CircuitBreakerState::closed;
+  // How many times it has opened.
+  uint64_t times_opened = 0;
+  // Traces dropped while it was open.
+  uint64_t dropped_traces = 0;
+};
+
+// Keeps track of whether the agent is reachable, so that while it isn't, traces are dropped
+// without the cost of encoding and retrying them. After enough consecutive failures the breaker
+// opens; while open, the agent is probed on a backoff schedule, and the breaker closes as soon as
+// any request succeeds.
+//
+// Only isOpen(), recordDroppedTraces() and stats() may be called from more than one thread.
+class CircuitBreaker {
+ public:
+  explicit CircuitBreaker(CircuitBreakerOptions options) : options_(options) {}
+
+  bool isOpen() const {
+    return state_.load(std::memory_order_relaxed) != CircuitBreakerState::closed;
+  }
+
+  void recordSuccess();
+  void recordFailure(std::chrono::steady_clock::time_point now);
+  void recordDroppedTraces(size_t num_traces) { dropped_traces_ += num_traces; }
+
+  // If the breaker is open and it's time to probe the agent, goes half-open and returns true. The
+  // probe's result must then be recorded.
+  bool startProbe(std::chrono::steady_clock::time_point now);
+  // When the next probe is due, if the breaker is open.
+  std::chrono::steady_clock::time_point nextProbe() const { return next_probe_; }
+
+  CircuitBreakerStats stats() const;
+
+ private:
+  const CircuitBreakerOptions options_;
+  std::atomic<CircuitBreakerState> state_{CircuitBreakerState::closed};
+  size_t consecutive_failures_ = 0;
+  std::chrono::milliseconds probe_interval_{0};
+  std::chrono::steady_clock::time_point next_probe_;
+  std::atomic<uint64_t> times_opened_{0};
+  std::atomic<uint64_t> dropped_traces_{0};
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_CIRCUIT_BREAKER_H
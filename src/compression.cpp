@@ -0,0 +1,87 @@
+#include "compression.h"
+
+#include <time.h>
+#include <zlib.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// Adding 16 to the maximum window bits makes zlib write a gzip header and trailer, rather than a
+// zlib one.
+const int gzip_window_bits = 15 + 16;
+const int default_mem_level = 8;
+
+int64_t threadCpuTime() {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+}  // namespace
+
+GzipCompressor::GzipCompressor(CompressionOptions options) : options_(options) {
+  if (!enabled()) {
+    return;
+  }
+  if (options_.level < 1 || options_.level > 9) {
+    throw std::runtime_error("Compression level must be from 1 to 9, or 0 to disable compression");
+  }
+  stream_.reset(new z_stream{});
+  int result = deflateInit2(stream_.get(), options_.level, Z_DEFLATED, gzip_window_bits,
+                            default_mem_level, Z_DEFAULT_STRATEGY);
+  if (result != Z_OK) {
+    stream_.reset();
+    throw std::runtime_error(std::string("Unable to set up zlib: ") + zError(result));
+  }
+}
+
+GzipCompressor::~GzipCompressor() {
+  if (stream_ != nullptr) {
+    deflateEnd(stream_.get());
+  }
+}
+
+bool GzipCompressor::compress(const PayloadBuffer &payload, PayloadBuffer &output) {
+  if (!enabled() || payload.size() < options_.min_size) {
+    skipped_payloads_++;
+    return false;
+  }
+  auto cpu_start = threadCpuTime();
+  deflateReset(stream_.get());
+  // There's always room for the whole output, so a single call does it all.
+  size_t bound = deflateBound(stream_.get(), uLong(payload.size()));
+  output.clear();
+  char *out = output.append(bound);
+  stream_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(payload.data()));
+  stream_->avail_in = uInt(payload.size());
+  stream_->next_out = reinterpret_cast<Bytef *>(out);
+  stream_->avail_out = uInt(bound);
+  int result = deflate(stream_.get(), Z_FINISH);
+  cpu_time_ns_ += threadCpuTime() - cpu_start;
+  if (result != Z_STREAM_END) {
+    std::cerr << "Unable to compress traces: " << zError(result) << std::endl;
+    skipped_payloads_++;
+    return false;
+  }
+  output.truncate(stream_->total_out);
+  compressed_payloads_++;
+  input_bytes_ += payload.size();
+  output_bytes_ += output.size();
+  return true;
+}
+
+CompressionStats GzipCompressor::stats() const {
+  CompressionStats stats;
+  stats.compressed_payloads = compressed_payloads_;
+  stats.skipped_payloads = skipped_payloads_;
+  stats.input_bytes = input_bytes_;
+  stats.output_bytes = output_bytes_;
+  stats.cpu_time = std::chrono::nanoseconds(cpu_time_ns_);
+  return stats;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
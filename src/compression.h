@@ -0,0 +1,74 @@
+#ifndef DD_OPENTRACING_COMPRESSION_H
+#define DD_OPENTRACING_COMPRESSION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "payload_buffer.h"
+
+struct z_stream_s;
+
+namespace datadog {
+namespace opentracing {
+
+// Options for compressing request bodies.
+struct CompressionOptions {
+  // The zlib compression level, from 1 (fastest) to 9 (smallest). 0 disables compression.
+  int level = 0;
+  // Payloads smaller than this many bytes aren't compressed, since it barely makes them smaller.
+  size_t min_size = 1024;
+};
+
+// What a GzipCompressor has done, so that its cost can be weighed against the bytes saved.
+struct CompressionStats {
+  // Payloads that were compressed, and that were sent uncompressed (because they were too small,
+  // or compression failed).
+  uint64_t compressed_payloads = 0;
+  uint64_t skipped_payloads = 0;
+  // The size of the compressed payloads before and after compression.
+  uint64_t input_bytes = 0;
+  uint64_t output_bytes = 0;
+  // CPU time spent compressing.
+  std::chrono::nanoseconds cpu_time{0};
+
+  // output_bytes / input_bytes, or 1 if nothing has been compressed.
+  double ratio() const { return input_bytes == 0 ? 1.0 : double(output_bytes) / input_bytes; }
+};
+
+// Compresses payloads to gzip, the format used for HTTP's "Content-Encoding: gzip". The zlib state
+// is kept and reused for each payload.
+//
+// Only stats() may be called from more than one thread.
+class GzipCompressor {
+ public:
+  // Throws runtime_error if compression is enabled but zlib can't be set up.
+  explicit GzipCompressor(CompressionOptions options);
+  ~GzipCompressor();
+
+  GzipCompressor(const GzipCompressor &) = delete;
+  GzipCompressor &operator=(const GzipCompressor &) = delete;
+
+  bool enabled() const { return options_.level != 0; }
+
+  // Replaces the contents of output with the compressed payload, and returns true. Returns false
+  // (leaving output in an unspecified state) if the payload should be sent uncompressed instead.
+  bool compress(const PayloadBuffer &payload, PayloadBuffer &output);
+
+  CompressionStats stats() const;
+
+ private:
+  const CompressionOptions options_;
+  std::unique_ptr<z_stream_s> stream_;
+
+  std::atomic<uint64_t> compressed_payloads_{0};
+  std::atomic<uint64_t> skipped_payloads_{0};
+  std::atomic<uint64_t> input_bytes_{0};
+  std::atomic<uint64_t> output_bytes_{0};
+  std::atomic<int64_t> cpu_time_ns_{0};
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_COMPRESSION_H
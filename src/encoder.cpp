@@ -0,0 +1,309 @@
+#include "encoder.h"
+
+#include <cstring>
+#include <limits>
+#include <utility>
+#include "span.h"
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+
+// A map key, encoded as a msgpack fixstr: the header byte followed by the characters.
+template <size_t N>
+struct EncodedKey {
+  char bytes[N];
+};
+
+template <size_t N, size_t... I>
+constexpr EncodedKey<N> encodeKey(const char (&key)[N], std::index_sequence<I...>) {
+  return {{char(0xa0 | (N - 1)), key[I]...}};
+}
+
+// Encodes a string literal, without its null terminator.
+template <size_t N>
+constexpr EncodedKey<N> encodeKey(const char (&key)[N]) {
+  static_assert(N - 1 < 32, "Key too long for a fixstr");
+  return encodeKey(key, std::make_index_sequence<N - 1>{});
+}
+
+constexpr auto name_key = encodeKey("name");
+constexpr auto service_key = encodeKey("service");
+constexpr auto resource_key = encodeKey("resource");
+constexpr auto type_key = encodeKey("type");
+constexpr auto start_key = encodeKey("start");
+constexpr auto duration_key = encodeKey("duration");
+constexpr auto meta_key = encodeKey("meta");
+constexpr auto span_id_key = encodeKey("span_id");
+constexpr auto trace_id_key = encodeKey("trace_id");
+constexpr auto parent_id_key = encodeKey("parent_id");
+constexpr auto error_key = encodeKey("error");
+
+// Number of fields in a span encoded for /v0.3 and /v0.5.
+constexpr uint8_t span_fields = 11;
+constexpr uint8_t string_table_span_fields = 12;
+
+// msgpack type bytes.
+constexpr uint8_t fixmap = 0x80;
+constexpr uint8_t fixarray = 0x90;
+constexpr uint8_t fixstr = 0xa0;
+constexpr uint8_t str8 = 0xd9;
+constexpr uint8_t str16 = 0xda;
+constexpr uint8_t str32 = 0xdb;
+constexpr uint8_t array16 = 0xdc;
+constexpr uint8_t array32 = 0xdd;
+constexpr uint8_t map16 = 0xde;
+constexpr uint8_t map32 = 0xdf;
+constexpr uint8_t uint32 = 0xce;
+constexpr uint8_t uint64 = 0xcf;
+constexpr uint8_t int32 = 0xd2;
+constexpr uint8_t int64 = 0xd3;
+
+// Writes value big-endian, as msgpack requires, returning the position after it.
+template <class T>
+char *writeBigEndian(char *out, T value) {
+  for (size_t i = sizeof(T); i-- > 0;) {
+    out[i] = char(uint8_t(value));
+    value = T(uint64_t(value) >> 8);
+  }
+  return out + sizeof(T);
+}
+
+template <size_t N>
+char *writeKey(char *out, const EncodedKey<N> &key) {
+  std::memcpy(out, key.bytes, N);
+  return out + N;
+}
+
+// The size of the header of a str, array or map with the given number of elements.
+size_t strHeaderSize(size_t size) {
+  return size < 32 ? 1 : size < 0x100 ? 2 : size < 0x10000 ? 3 : 5;
+}
+size_t containerHeaderSize(size_t size) { return size < 16 ? 1 : size < 0x10000 ? 3 : 5; }
+
+char *writeStrHeader(char *out, size_t size) {
+  if (size < 32) {
+    *out = char(fixstr | size);
+    return out + 1;
+  } else if (size < 0x100) {
+    *out = char(str8);
+    return writeBigEndian(out + 1, uint8_t(size));
+  } else if (size < 0x10000) {
+    *out = char(str16);
+    return writeBigEndian(out + 1, uint16_t(size));
+  }
+  *out = char(str32);
+  return writeBigEndian(out + 1, uint32_t(size));
+}
+
+char *writeContainerHeader(char *out, size_t size, uint8_t fix, uint8_t type16, uint8_t type32) {
+  if (size < 16) {
+    *out = char(fix | size);
+    return out + 1;
+  } else if (size < 0x10000) {
+    *out = char(type16);
+    return writeBigEndian(out + 1, uint16_t(size));
+  }
+  *out = char(type32);
+  return writeBigEndian(out + 1, uint32_t(size));
+}
+
+char *writeStr(char *out, const std::string &value) {
+  out = writeStrHeader(out, value.size());
+  std::memcpy(out, value.data(), value.size());
+  return out + value.size();
+}
+
+size_t strSize(const std::string &value) { return strHeaderSize(value.size()) + value.size(); }
+
+void encodeArrayHeader(PayloadBuffer &payload, size_t size) {
+  writeContainerHeader(payload.append(containerHeaderSize(size)), size, fixarray, array16,
+                       array32);
+}
+
+template <size_t N>
+void encodeField(PayloadBuffer &payload, const EncodedKey<N> &key, const std::string &value) {
+  writeStr(writeKey(payload.append(N + strSize(value)), key), value);
+}
+
+template <size_t N, class T>
+void encodeField(PayloadBuffer &payload, const EncodedKey<N> &key, uint8_t type, T value) {
+  char *out = writeKey(payload.append(N + 1 + sizeof(T)), key);
+  *out = char(type);
+  writeBigEndian(out + 1, value);
+}
+
+template <class T>
+char *writeInt(char *out, uint8_t type, T value) {
+  *out = char(type);
+  return writeBigEndian(out + 1, value);
+}
+
+void encodeMeta(PayloadBuffer &payload, const std::unordered_map<std::string, std::string> &meta) {
+  writeContainerHeader(
+      writeKey(payload.append(sizeof(meta_key.bytes) + containerHeaderSize(meta.size())),
+               meta_key),
+      meta.size(), fixmap, map16, map32);
+  for (auto &tag : meta) {
+    char *out = payload.append(strSize(tag.first) + strSize(tag.second));
+    writeStr(writeStr(out, tag.first), tag.second);
+  }
+}
+
+// Fields are in the same order as SpanData's MSGPACK_DEFINE_MAP.
+void encodeSpan(PayloadBuffer &payload, const SpanData &span) {
+  *payload.append(1) = char(fixmap | span_fields);
+  encodeField(payload, name_key, span.name);
+  encodeField(payload, service_key, span.service);
+  encodeField(payload, resource_key, span.resource);
+  encodeField(payload, type_key, span.type);
+  encodeField(payload, start_key, int64, span.start);
+  encodeField(payload, duration_key, int64, span.duration);
+  encodeMeta(payload, span.meta);
+  encodeField(payload, span_id_key, uint64, span.span_id);
+  encodeField(payload, trace_id_key, uint64, span.trace_id);
+  encodeField(payload, parent_id_key, uint64, span.parent_id);
+  encodeField(payload, error_key, int32, span.error);
+}
+
+// The number of bytes encodeSpan appends.
+size_t encodedSize(const SpanData &span) {
+  size_t size = 1 + sizeof(name_key.bytes) + strSize(span.name) + sizeof(service_key.bytes) +
+                strSize(span.service) + sizeof(resource_key.bytes) + strSize(span.resource) +
+                sizeof(type_key.bytes) + strSize(span.type) + sizeof(start_key.bytes) + 9 +
+                sizeof(duration_key.bytes) + 9 + sizeof(meta_key.bytes) +
+                containerHeaderSize(span.meta.size()) + sizeof(span_id_key.bytes) + 9 +
+                sizeof(trace_id_key.bytes) + 9 + sizeof(parent_id_key.bytes) + 9 +
+                sizeof(error_key.bytes) + 5;
+  for (auto &tag : span.meta) {
+    size += strSize(tag.first) + strSize(tag.second);
+  }
+  return size;
+}
+
+const std::string empty_string;
+
+const size_t no_max_size = std::numeric_limits<size_t>::max();
+
+}  // namespace
+
+void encodeTraces(PayloadBuffer &payload, const std::vector<Trace> &traces) {
+  encodeTraces(payload, traces, 0, no_max_size);
+}
+
+size_t encodeTraces(PayloadBuffer &payload, const std::vector<Trace> &traces, size_t begin,
+                    size_t max_size) {
+  // Every size is known up front, so find where to stop before encoding anything.
+  size_t end = begin < traces.size() ? traces.size() : begin;
+  if (max_size != no_max_size) {
+    size_t size = 0;  // Without the header, which depends on how many traces there are.
+    for (end = begin; end < traces.size(); end++) {
+      size_t trace_size = containerHeaderSize(traces[end]->size());
+      for (auto &span : *traces[end]) {
+        trace_size += encodedSize(*span);
+      }
+      if (end > begin && containerHeaderSize(end + 1 - begin) + size + trace_size > max_size) {
+        break;
+      }
+      size += trace_size;
+    }
+  }
+  encodeArrayHeader(payload, end - begin);
+  for (size_t i = begin; i < end; i++) {
+    encodeArrayHeader(payload, traces[i]->size());
+    for (auto &span : *traces[i]) {
+      encodeSpan(payload, *span);
+    }
+  }
+  return end;
+}
+
+void StringTableEncoder::encode(PayloadBuffer &payload, const std::vector<Trace> &traces) {
+  encode(payload, traces, 0, no_max_size);
+}
+
+size_t StringTableEncoder::encode(PayloadBuffer &payload, const std::vector<Trace> &traces,
+                                  size_t begin, size_t max_size) {
+  spans_.clear();
+  strings_.clear();
+  strings_size_ = 0;
+  indices_.clear();
+  index(empty_string);  // Always first.
+
+  // The size of a trace's strings depends on what's already in the table, so each trace is
+  // encoded before it's known whether it fits. If it doesn't, it's taken out again.
+  size_t end = begin;
+  for (; end < traces.size(); end++) {
+    auto &trace = traces[end];
+    size_t spans_size = spans_.size();
+    size_t num_strings = strings_.size();
+    encodeArrayHeader(spans_, trace->size());
+    for (auto &span : *trace) {
+      // Everything but meta has a fixed size: the strings are all indices.
+      char *out = spans_.append(1 + 5 * 3 + 9 * 3 + 9 * 2 + 5);
+      *out++ = char(fixarray | string_table_span_fields);
+      out = writeInt(out, uint32, index(span->service));
+      out = writeInt(out, uint32, index(span->name));
+      out = writeInt(out, uint32, index(span->resource));
+      out = writeInt(out, uint64, span->trace_id);
+      out = writeInt(out, uint64, span->span_id);
+      out = writeInt(out, uint64, span->parent_id);
+      out = writeInt(out, int64, span->start);
+      out = writeInt(out, int64, span->duration);
+      writeInt(out, int32, span->error);
+      writeContainerHeader(spans_.append(containerHeaderSize(span->meta.size())),
+                           span->meta.size(), fixmap, map16, map32);
+      for (auto &tag : span->meta) {
+        out = writeInt(spans_.append(10), uint32, index(tag.first));
+        writeInt(out, uint32, index(tag.second));
+      }
+      out = spans_.append(1 + 5);
+      *out++ = char(fixmap);  // No metrics.
+      writeInt(out, uint32, index(span->type));
+    }
+    if (end > begin && 1 + containerHeaderSize(strings_.size()) + strings_size_ +
+                               containerHeaderSize(end + 1 - begin) + spans_.size() >
+                           max_size) {
+      spans_.truncate(spans_size);
+      truncateTable(num_strings);
+      break;
+    }
+  }
+
+  *payload.append(1) = char(fixarray | 2);
+  encodeArrayHeader(payload, strings_.size());
+  for (auto string : strings_) {
+    writeStr(payload.append(strSize(*string)), *string);
+  }
+  encodeArrayHeader(payload, end - begin);
+  payload.write(spans_.data(), spans_.size());
+  // Don't keep pointers into the traces.
+  strings_.clear();
+  indices_.clear();
+  return end;
+}
+
+uint32_t StringTableEncoder::index(const std::string &value) {
+  // Most strings are repeats, so look before inserting (which allocates).
+  auto existing = indices_.find(&value);
+  if (existing != indices_.end()) {
+    return existing->second;
+  }
+  uint32_t index = uint32_t(strings_.size());
+  indices_.emplace(&value, index);
+  strings_.push_back(&value);
+  strings_size_ += strSize(value);
+  return index;
+}
+
+void StringTableEncoder::truncateTable(size_t size) {
+  for (size_t i = size; i < strings_.size(); i++) {
+    indices_.erase(strings_[i]);
+    strings_size_ -= strSize(*strings_[i]);
+  }
+  strings_.resize(size);
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,77 @@
+#ifndef DD_OPENTRACING_ENCODER_H
+#define DD_OPENTRACING_ENCODER_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "payload_buffer.h"
+
+namespace datadog {
+namespace opentracing {
+
+struct SpanData;
+using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
+
+// Appends the traces to the payload as msgpack, in the form the agent's /v0.3/traces endpoint
+// accepts: an array of traces, each an array of spans, each a map of the fields in SpanData.
+//
+// Decodes to the same objects as msgpack::pack(payload, traces), but is written specifically for
+// SpanData: the keys are encoded at compile time, integers always use their fixed-width forms (so
+// their size is known without inspecting them) and each value takes a single bounds check on the
+// payload. This means the bytes aren't identical to msgpack::pack's, which uses the smallest
+// form of each integer.
+void encodeTraces(PayloadBuffer &payload, const std::vector<Trace> &traces);
+
+// Appends as many of the traces, starting from traces[begin], as fit in max_size bytes: at least
+// one, even if it doesn't fit on its own. Returns the index after the last trace appended.
+size_t encodeTraces(PayloadBuffer &payload, const std::vector<Trace> &traces, size_t begin,
+                    size_t max_size);
+
+// Encodes traces in the form the agent's /v0.5/traces endpoint accepts. Each string is written
+// once, to a table at the start of the payload, and spans refer to strings by their index in it.
+// Since the service, name, type and tag keys mostly repeat from span to span, this is much
+// smaller than the /v0.3 encoding.
+//
+// The payload is an array of the string table (an array of strings, of which the first is always
+// "") and the traces. Each span is an array of: service, name, resource, trace_id, span_id,
+// parent_id, start, duration, error, meta (string index to string index), metrics (always empty)
+// and type. Like encodeTraces, integers use their fixed-width forms.
+//
+// Keeps its working memory between payloads, so should be reused.
+class StringTableEncoder {
+ public:
+  // Appends the traces to the payload. The traces must not change while this runs.
+  void encode(PayloadBuffer &payload, const std::vector<Trace> &traces);
+
+  // Appends as many of the traces, starting from traces[begin], as fit in max_size bytes: at
+  // least one, even if it doesn't fit on its own. Returns the index after the last trace appended.
+  size_t encode(PayloadBuffer &payload, const std::vector<Trace> &traces, size_t begin,
+                size_t max_size);
+
+ private:
+  uint32_t index(const std::string &value);
+  // Removes the strings after the first size from the table.
+  void truncateTable(size_t size);
+
+  struct Hash {
+    size_t operator()(const std::string *value) const { return std::hash<std::string>{}(*value); }
+  };
+  struct Equal {
+    bool operator()(const std::string *a, const std::string *b) const { return *a == *b; }
+  };
+
+  // The traces, which are encoded before the string table is complete.
+  PayloadBuffer spans_;
+  // The strings of the payload's table, pointing to strings in the traces being encoded.
+  std::vector<const std::string *> strings_;
+  // The encoded size of the strings.
+  size_t strings_size_ = 0;
+  std::unordered_map<const std::string *, uint32_t, Hash, Equal> indices_;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_ENCODER_H
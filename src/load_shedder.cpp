@@ -0,0 +1,42 @@
+#include "load_shedder.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// Not the constant that ConstantRateSampler hashes trace ids with, so that which traces are shed
+// doesn't depend on which were sampled.
+const uint64_t keep_hash_factor = 0x9E3779B97F4A7C15ULL;
+}  // namespace
+
+void LoadShedder::update(double fill_ratio, uint64_t written_traces, uint64_t dropped_traces) {
+  double saturation = fill_ratio;
+  if (written_traces > 0) {
+    saturation = std::max(saturation, double(dropped_traces) / double(written_traces));
+  }
+  double rate = keepRate();
+  if (saturation >= options_.high_watermark) {
+    calm_updates_ = 0;
+    keep_rate_ = std::max(rate / 2, options_.min_keep_rate);
+  } else if (saturation > options_.low_watermark) {
+    calm_updates_ = 0;
+  } else if (rate < 1.0 && ++calm_updates_ >= options_.recovery_updates) {
+    calm_updates_ = 0;
+    keep_rate_ = std::min(rate * 2, 1.0);
+  }
+}
+
+bool LoadShedder::keep(uint64_t trace_id) const {
+  double rate = keepRate();
+  if (rate >= 1.0) {
+    return true;
+  }
+  uint64_t max_hash = uint64_t(rate * double(std::numeric_limits<uint64_t>::max()));
+  return trace_id * keep_hash_factor < max_hash;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
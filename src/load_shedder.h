@@ -0,0 +1,52 @@
+#ifndef DD_OPENTRACING_LOAD_SHEDDER_H
+#define DD_OPENTRACING_LOAD_SHEDDER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace datadog {
+namespace opentracing {
+
+struct LoadSheddingOptions {
+  // When the writer is at least this saturated (see LoadShedder::update), the rate at which new
+  // traces are kept is halved.
+  double high_watermark = 0.8;
+  // Once the writer has been at most this saturated for recovery_updates updates in a row, the
+  // rate is doubled (up to 1). In between the watermarks, it stays the same.
+  double low_watermark = 0.2;
+  size_t recovery_updates = 3;
+  // The rate isn't lowered any further than this.
+  double min_keep_rate = 1.0 / 64;
+};
+
+// Lowers the rate at which new traces are started when the writer can't keep up, so that
+// overload is shed before the work of building the traces is done, rather than by dropping them
+// once they're built. The writer reports how saturated it is, and the Tracer asks whether to keep
+// each new root span.
+//
+// keep() and keepRate() may be called from any thread, update() from one thread at a time.
+class LoadShedder {
+ public:
+  explicit LoadShedder(LoadSheddingOptions options = {}) : options_(options) {}
+
+  // Reports how full the writer's queue is (from 0 to 1), and how many traces were written, and
+  // dropped, since the last update.
+  void update(double fill_ratio, uint64_t written_traces, uint64_t dropped_traces);
+
+  // Whether to keep the new trace, at the current rate.
+  bool keep(uint64_t trace_id) const;
+  // The fraction of new traces being kept.
+  double keepRate() const { return keep_rate_.load(std::memory_order_relaxed); }
+
+ private:
+  const LoadSheddingOptions options_;
+  std::atomic<double> keep_rate_{1.0};
+  // Updates in a row at or below the low watermark.
+  size_t calm_updates_ = 0;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_LOAD_SHEDDER_H
@@ -0,0 +1,131 @@
+#include "memory_budget.h"
+
+#include <fstream>
+#include "span.h"
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+// Strings up to this long are kept inside the std::string (by libstdc++; libc++ keeps longer
+// ones).
+const size_t inline_string_capacity = 15;
+// cgroup v1 reports a limit around 2^63 when there isn't one.
+const uint64_t no_cgroup_limit = uint64_t(1) << 60;
+
+size_t heapSize(const std::string &s) {
+  return s.capacity() > inline_string_capacity ? s.capacity() + 1 : 0;
+}
+
+// Reads a limit from the file, which has a number or "max". Returns 0 if there's no limit.
+uint64_t readLimit(const std::string &path) {
+  std::ifstream file{path};
+  std::string value;
+  if (!(file >> value) || value == "max" ||
+      value.find_first_not_of("0123456789") != std::string::npos) {
+    return 0;
+  }
+  uint64_t limit = std::stoull(value);
+  return limit >= no_cgroup_limit ? 0 : limit;
+}
+
+// Reads the process's cgroups from the proc file (eg. /proc/self/cgroup): its cgroup v2 path, and
+// its path in the cgroup v1 memory hierarchy. Either is left empty if it isn't listed.
+void readCgroupPaths(const std::string &proc_path, std::string &v2_path, std::string &v1_path) {
+  std::ifstream file{proc_path};
+  std::string line;
+  // Each line is "hierarchy-id:controller-list:path".
+  while (std::getline(file, line)) {
+    auto first = line.find(':');
+    auto second = first == std::string::npos ? first : line.find(':', first + 1);
+    if (second == std::string::npos) {
+      continue;
+    }
+    auto controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+    auto path = line.substr(second + 1);
+    if (line.compare(0, first, "0") == 0 && controllers == ",,") {
+      v2_path = path;
+    } else if (controllers.find(",memory,") != std::string::npos) {
+      v1_path = path;
+    }
+  }
+}
+
+// Returns the lowest limit in the named file of the cgroup at path, in the hierarchy mounted at
+// root, and of its ancestors, since they all apply. Returns 0 if none of them has a limit. A
+// cgroup that doesn't exist under root (eg. since root is a container's own cgroup) has none.
+uint64_t lowestLimit(const std::string &root, std::string path, const std::string &name) {
+  while (!path.empty() && path.back() == '/') {
+    path.pop_back();
+  }
+  uint64_t lowest = 0;
+  while (true) {
+    uint64_t limit = readLimit(root + path + "/" + name);
+    if (limit != 0 && (lowest == 0 || limit < lowest)) {
+      lowest = limit;
+    }
+    if (path.empty()) {
+      return lowest;
+    }
+    auto slash = path.rfind('/');
+    path.erase(slash == std::string::npos ? 0 : slash);
+  }
+}
+}  // namespace
+
+size_t estimatedSize(const SpanData &span) {
+  size_t size = sizeof(SpanData) + heapSize(span.type) + heapSize(span.service) +
+                heapSize(span.resource) + heapSize(span.name);
+  // Each tag is a node with the pair, a next pointer and the cached hash, plus a bucket pointer.
+  using Tag = std::pair<const std::string, std::string>;
+  size += span.meta.bucket_count() * sizeof(void *);
+  for (const auto &tag : span.meta) {
+    size += sizeof(Tag) + sizeof(void *) + sizeof(size_t) + heapSize(tag.first) +
+            heapSize(tag.second);
+  }
+  return size;
+}
+
+size_t estimatedSize(const Trace &trace) {
+  if (trace == nullptr) {
+    return 0;
+  }
+  size_t size = sizeof(*trace) + trace->capacity() * sizeof(std::unique_ptr<SpanData>);
+  for (const auto &span : *trace) {
+    size += estimatedSize(*span);
+  }
+  return size;
+}
+
+uint64_t cgroupMemoryLimit(const std::string &root, const std::string &proc_cgroup_path) {
+  std::string v2_path;
+  std::string v1_path;
+  readCgroupPaths(proc_cgroup_path, v2_path, v1_path);
+  uint64_t limit = lowestLimit(root, v2_path, "memory.max");
+  if (limit == 0) {
+    limit = lowestLimit(root + "/memory", v1_path, "memory.limit_in_bytes");
+  }
+  return limit;
+}
+
+bool MemoryBudget::reserve(size_t bytes) {
+  if (max_bytes_ == 0) {
+    used_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    return true;
+  }
+  size_t used = used_bytes_.load(std::memory_order_relaxed);
+  do {
+    if (used + bytes > max_bytes_) {
+      rejections_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!used_bytes_.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+  return true;
+}
+
+void MemoryBudget::release(size_t bytes) {
+  used_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+}  // namespace opentracing
+}  // namespace datadog
@@ -0,0 +1,58 @@
+#ifndef DD_OPENTRACING_MEMORY_BUDGET_H
+#define DD_OPENTRACING_MEMORY_BUDGET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace datadog {
+namespace opentracing {
+
+class SpanData;
+using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
+
+// Approximately how many bytes of memory the span takes up, including its strings and tags.
+size_t estimatedSize(const SpanData &span);
+// Approximately how many bytes of memory the trace takes up, including its spans.
+size_t estimatedSize(const Trace &trace);
+
+// The memory limit of the cgroup that the process is in (v2, or else v1), read from the cgroup
+// filesystem mounted at root. The process's cgroup is found in proc_cgroup_path, and the lowest
+// limit of it and its ancestors is used. Returns 0 if there's no limit, or it can't be read.
+uint64_t cgroupMemoryLimit(const std::string &root = "/sys/fs/cgroup",
+                           const std::string &proc_cgroup_path = "/proc/self/cgroup");
+
+// A limit on the bytes taken up by traces that are waiting to be sent, shared by the
+// WritingSpanBuffer and the AgentWriter so that together they stay within it. Bytes are reserved
+// before a trace (or span) is kept, and released once it's gone. May be used from any thread.
+class MemoryBudget {
+ public:
+  // 0 means there's no limit.
+  explicit MemoryBudget(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  MemoryBudget(const MemoryBudget &) = delete;
+  MemoryBudget &operator=(const MemoryBudget &) = delete;
+
+  // Returns false, and reserves nothing, if that would go over the limit.
+  bool reserve(size_t bytes);
+  void release(size_t bytes);
+
+  size_t maxBytes() const { return max_bytes_; }
+  // The bytes reserved now.
+  size_t usedBytes() const { return used_bytes_.load(std::memory_order_relaxed); }
+  // How many times a reservation was refused.
+  uint64_t rejections() const { return rejections_.load(std::memory_order_relaxed); }
+
+ private:
+  const size_t max_bytes_;
+  std::atomic<size_t> used_bytes_{0};
+  std::atomic<uint64_t> rejections_{0};
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_MEMORY_BUDGET_H
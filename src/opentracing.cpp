@@ -10,5 +10,13 @@ std::shared_ptr<ot::Tracer> makeTracer(const TracerOptions &options) {
   return std::shared_ptr<ot::Tracer>{new Tracer{options}};
 }
 
+TracerTelemetry snapshot(const ot::Tracer &tracer) {
+  auto datadog_tracer = dynamic_cast<const Tracer *>(&tracer);
+  if (datadog_tracer == nullptr) {
+    return TracerTelemetry{};
+  }
+  return datadog_tracer->snapshot();
+}
+
 }  // namespace opentracing
 }  // namespace datadog
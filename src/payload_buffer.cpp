@@ -0,0 +1,50 @@
+#include "payload_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace datadog {
+namespace opentracing {
+
+PayloadBuffer::PayloadBuffer(size_t shrink_after_uses, size_t min_capacity)
+    : shrink_after_uses_(shrink_after_uses), min_capacity_(min_capacity) {}
+
+void PayloadBuffer::write(const char *data, size_t size) {
+  if (size != 0) {
+    std::memcpy(append(size), data, size);
+  }
+}
+
+void PayloadBuffer::grow(size_t min_capacity) {
+  reallocate(std::max(min_capacity, capacity_ * 2));
+}
+
+void PayloadBuffer::reallocate(size_t capacity) {
+  std::unique_ptr<char[]> bytes{new char[capacity]};
+  if (size_ != 0) {
+    std::memcpy(bytes.get(), bytes_.get(), size_);
+  }
+  bytes_ = std::move(bytes);
+  capacity_ = capacity;
+}
+
+void PayloadBuffer::clear() {
+  size_t used = size_;
+  size_ = 0;
+  if (shrink_after_uses_ == 0 || capacity_ <= min_capacity_ || used >= capacity_ / 4) {
+    small_uses_ = 0;
+    largest_small_use_ = 0;
+    return;
+  }
+  largest_small_use_ = std::max(largest_small_use_, used);
+  if (++small_uses_ < shrink_after_uses_) {
+    return;
+  }
+  // Give back the memory, leaving some headroom over what's recently been needed.
+  reallocate(std::max(min_capacity_, largest_small_use_ * 2));
+  small_uses_ = 0;
+  largest_small_use_ = 0;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
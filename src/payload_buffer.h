@@ -0,0 +1,68 @@
+#ifndef DD_OPENTRACING_PAYLOAD_BUFFER_H
+#define DD_OPENTRACING_PAYLOAD_BUFFER_H
+
+#include <cstddef>
+#include <memory>
+
+namespace datadog {
+namespace opentracing {
+
+// A growable, contiguous byte buffer for request bodies. msgpack can encode directly into it (it
+// has the write() method of a msgpack stream), and its contents can be given to curl without
+// being copied.
+//
+// The memory is kept when the buffer is cleared, so that it can be reused for the next request.
+// After a spike (when the last shrink_after_uses uses each needed less than a quarter of the
+// capacity) it is shrunk to fit the largest of those uses, but never below min_capacity.
+class PayloadBuffer {
+ public:
+  PayloadBuffer(size_t shrink_after_uses = 16, size_t min_capacity = 64 * 1024);
+
+  // Appends the given bytes.
+  void write(const char *data, size_t size);
+
+  // Appends size bytes, and returns where they start, for the caller to fill in. The bytes are
+  // uninitialised. Only valid until the buffer is next changed.
+  char *append(size_t size) {
+    if (size_ + size > capacity_) {
+      grow(size_ + size);
+    }
+    char *start = bytes_.get() + size_;
+    size_ += size;
+    return start;
+  }
+
+  // Drops bytes from the end, leaving the first size bytes.
+  void truncate(size_t size) {
+    if (size < size_) {
+      size_ = size;
+    }
+  }
+
+  // Empties the buffer, keeping (most of) the memory.
+  void clear();
+
+  const char *data() const { return bytes_.get(); }
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  // Reallocates so that there's room for at least the given number of bytes.
+  void grow(size_t min_capacity);
+  void reallocate(size_t capacity);
+
+  const size_t shrink_after_uses_;
+  const size_t min_capacity_;
+  std::unique_ptr<char[]> bytes_;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+  // Number of uses in a row that needed less than a quarter of the capacity.
+  size_t small_uses_ = 0;
+  // The largest of those uses.
+  size_t largest_small_use_ = 0;
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_PAYLOAD_BUFFER_H
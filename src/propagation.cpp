@@ -40,12 +40,18 @@ SpanContext::SpanContext(uint64_t id, uint64_t trace_id,
     : id_(id), trace_id_(trace_id), baggage_(std::move(baggage)) {}
 
 SpanContext::SpanContext(SpanContext &&other)
-    : id_(other.id_), trace_id_(other.trace_id_), baggage_(std::move(other.baggage_)) {}
+    : id_(other.id_),
+      trace_id_(other.trace_id_),
+      pending_trace_(std::move(other.pending_trace_)),
+      shed_(other.shed_),
+      baggage_(std::move(other.baggage_)) {}
 
 SpanContext &SpanContext::operator=(SpanContext &&other) {
   std::lock_guard<std::mutex> lock{mutex_};
   id_ = other.id_;
   trace_id_ = other.trace_id_;
+  pending_trace_ = std::move(other.pending_trace_);
+  shed_ = other.shed_;
   baggage_ = std::move(other.baggage_);
   return *this;
 }
@@ -69,6 +75,26 @@ uint64_t SpanContext::trace_id() const {
   return trace_id_;
 }
 
+std::shared_ptr<PendingTrace> SpanContext::pendingTrace() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return pending_trace_;
+}
+
+void SpanContext::setPendingTrace(std::shared_ptr<PendingTrace> trace) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  pending_trace_ = std::move(trace);
+}
+
+bool SpanContext::shed() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shed_;
+}
+
+void SpanContext::setShed(bool shed) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  shed_ = shed;
+}
+
 void SpanContext::setBaggageItem(ot::string_view key, ot::string_view value) noexcept try {
   std::lock_guard<std::mutex> lock{mutex_};
   baggage_.emplace(key, value);
@@ -87,7 +113,10 @@ std::string SpanContext::baggageItem(ot::string_view key) const {
 SpanContext SpanContext::withId(uint64_t id) const {
   std::lock_guard<std::mutex> lock{mutex_};
   auto baggage = baggage_;  // (Shallow) copy baggage.
-  return std::move(SpanContext{id, trace_id_, std::move(baggage)});
+  SpanContext context{id, trace_id_, std::move(baggage)};
+  context.pending_trace_ = pending_trace_;
+  context.shed_ = shed_;
+  return std::move(context);
 }
 
 ot::expected<void> SpanContext::serialize(const ot::TextMapWriter &writer) const {
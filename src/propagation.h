@@ -3,6 +3,7 @@
 
 #include <opentracing/tracer.h>
 
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 
@@ -11,6 +12,8 @@ namespace ot = opentracing;
 namespace datadog {
 namespace opentracing {
 
+struct PendingTrace;
+
 class SpanContext : public ot::SpanContext {
  public:
   SpanContext(uint64_t id, uint64_t trace_id,
@@ -38,9 +41,22 @@ class SpanContext : public ot::SpanContext {
   uint64_t id() const;
   uint64_t trace_id() const;
 
+  // The unfinished trace that the span with this context belongs to, if the span is local.
+  // Spans started as children of this context inherit it. nullptr for remote (extracted)
+  // contexts.
+  std::shared_ptr<PendingTrace> pendingTrace() const;
+  void setPendingTrace(std::shared_ptr<PendingTrace> trace);
+
+  // Whether the trace was shed by the load shedder, so that spans started as children of this
+  // context are too. Not propagated, so that other services shed their own load.
+  bool shed() const;
+  void setShed(bool shed);
+
  private:
   uint64_t id_;
   uint64_t trace_id_;
+  std::shared_ptr<PendingTrace> pending_trace_;
+  bool shed_ = false;
   std::unordered_map<std::string, std::string> baggage_;
   mutable std::mutex mutex_;
 };
@@ -61,8 +61,10 @@ Span::Span(std::shared_ptr<const Tracer> tracer, std::shared_ptr<SpanBuffer> buf
                          parent_id,
                          std::chrono::duration_cast<std::chrono::nanoseconds>(
                              start_time_.absolute_time.time_since_epoch())
-                             .count())) {
-  buffer_->registerSpan(*span_.get());  // Doens't keep reference.
+                             .count())),
+      trace_(buffer_->registerSpan(*span_.get(), context_.pendingTrace())) {
+  // Children of this span belong to the same trace.
+  context_.setPendingTrace(trace_);
 }
 
 Span::~Span() {
@@ -107,7 +109,7 @@ void Span::FinishWithOptions(const ot::FinishSpanOptions &finish_span_options) n
   }
   // Audit and finish span.
   audit(span_.get());
-  buffer_->finishSpan(std::move(span_));
+  buffer_->finishSpan(trace_, std::move(span_));
   // According to the OT lifecycle, no more methods should be called on this Span. But just in case
   // let's make sure that span_ isn't nullptr. Fine line between defensive programming and voodoo.
   span_ = stubSpanData();
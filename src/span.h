@@ -104,6 +104,7 @@ class Span : public ot::Span {
 
   // Set in constructor initializer, depends on previous constructor initializer-set members:
   std::unique_ptr<SpanData> span_;
+  std::shared_ptr<PendingTrace> trace_;
 };
 
 }  // namespace opentracing
@@ -1,40 +1,304 @@
 #include "span_buffer.h"
 
 #include <iostream>
+#include <thread>
 
 namespace datadog {
 namespace opentracing {
 
-WritingSpanBuffer::WritingSpanBuffer(std::shared_ptr<Writer> writer) : writer_(writer) {}
+namespace {
+// Returns a number of shards that makes it unlikely that threads contend on the same shard.
+size_t defaultNumShards() {
+  size_t cpus = std::thread::hardware_concurrency();
+  size_t num_shards = 1;
+  while (num_shards < cpus * 4 && num_shards < 256) {
+    num_shards *= 2;
+  }
+  return num_shards;
+}
+}  // namespace
+
+WritingSpanBuffer::WritingSpanBuffer(std::shared_ptr<Writer> writer,
+                                     WritingSpanBufferOptions options, TimeProvider get_time)
+    : writer_(writer),
+      options_(options),
+      get_time_(get_time),
+      num_shards_(options.num_shards == 0 ? defaultNumShards() : options.num_shards),
+      shards_(new Shard[num_shards_]) {
+  if (options_.pending_trace_ttl.count() != 0) {
+    writer_->setPeriodicTask([this]() { expireTraces(); });
+  }
+}
+
+WritingSpanBuffer::~WritingSpanBuffer() {
+  if (options_.pending_trace_ttl.count() != 0) {
+    writer_->setPeriodicTask(nullptr);
+  }
+}
+
+WritingSpanBuffer::Shard& WritingSpanBuffer::shardFor(uint64_t trace_id) {
+  // Mix the bits of the trace id, since they needn't be random (eg. if propagated from a client
+  // that uses sequential ids).
+  uint64_t hash = trace_id * 0x9E3779B97F4A7C15ULL;
+  return shards_[(hash >> 32) % num_shards_];
+}
+
+std::shared_ptr<PendingTrace> WritingSpanBuffer::newTrace(uint64_t trace_id) {
+  if (options_.partial_flush_max_age.count() == 0 && options_.pending_trace_ttl.count() == 0) {
+    return std::make_shared<PendingTrace>(trace_id);  // Don't need the time.
+  }
+  return std::make_shared<PendingTrace>(trace_id, get_time_().relative_time);
+}
+
+void WritingSpanBuffer::addToAgeIndex(Shard& shard, const std::shared_ptr<PendingTrace>& trace) {
+  trace->age_entry = shard.by_age.insert(shard.by_age.end(), trace);
+  trace->in_age_index = true;
+}
+
+bool WritingSpanBuffer::shouldFlushPartially(PendingTrace& trace) {
+  if (options_.partial_flush_min_spans != 0 &&
+      trace.finished_spans->size() >= options_.partial_flush_min_spans) {
+    return true;
+  }
+  if (options_.partial_flush_max_age.count() != 0) {
+    auto now = get_time_().relative_time;
+    if (now - trace.last_flush >= options_.partial_flush_max_age) {
+      trace.last_flush = now;
+      return true;
+    }
+  }
+  return false;
+}
 
-void WritingSpanBuffer::registerSpan(const SpanData& span) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
+std::shared_ptr<PendingTrace> WritingSpanBuffer::registerSpan(
+    const SpanData& span, std::shared_ptr<PendingTrace> local_trace) {
+  if (local_trace != nullptr) {
+    if (local_trace->open_spans++ == 0) {
+      reopenTrace(local_trace);
+    }
+    return local_trace;
+  }
   uint64_t trace_id = span.traceId();
-  auto trace = traces_.find(trace_id);
-  if (trace == traces_.end()) {
-    traces_.emplace(std::make_pair(trace_id, PendingTrace{}));
-    trace = traces_.find(trace_id);
+  if (span.parent_id == 0) {
+    // A new trace, only local spans can belong to it.
+    auto trace = newTrace(trace_id);
+    trace->open_spans = 1;
+    traces_created_.add();
+    if (options_.pending_trace_ttl.count() != 0) {
+      auto& shard = shardFor(trace_id);
+      std::lock_guard<std::mutex> lock_guard{shard.mutex};
+      addToAgeIndex(shard, trace);
+    }
+    return trace;
+  }
+  // The parent is remote, so other spans of the trace can only be found by its id.
+  auto& shard = shardFor(trace_id);
+  std::lock_guard<std::mutex> lock_guard{shard.mutex};
+  auto& trace = shard.traces[trace_id];
+  bool created = false;
+  if (trace == nullptr) {
+    trace = newTrace(trace_id);
+    trace->findable_by_id = true;
+    if (options_.pending_trace_ttl.count() != 0) {
+      addToAgeIndex(shard, trace);
+    }
+    created = true;
   }
-  trace->second.all_spans.insert(span.spanId());
+  if (trace->open_spans++ == 0) {
+    if (created) {
+      traces_created_.add();
+    } else {
+      // Completed, but not yet removed from the shard.
+      reopenTrace(shard, trace);
+    }
+  }
+  return trace;
 }
 
-void WritingSpanBuffer::finishSpan(std::unique_ptr<SpanData> span) {
-  std::lock_guard<std::mutex> lock_guard{mutex_};
-  auto trace_iter = traces_.find(span->traceId());
-  if (trace_iter == traces_.end()) {
+void WritingSpanBuffer::finishSpan(const std::shared_ptr<PendingTrace>& trace,
+                                   std::unique_ptr<SpanData> span) {
+  if (trace == nullptr) {
     std::cerr << "Missing trace for finished span" << std::endl;
     return;
   }
-  auto& trace = trace_iter->second;
-  if (trace.all_spans.find(span->spanId()) == trace.all_spans.end()) {
-    std::cerr << "A Span that was not registered was submitted to WritingSpanBuffer" << std::endl;
+  spans_finished_.add();
+  Trace spans;
+  bool complete = false;
+  size_t released_bytes = 0;
+  {
+    std::lock_guard<std::mutex> lock_guard{trace->mutex};
+    if (trace->expired) {
+      // Send (or drop) the span by itself, the rest of the trace is already gone.
+      trace->open_spans--;
+      expired_spans_++;
+      if (!options_.flush_expired_traces) {
+        return;
+      }
+      spans.reset(new std::vector<std::unique_ptr<SpanData>>());
+      spans->push_back(std::move(span));
+    } else {
+      bool reserved = true;
+      if (options_.memory_budget != nullptr) {
+        size_t size = estimatedSize(*span);
+        reserved = options_.memory_budget->reserve(size);
+        trace->reserved_bytes += reserved ? size : 0;
+      }
+      trace->finished_spans->push_back(std::move(span));
+      complete = --trace->open_spans == 0;
+      if (!complete && reserved && !shouldFlushPartially(*trace)) {
+        return;
+      }
+      // The writer accounts for the spans from here on.
+      released_bytes = trace->reserved_bytes;
+      trace->reserved_bytes = 0;
+      spans = std::move(trace->finished_spans);
+      // Any spans finished from now on are sent separately.
+      trace->finished_spans.reset(new std::vector<std::unique_ptr<SpanData>>());
+    }
+  }
+  if (released_bytes != 0) {
+    options_.memory_budget->release(released_bytes);
+  }
+  if (complete) {
+    traces_completed_.add();
+    removeCompleteTrace(trace);
+  }
+  // Written outside of any lock, so that the Writer doesn't hold up other traces.
+  writer_->write(std::move(spans));
+}
+
+void WritingSpanBuffer::removeCompleteTrace(const std::shared_ptr<PendingTrace>& trace) {
+  if (!trace->findable_by_id && options_.pending_trace_ttl.count() == 0) {
+    return;  // Not in the shard.
+  }
+  auto& shard = shardFor(trace->trace_id);
+  std::lock_guard<std::mutex> lock_guard{shard.mutex};
+  if (trace->open_spans != 0) {
+    return;  // Already has new spans.
+  }
+  if (trace->findable_by_id) {
+    auto entry = shard.traces.find(trace->trace_id);
+    // Spans are only registered to the trace by id under the shard lock, so it can't be reopened
+    // by id while it's removed.
+    if (entry != shard.traces.end() && entry->second == trace) {
+      shard.traces.erase(entry);
+    }
+  }
+  if (trace->in_age_index) {
+    shard.by_age.erase(trace->age_entry);
+    trace->in_age_index = false;
+  }
+}
+
+void WritingSpanBuffer::addTelemetry(TracerTelemetry& telemetry) const {
+  // Read before traces_created_, so that a trace that completes meanwhile isn't counted as
+  // completed without having been created.
+  uint64_t completed = traces_completed_.value();
+  uint64_t expired = expired_traces_;
+  uint64_t created = traces_created_.value();
+  telemetry.spans_finished += spans_finished_.value();
+  telemetry.traces_completed += completed;
+  telemetry.traces_expired += expired;
+  telemetry.pending_traces += created > completed + expired ? created - completed - expired : 0;
+  writer_->addTelemetry(telemetry);
+}
+
+void WritingSpanBuffer::reopenTrace(const std::shared_ptr<PendingTrace>& trace) {
+  if (!trace->findable_by_id && options_.pending_trace_ttl.count() == 0) {
+    traces_created_.add();  // Pending again, but not in the shard.
+    return;
+  }
+  auto& shard = shardFor(trace->trace_id);
+  std::lock_guard<std::mutex> lock_guard{shard.mutex};
+  reopenTrace(shard, trace);
+}
+
+void WritingSpanBuffer::reopenTrace(Shard& shard, const std::shared_ptr<PendingTrace>& trace) {
+  // Counted as pending again, since it was counted as completed or expired.
+  traces_created_.add();
+  // Since open_spans was incremented before the shard was locked, removeCompleteTrace either
+  // removed the trace before now, or leaves it be.
+  if (trace->findable_by_id) {
+    auto& entry = shard.traces[trace->trace_id];
+    if (entry == nullptr) {
+      entry = trace;
+    }
+  }
+  if (options_.pending_trace_ttl.count() == 0) {
     return;
   }
-  trace.finished_spans->push_back(std::move(span));
-  if (trace.finished_spans->size() == trace.all_spans.size()) {
-    writer_->write(std::move(trace.finished_spans));
-    traces_.erase(trace_iter);
+  {
+    // The spans of an expired trace all finished, so it starts over like a new trace.
+    std::lock_guard<std::mutex> lock_guard{trace->mutex};
+    trace->expired = false;
+  }
+  // Its TTL starts again too, so that the span is expired if it's never finished.
+  if (trace->in_age_index) {
+    shard.by_age.erase(trace->age_entry);
+  }
+  trace->created = get_time_().relative_time;
+  addToAgeIndex(shard, trace);
+}
+
+size_t WritingSpanBuffer::expireTraces() {
+  if (options_.pending_trace_ttl.count() == 0) {
+    return 0;
+  }
+  auto now = get_time_().relative_time;
+  size_t num_traces = 0;
+  size_t num_spans = 0;
+  size_t released_bytes = 0;
+  std::vector<Trace> to_send;
+  for (size_t i = 0; i < num_shards_; i++) {
+    auto& shard = shards_[i];
+    std::lock_guard<std::mutex> shard_lock{shard.mutex};
+    while (!shard.by_age.empty()) {
+      auto trace = shard.by_age.front().lock();
+      if (trace != nullptr && now - trace->created < options_.pending_trace_ttl) {
+        break;  // The rest are newer.
+      }
+      shard.by_age.pop_front();
+      if (trace == nullptr) {
+        continue;
+      }
+      trace->in_age_index = false;
+      if (trace->findable_by_id) {
+        auto entry = shard.traces.find(trace->trace_id);
+        if (entry != shard.traces.end() && entry->second == trace) {
+          shard.traces.erase(entry);
+        }
+      }
+      std::lock_guard<std::mutex> trace_lock{trace->mutex};
+      if (trace->open_spans == 0) {
+        continue;  // Completed just now.
+      }
+      trace->expired = true;
+      released_bytes += trace->reserved_bytes;
+      trace->reserved_bytes = 0;
+      num_traces++;
+      num_spans += trace->finished_spans->size();
+      if (options_.flush_expired_traces && !trace->finished_spans->empty()) {
+        to_send.push_back(std::move(trace->finished_spans));
+      }
+      trace->finished_spans.reset(new std::vector<std::unique_ptr<SpanData>>());
+    }
+  }
+  if (released_bytes != 0) {
+    options_.memory_budget->release(released_bytes);
+  }
+  for (auto& spans : to_send) {
+    writer_->write(std::move(spans));
+  }
+  if (num_traces > 0) {
+    expired_traces_ += num_traces;
+    expired_spans_ += num_spans;
+    std::cerr << "Expired " << num_traces << " trace(s) that were unfinished after "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(options_.pending_trace_ttl)
+                     .count()
+              << "ms, " << (options_.flush_expired_traces ? "sent " : "dropped ") << num_spans
+              << " finished span(s)" << std::endl;
   }
+  return num_traces;
 }
 
 }  // namespace opentracing
@@ -1,9 +1,15 @@
 #ifndef DD_OPENTRACING_SPAN_BUFFER_H
 #define DD_OPENTRACING_SPAN_BUFFER_H
 
+#include <datadog/opentracing.h>
+#include "memory_budget.h"
 #include "span.h"
+#include "telemetry.h"
 #include "writer.h"
 
+#include <atomic>
+#include <chrono>
+#include <list>
 #include <mutex>
 #include <unordered_map>
 
@@ -14,12 +20,38 @@ class SpanData;
 class Writer;
 using Trace = std::unique_ptr<std::vector<std::unique_ptr<SpanData>>>;
 
+// The spans of a trace that haven't been sent yet. Shared between all the local spans of the
+// trace, so that they can be finished without looking up the trace.
 struct PendingTrace {
-  PendingTrace()
-      : finished_spans(Trace{new std::vector<std::unique_ptr<SpanData>>()}), all_spans() {}
+  PendingTrace(uint64_t trace_id_, std::chrono::steady_clock::time_point created_ = {})
+      : trace_id(trace_id_),
+        created(created_),
+        finished_spans(Trace{new std::vector<std::unique_ptr<SpanData>>()}),
+        last_flush(created_) {}
 
+  const uint64_t trace_id;
+  // Only set if the WritingSpanBuffer needs it. Reset if the trace is reopened, by a span that's
+  // registered after the trace's other spans have all finished. Locked by the buffer.
+  std::chrono::steady_clock::time_point created;
+  // Spans that have been registered but not yet finished.
+  std::atomic<uint64_t> open_spans{0};
+  // Locks finished_spans.
+  std::mutex mutex;
   Trace finished_spans;
-  std::unordered_set<uint64_t> all_spans;
+  // When the trace was created, or when its finished spans were last sent as a partial trace.
+  // Locked by mutex.
+  std::chrono::steady_clock::time_point last_flush;
+  // The bytes of finished_spans reserved from the memory budget. Locked by mutex.
+  size_t reserved_bytes = 0;
+  // Set once the trace has been pending for too long (see WritingSpanBufferOptions). Any spans
+  // that finish afterwards are sent or dropped straight away. Locked by mutex.
+  bool expired = false;
+  // Set if the trace can be found by id, because it has spans with a remote parent.
+  bool findable_by_id = false;
+  // The trace's entry in the WritingSpanBuffer's age index, if in_age_index. Locked by the
+  // buffer.
+  std::list<std::weak_ptr<PendingTrace>>::iterator age_entry;
+  bool in_age_index = false;
 };
 
 // Keeps track of Spans until there is a complete trace.
@@ -27,22 +59,115 @@ class SpanBuffer {
  public:
   SpanBuffer() {}
   virtual ~SpanBuffer() {}
-  virtual void registerSpan(const SpanData& span) = 0;
-  virtual void finishSpan(std::unique_ptr<SpanData> span) = 0;
+  // Registers an unfinished span. local_trace is the trace of the span's parent if the parent is
+  // in this process, otherwise nullptr. Returns the trace that the span belongs to, which must
+  // be given to finishSpan.
+  virtual std::shared_ptr<PendingTrace> registerSpan(
+      const SpanData& span, std::shared_ptr<PendingTrace> local_trace) = 0;
+  virtual void finishSpan(const std::shared_ptr<PendingTrace>& trace,
+                          std::unique_ptr<SpanData> span) = 0;
+  // Adds what it (and its writer, if any) has done to the telemetry.
+  virtual void addTelemetry(TracerTelemetry& telemetry) const {}
+};
+
+struct WritingSpanBufferOptions {
+  // Number of shards that traces with a remote parent are split between. 0 picks a number based
+  // on the number of CPUs.
+  size_t num_shards = 0;
+  // If not 0, the finished spans of an unfinished trace are sent once there are this many.
+  size_t partial_flush_min_spans = 0;
+  // If not 0, the finished spans of an unfinished trace are sent when a span finishes and it has
+  // been this long since the trace started (or its spans were last sent).
+  std::chrono::steady_clock::duration partial_flush_max_age{0};
+  // If not 0, traces that are still unfinished this long after they started are expired, so that
+  // a span that is never finished can't keep its trace in memory forever. Checked periodically
+  // on the Writer's thread.
+  std::chrono::steady_clock::duration pending_trace_ttl{0};
+  // If true, the finished spans of an expired trace are sent, as are its spans that finish later.
+  // Otherwise they are dropped.
+  bool flush_expired_traces = true;
+  // If set, the finished spans of unfinished traces are counted against it. A span that doesn't
+  // fit is sent straight away, along with the rest of its trace's finished spans, rather than
+  // being kept.
+  std::shared_ptr<MemoryBudget> memory_budget;
 };
 
 // A SpanBuffer that sends completed traces to a Writer.
+//
+// A trace is complete when all of its registered spans have finished. The spans of a trace that
+// was started in this process share a PendingTrace, so registering and finishing them only
+// touches that trace. Spans whose parent is remote (eg. extracted from a request) are matched up
+// by trace id instead; those traces are split between a number of shards, each with its own lock,
+// so that unrelated traces can be looked up concurrently.
+//
+// Optionally, long-running or very large traces are sent in parts, and traces that never finish
+// are expired (see WritingSpanBufferOptions), so that they don't hold their spans in memory
+// indefinitely. The same goes for the finished spans that don't fit in the memory budget.
 class WritingSpanBuffer : public SpanBuffer {
  public:
-  WritingSpanBuffer(std::shared_ptr<Writer> writer);
+  WritingSpanBuffer(std::shared_ptr<Writer> writer,
+                    WritingSpanBufferOptions options = WritingSpanBufferOptions{},
+                    TimeProvider get_time = getRealTime);
+  ~WritingSpanBuffer() override;
+
+  std::shared_ptr<PendingTrace> registerSpan(const SpanData& span,
+                                             std::shared_ptr<PendingTrace> local_trace) override;
+  void finishSpan(const std::shared_ptr<PendingTrace>& trace,
+                  std::unique_ptr<SpanData> span) override;
+  void addTelemetry(TracerTelemetry& telemetry) const override;
+
+  size_t numShards() const { return num_shards_; }
 
-  void registerSpan(const SpanData& span) override;
-  void finishSpan(std::unique_ptr<SpanData> span) override;
+  // Expires traces that have been pending for longer than the TTL. Returns the number of traces
+  // expired. Called periodically on the Writer's thread if there is a TTL.
+  size_t expireTraces();
+  // Number of traces expired so far.
+  uint64_t expiredTraces() const { return expired_traces_; }
+  // Number of finished spans of expired traces so far, whether sent or dropped.
+  uint64_t expiredSpans() const { return expired_spans_; }
 
  private:
+  // Assumed size of a cache line.
+  static const size_t cache_line_size = 64;
+
+  struct Shard {
+    std::mutex mutex;
+    // Traces with spans that have a remote parent.
+    std::unordered_map<uint64_t, std::shared_ptr<PendingTrace>> traces;
+    // All of the shard's pending traces, oldest first, if there is a TTL.
+    std::list<std::weak_ptr<PendingTrace>> by_age;
+    // Keeps the locks of neighbouring shards out of each others' cache lines.
+    char padding[cache_line_size];
+  };
+
+  Shard& shardFor(uint64_t trace_id);
+  std::shared_ptr<PendingTrace> newTrace(uint64_t trace_id);
+  // Adds the trace to the shard's age index. Expects the shard's mutex to be locked.
+  void addToAgeIndex(Shard& shard, const std::shared_ptr<PendingTrace>& trace);
+  // Removes the trace from its shard once it's complete.
+  void removeCompleteTrace(const std::shared_ptr<PendingTrace>& trace);
+  // Makes a trace pending again once a span is registered to it after its other spans have all
+  // finished (and it may have been removed from its shard, or expired).
+  void reopenTrace(const std::shared_ptr<PendingTrace>& trace);
+  // Like reopenTrace, but expects the trace's shard's mutex to be locked.
+  void reopenTrace(Shard& shard, const std::shared_ptr<PendingTrace>& trace);
+  // Returns true if the finished spans of an unfinished trace should be sent now. Expects the
+  // trace's mutex to be locked.
+  bool shouldFlushPartially(PendingTrace& trace);
+
   std::shared_ptr<Writer> writer_;
-  std::unordered_map<uint64_t, PendingTrace> traces_;
-  mutable std::mutex mutex_;
+  const WritingSpanBufferOptions options_;
+  TimeProvider get_time_;
+  size_t num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<uint64_t> expired_traces_{0};
+  std::atomic<uint64_t> expired_spans_{0};
+  // Spans finished. Traces created (or reopened, see reopenTrace), and completed. Every trace
+  // created is then either completed or expired, so the number pending is the difference, less
+  // those expired.
+  TelemetryCounter spans_finished_;
+  TelemetryCounter traces_created_;
+  TelemetryCounter traces_completed_;
 };
 
 }  // namespace opentracing
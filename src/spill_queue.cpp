@@ -0,0 +1,339 @@
+#include "spill_queue.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+namespace datadog {
+namespace opentracing {
+
+namespace {
+const char segment_prefix[] = "segment-";
+const char segment_suffix[] = ".spill";
+const char lock_file_name[] = ".lock";
+const uint32_t segment_magic = 0x44445351;  // "DDSQ"
+const uint32_t record_magic = 0x44445352;   // "DDSR"
+const uint32_t segment_version = 1;
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t updates;
+  uint64_t read_offset;
+  uint32_t crc;  // Of the fields before it.
+  uint32_t padding;
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t num_traces;
+  uint32_t format;
+  uint32_t crc;  // Of size, num_traces, format and the payload.
+};
+
+// Both copies of the segment header.
+const size_t headers_size = 2 * sizeof(SegmentHeader);
+
+uint32_t headerCrc(const SegmentHeader &header) {
+  return uint32_t(
+      crc32(0, reinterpret_cast<const Bytef *>(&header), offsetof(SegmentHeader, crc)));
+}
+
+uint32_t recordCrc(const RecordHeader &header, const char *payload) {
+  uLong crc = crc32(0, reinterpret_cast<const Bytef *>(&header.size),
+                    offsetof(RecordHeader, crc) - offsetof(RecordHeader, size));
+  return uint32_t(crc32(crc, reinterpret_cast<const Bytef *>(payload), uInt(header.size)));
+}
+
+// Reads the header of the complete record at offset, if there is one.
+bool readRecord(const char *data, size_t size, size_t offset, RecordHeader &header) {
+  if (offset + sizeof(RecordHeader) > size) {
+    return false;
+  }
+  std::memcpy(&header, data + offset, sizeof(RecordHeader));
+  return header.magic == record_magic && header.size <= size - offset - sizeof(RecordHeader) &&
+         header.crc == recordCrc(header, data + offset + sizeof(RecordHeader));
+}
+
+// Parses "segment-<sequence>.spill".
+bool parseSegmentName(const std::string &name, uint64_t &sequence) {
+  size_t prefix = sizeof(segment_prefix) - 1;
+  size_t suffix = sizeof(segment_suffix) - 1;
+  if (name.size() <= prefix + suffix || name.compare(0, prefix, segment_prefix) != 0 ||
+      name.compare(name.size() - suffix, suffix, segment_suffix) != 0) {
+    return false;
+  }
+  std::string digits = name.substr(prefix, name.size() - prefix - suffix);
+  if (digits.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  sequence = std::stoull(digits);
+  return true;
+}
+}  // namespace
+
+SpillQueue::SpillQueue(SpillQueueOptions options)
+    : options_(options),
+      segment_size_(std::min(options.segment_size, options.max_bytes)),
+      max_segments_(std::max<size_t>(options.max_bytes / std::max<size_t>(segment_size_, 1), 1)) {
+  if (segment_size_ <= headers_size + sizeof(RecordHeader)) {
+    throw std::runtime_error("Spill segment size is too small");
+  }
+  if (mkdir(options_.directory.c_str(), 0700) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Unable to create spill directory " + options_.directory + ": " +
+                             std::strerror(errno));
+  }
+  std::string lock_path = options_.directory + "/" + lock_file_name;
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd < 0) {
+    throw std::runtime_error("Unable to open spill directory lock " + lock_path + ": " +
+                             std::strerror(errno));
+  }
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    int error = errno;
+    close(lock_fd);
+    if (error != EWOULDBLOCK) {
+      throw std::runtime_error("Unable to lock spill directory " + options_.directory + ": " +
+                               std::strerror(error));
+    }
+    std::cerr << "Spill directory " << options_.directory
+              << " is in use by another tracer, payloads won't be spilled" << std::endl;
+    return;
+  }
+  DIR *directory = opendir(options_.directory.c_str());
+  if (directory == nullptr) {
+    int error = errno;
+    close(lock_fd);
+    throw std::runtime_error("Unable to open spill directory " + options_.directory + ": " +
+                             std::strerror(error));
+  }
+  std::vector<uint64_t> sequences;
+  while (dirent *entry = readdir(directory)) {
+    uint64_t sequence;
+    if (parseSegmentName(entry->d_name, sequence)) {
+      sequences.push_back(sequence);
+    }
+  }
+  closedir(directory);
+  lock_fd_ = lock_fd;
+  std::sort(sequences.begin(), sequences.end());
+  for (uint64_t sequence : sequences) {
+    if (!openSegment(sequence, false)) {
+      std::cerr << "Discarding unreadable spill segment " << segmentPath(sequence) << std::endl;
+      unlink(segmentPath(sequence).c_str());
+    }
+    next_sequence_ = sequence + 1;
+  }
+  while (segments_.size() > max_segments_) {
+    removeOldestSegment();
+  }
+}
+
+SpillQueue::~SpillQueue() {
+  // The files are kept, for the next queue to pick up.
+  for (auto &segment : segments_) {
+    munmap(segment.data, segment_size_);
+  }
+  if (lock_fd_ >= 0) {
+    close(lock_fd_);  // Unlocks the directory.
+  }
+}
+
+std::string SpillQueue::segmentPath(uint64_t sequence) const {
+  char name[64];
+  std::snprintf(name, sizeof(name), "%s%020llu%s", segment_prefix, (unsigned long long)sequence,
+                segment_suffix);
+  return options_.directory + "/" + name;
+}
+
+bool SpillQueue::openSegment(uint64_t sequence, bool create) {
+  std::string path = segmentPath(sequence);
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat status;
+  // Allocated up front, so that running out of disk is an error here, rather than a SIGBUS when
+  // writing to the mapping.
+  bool sized = create ? posix_fallocate(fd, 0, off_t(segment_size_)) == 0
+                      : fstat(fd, &status) == 0 && size_t(status.st_size) == segment_size_;
+  void *data = sized ? mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0)
+                     : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    if (create) {
+      unlink(path.c_str());
+    }
+    return false;
+  }
+  Segment segment{sequence, static_cast<char *>(data), headers_size, headers_size, 0, 0};
+  if (create) {
+    writeHeader(segment);
+    segments_.push_back(segment);
+    return true;
+  }
+
+  // Use the newest complete copy of the header.
+  bool found = false;
+  for (size_t i = 0; i < 2; i++) {
+    SegmentHeader header;
+    std::memcpy(&header, segment.data + i * sizeof(SegmentHeader), sizeof(SegmentHeader));
+    if (header.magic == segment_magic && header.version == segment_version &&
+        header.crc == headerCrc(header) && (!found || header.updates > segment.updates)) {
+      found = true;
+      segment.updates = header.updates;
+      segment.read_offset = header.read_offset;
+    }
+  }
+  if (!found) {
+    munmap(data, segment_size_);
+    return false;
+  }
+  // Find the end of the complete records, and count the ones that haven't been taken.
+  size_t offset = headers_size;
+  size_t read_offset = segment.read_offset;
+  RecordHeader header;
+  while (readRecord(segment.data, segment_size_, offset, header)) {
+    if (offset >= read_offset) {
+      if (segment.records == 0) {
+        segment.read_offset = offset;
+      }
+      segment.records++;
+    }
+    offset += sizeof(RecordHeader) + header.size;
+  }
+  segment.write_offset = offset;
+  if (segment.records == 0) {
+    segment.read_offset = offset;
+  }
+  queued_payloads_ += segment.records;
+  segments_.push_back(segment);
+  return true;
+}
+
+void SpillQueue::removeOldestSegment() {
+  Segment &segment = segments_.front();
+  evicted_payloads_ += segment.records;
+  queued_payloads_ -= segment.records;
+  munmap(segment.data, segment_size_);
+  unlink(segmentPath(segment.sequence).c_str());
+  segments_.pop_front();
+}
+
+void SpillQueue::writeHeader(Segment &segment) {
+  segment.updates++;
+  SegmentHeader header{segment_magic, segment_version, segment.updates, segment.read_offset, 0, 0};
+  header.crc = headerCrc(header);
+  // Alternate between the copies, so that the other one is complete while this one is written.
+  std::memcpy(segment.data + (segment.updates % 2) * sizeof(SegmentHeader), &header,
+              sizeof(SegmentHeader));
+}
+
+bool SpillQueue::push(const PayloadBuffer &payload, uint32_t num_traces, uint32_t format) {
+  size_t record_size = sizeof(RecordHeader) + payload.size();
+  if (!ownsDirectory() || headers_size + record_size > segment_size_) {
+    dropped_payloads_++;
+    return false;
+  }
+  if (segments_.empty() || segments_.back().write_offset + record_size > segment_size_) {
+    if (segments_.size() >= max_segments_) {
+      removeOldestSegment();
+    }
+    if (!openSegment(next_sequence_++, true)) {
+      std::cerr << "Unable to create spill segment " << segmentPath(next_sequence_ - 1) << ": "
+                << std::strerror(errno) << std::endl;
+      dropped_payloads_++;
+      return false;
+    }
+  }
+  Segment &segment = segments_.back();
+  RecordHeader header{record_magic, uint32_t(payload.size()), num_traces, format, 0};
+  header.crc = recordCrc(header, payload.data());
+  char *out = segment.data + segment.write_offset;
+  std::memcpy(out + sizeof(RecordHeader), payload.data(), payload.size());
+  std::memcpy(out, &header, sizeof(RecordHeader));
+  segment.write_offset += record_size;
+  segment.records++;
+  spilled_payloads_++;
+  queued_payloads_++;
+  return true;
+}
+
+bool SpillQueue::front(PayloadBuffer &payload, SpilledPayload &spilled) {
+  while (!segments_.empty()) {
+    Segment &segment = segments_.front();
+    RecordHeader header;
+    if (segment.records > 0 &&
+        readRecord(segment.data, segment_size_, segment.read_offset, header)) {
+      payload.clear();
+      payload.write(segment.data + segment.read_offset + sizeof(RecordHeader), header.size);
+      spilled.num_traces = header.num_traces;
+      spilled.format = header.format;
+      spilled.segment = segment.sequence;
+      spilled.offset = segment.read_offset;
+      return true;
+    }
+    if (segment.records > 0) {
+      // Only possible if the file was changed under us. Give up on the rest of it.
+      evicted_payloads_ += segment.records;
+      queued_payloads_ -= segment.records;
+      segment.records = 0;
+      segment.read_offset = segment.write_offset;
+      writeHeader(segment);
+    }
+    if (segments_.size() == 1) {
+      return false;  // Keep the newest segment to append to.
+    }
+    removeOldestSegment();  // All taken.
+  }
+  return false;
+}
+
+void SpillQueue::pop(const SpilledPayload &spilled, bool rejected) {
+  if (segments_.empty()) {
+    return;
+  }
+  Segment &segment = segments_.front();
+  RecordHeader header;
+  if (segment.sequence != spilled.segment || segment.read_offset != spilled.offset ||
+      segment.records == 0 ||
+      !readRecord(segment.data, segment_size_, segment.read_offset, header)) {
+    return;  // Evicted.
+  }
+  segment.read_offset += sizeof(RecordHeader) + header.size;
+  segment.records--;
+  queued_payloads_--;
+  (rejected ? rejected_payloads_ : replayed_payloads_)++;
+  writeHeader(segment);
+  if (segment.records == 0 && segments_.size() > 1) {
+    removeOldestSegment();
+  }
+}
+
+SpillStats SpillQueue::stats() const {
+  SpillStats stats;
+  stats.spilled_payloads = spilled_payloads_;
+  stats.replayed_payloads = replayed_payloads_;
+  stats.rejected_payloads = rejected_payloads_;
+  stats.evicted_payloads = evicted_payloads_;
+  stats.dropped_payloads = dropped_payloads_;
+  stats.queued_payloads = queued_payloads_;
+  return stats;
+}
+
+}  // namespace opentracing
+}  // namespace datadog
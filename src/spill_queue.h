@@ -0,0 +1,137 @@
+#ifndef DD_OPENTRACING_SPILL_QUEUE_H
+#define DD_OPENTRACING_SPILL_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include "payload_buffer.h"
+
+namespace datadog {
+namespace opentracing {
+
+// Options for keeping payloads on disk.
+struct SpillQueueOptions {
+  // The directory that the segment files are kept in. Created if it doesn't exist. Only one
+  // SpillQueue (in any process) uses a directory at a time, see SpillQueue::ownsDirectory.
+  std::string directory;
+  // The most disk space the segments may take up. When a new segment would take more, the oldest
+  // is deleted, along with any payloads in it that haven't been taken from the queue.
+  size_t max_bytes = 64 * 1024 * 1024;
+  // The size of each segment file (or max_bytes, if that's smaller). A payload bigger than this
+  // (less a few bytes of headers) can't be kept.
+  size_t segment_size = 16 * 1024 * 1024;
+};
+
+// A payload in a SpillQueue, and what's needed to send it.
+struct SpilledPayload {
+  uint32_t num_traces = 0;
+  // Not interpreted by the queue. AgentWriter keeps the payload's encoding in it.
+  uint32_t format = 0;
+  // Where it is in the queue.
+  uint64_t segment = 0;
+  uint64_t offset = 0;
+};
+
+// What a SpillQueue has done.
+struct SpillStats {
+  // Payloads added to the queue, and taken from it.
+  uint64_t spilled_payloads = 0;
+  uint64_t replayed_payloads = 0;
+  // Payloads taken from the queue that the agent rejected (eg. v0.5 payloads, once the agent
+  // doesn't support v0.5), so were dropped.
+  uint64_t rejected_payloads = 0;
+  // Payloads deleted before being taken, to stay within max_bytes.
+  uint64_t evicted_payloads = 0;
+  // Payloads that couldn't be added (too big, or the disk is full).
+  uint64_t dropped_payloads = 0;
+  // Payloads in the queue now.
+  uint64_t queued_payloads = 0;
+};
+
+// A FIFO queue of payloads that's kept on disk, so that payloads the agent can't take right now
+// survive until it can (even if the process restarts in between).
+//
+// The payloads are appended, as records, to memory-mapped segment files of a fixed size. When the
+// newest segment is full, another is started, and if that would take more than max_bytes the
+// oldest segment is deleted. Each record has a CRC-32 of its contents, so if the process dies
+// while writing one, the segment is read back up to the last complete record. Each segment has
+// two copies of its header (which says how much of it has been read), written alternately, so
+// there's always a complete one to fall back to.
+//
+// Only stats() may be called from more than one thread.
+class SpillQueue {
+ public:
+  // Opens the queue in options.directory, picking up the payloads left there by an earlier queue,
+  // unless another queue has the directory (see ownsDirectory). May throw runtime_error.
+  explicit SpillQueue(SpillQueueOptions options);
+  ~SpillQueue();
+
+  SpillQueue(const SpillQueue &) = delete;
+  SpillQueue &operator=(const SpillQueue &) = delete;
+
+  // Appends the payload. Returns false if it couldn't be kept.
+  bool push(const PayloadBuffer &payload, uint32_t num_traces, uint32_t format);
+
+  // Replaces the contents of payload with the oldest payload in the queue, and describes it in
+  // spilled. Returns false if the queue is empty.
+  bool front(PayloadBuffer &payload, SpilledPayload &spilled);
+
+  // Removes the payload that front() returned, unless it has been evicted since. If rejected, it's
+  // counted as rejected by the agent rather than replayed.
+  void pop(const SpilledPayload &spilled, bool rejected = false);
+
+  bool empty() const { return queued_payloads_ == 0; }
+
+  // Whether the queue has locked its directory. If another queue (eg. in another process sharing
+  // the configuration) already had, this one keeps nothing, so that they don't overwrite or send
+  // each other's payloads.
+  bool ownsDirectory() const { return lock_fd_ >= 0; }
+
+  SpillStats stats() const;
+
+ private:
+  struct Segment {
+    uint64_t sequence;
+    // The mapped file.
+    char *data;
+    // Where the next record goes, and where the oldest record that hasn't been taken is.
+    size_t write_offset;
+    size_t read_offset;
+    // How many times the header has been written, to find the newest copy.
+    uint64_t updates;
+    // Records that haven't been taken.
+    size_t records;
+  };
+
+  std::string segmentPath(uint64_t sequence) const;
+  // Maps the segment (creating it, or reading what's in it) and adds it to the end of segments_.
+  // Returns false if that can't be done.
+  bool openSegment(uint64_t sequence, bool create);
+  // Unmaps and deletes the oldest segment.
+  void removeOldestSegment();
+  void writeHeader(Segment &segment);
+
+  const SpillQueueOptions options_;
+  // The lock file in the directory, which is exclusively locked for as long as it's open. -1 if
+  // another queue has it.
+  int lock_fd_ = -1;
+  const size_t segment_size_;
+  const size_t max_segments_;
+  // Oldest first.
+  std::deque<Segment> segments_;
+  uint64_t next_sequence_ = 0;
+
+  std::atomic<uint64_t> spilled_payloads_{0};
+  std::atomic<uint64_t> replayed_payloads_{0};
+  std::atomic<uint64_t> rejected_payloads_{0};
+  std::atomic<uint64_t> evicted_payloads_{0};
+  std::atomic<uint64_t> dropped_payloads_{0};
+  std::atomic<uint64_t> queued_payloads_{0};
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_SPILL_QUEUE_H
@@ -0,0 +1,56 @@
+#ifndef DD_OPENTRACING_TELEMETRY_H
+#define DD_OPENTRACING_TELEMETRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace datadog {
+namespace opentracing {
+
+// A count that many threads add to at once, such as the number of spans started. Each thread adds
+// to one of a number of slots, in different cache lines, so that threads seldom contend on the
+// same one. Reading it sums the slots, so it may be a little behind while it's being added to.
+class TelemetryCounter {
+ public:
+  TelemetryCounter() {}
+  TelemetryCounter(const TelemetryCounter &) = delete;
+  TelemetryCounter &operator=(const TelemetryCounter &) = delete;
+
+  void add(uint64_t n = 1) { slots_[slot()].value.fetch_add(n, std::memory_order_relaxed); }
+
+  uint64_t value() const {
+    uint64_t sum = 0;
+    for (auto &slot : slots_) {
+      sum += slot.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+ private:
+  static const size_t num_slots = 16;
+  // Assumed size of a cache line.
+  static const size_t cache_line_size = 64;
+
+  struct Slot {
+    std::atomic<uint64_t> value{0};
+    // Keeps the values of neighbouring slots out of each others' cache lines.
+    char padding[cache_line_size - sizeof(std::atomic<uint64_t>)];
+  };
+
+  // The slot that the calling thread adds to. Threads are given slots in turn, the first time
+  // they add to any counter.
+  static size_t slot() {
+    static std::atomic<size_t> next_slot{0};
+    static thread_local size_t slot =
+        next_slot.fetch_add(1, std::memory_order_relaxed) % num_slots;
+    return slot;
+  }
+
+  Slot slots_[num_slots];
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_TELEMETRY_H
@@ -1,5 +1,7 @@
 #include <datadog/opentracing.h>
+#include <algorithm>
 #include <cstdlib>
+#include <iostream>
 
 #include "noopspan.h"
 #include "span.h"
@@ -16,24 +18,99 @@ uint64_t getId() {
   return distribution(source);
 }
 
+namespace {
+// The fraction of new traces being kept by the load shedder, on the root spans it keeps.
+const std::string load_shedding_rate_metric_key = "_dd.load_shedding_rate";
+
+WritingSpanBufferOptions spanBufferOptions(const TracerOptions &options) {
+  WritingSpanBufferOptions buffer_options;
+  buffer_options.num_shards = options.span_buffer_shards;
+  buffer_options.partial_flush_min_spans = options.partial_flush_min_spans;
+  buffer_options.partial_flush_max_age =
+      std::chrono::milliseconds(llabs(options.partial_flush_max_age_ms));
+  buffer_options.pending_trace_ttl =
+      std::chrono::milliseconds(llabs(options.pending_trace_ttl_ms));
+  buffer_options.flush_expired_traces = options.flush_expired_traces;
+  return buffer_options;
+}
+
+AgentWriterOptions agentWriterOptions(const TracerOptions &options) {
+  AgentWriterOptions writer_options;
+  writer_options.api_version =
+      options.agent_api_version == "v0.5" ? AgentApiVersion::v0_5 : AgentApiVersion::v0_3;
+  writer_options.compression.level = options.payload_compression_level;
+  writer_options.compression.min_size = options.payload_compression_min_bytes;
+  writer_options.socket_path = options.agent_socket_path;
+  writer_options.prewarm_connection = true;
+  writer_options.max_concurrent_requests = options.agent_max_concurrent_requests;
+  writer_options.max_payload_size = options.payload_max_bytes;
+  writer_options.spill.directory = options.spill_directory;
+  writer_options.spill.max_bytes = options.spill_max_bytes;
+  writer_options.circuit_breaker.failure_threshold = options.agent_circuit_breaker_failures;
+  writer_options.write_threshold_spans = options.write_threshold_spans;
+  writer_options.write_threshold_bytes = options.write_threshold_bytes;
+  if (options.queue_drop_policy == "drop_oldest") {
+    writer_options.drop_policy = DropPolicy::drop_oldest;
+  } else if (options.queue_drop_policy == "priority") {
+    writer_options.drop_policy = DropPolicy::priority;
+  }
+  return writer_options;
+}
+
+// Returns null if there's no memory budget.
+std::shared_ptr<MemoryBudget> memoryBudget(const TracerOptions &options) {
+  uint64_t max_bytes = options.memory_budget_bytes;
+  if (options.memory_budget_cgroup_fraction > 0) {
+    uint64_t limit = cgroupMemoryLimit();
+    if (limit != 0) {
+      max_bytes = std::max<uint64_t>(uint64_t(limit * options.memory_budget_cgroup_fraction), 1);
+    } else {
+      std::cerr << "No cgroup memory limit found, ignoring memory_budget_cgroup_fraction"
+                << std::endl;
+    }
+  }
+  if (max_bytes == 0) {
+    return nullptr;
+  }
+  return std::make_shared<MemoryBudget>(max_bytes);
+}
+
+std::shared_ptr<SpanBuffer> makeSpanBuffer(const TracerOptions &options,
+                                           std::shared_ptr<LoadShedder> load_shedder) {
+  // The span buffer and the writer share the budget.
+  auto buffer_options = spanBufferOptions(options);
+  auto writer_options = agentWriterOptions(options);
+  buffer_options.memory_budget = writer_options.memory_budget = memoryBudget(options);
+  writer_options.load_shedder = load_shedder;
+  return std::shared_ptr<SpanBuffer>{new WritingSpanBuffer{
+      std::make_shared<AgentWriter>(options.agent_host, options.agent_port,
+                                    std::chrono::milliseconds(llabs(options.write_period_ms)),
+                                    writer_options),
+      buffer_options}};
+}
+}  // namespace
+
 Tracer::Tracer(TracerOptions options)
-    : Tracer(options,
-             std::shared_ptr<SpanBuffer>{new WritingSpanBuffer{std::make_shared<AgentWriter>(
-                 options.agent_host, options.agent_port,
-                 std::chrono::milliseconds(llabs(options.write_period_ms)))}},
-             getRealTime, getId, ConstantRateSampler(options.sample_rate)) {}
+    : Tracer(options, options.load_shedding ? std::make_shared<LoadShedder>() : nullptr) {}
+
+Tracer::Tracer(TracerOptions options, std::shared_ptr<LoadShedder> load_shedder)
+    : Tracer(options, makeSpanBuffer(options, load_shedder), getRealTime, getId,
+             ConstantRateSampler(options.sample_rate), load_shedder) {}
 
 Tracer::Tracer(TracerOptions options, std::shared_ptr<SpanBuffer> buffer, TimeProvider get_time,
-               IdProvider get_id, SampleProvider sampler)
+               IdProvider get_id, SampleProvider sampler,
+               std::shared_ptr<LoadShedder> load_shedder)
     : opts_(options),
       buffer_(std::move(buffer)),
       get_time_(get_time),
       get_id_(get_id),
-      sampler_(sampler) {}
+      sampler_(sampler),
+      load_shedder_(std::move(load_shedder)) {}
 
 std::unique_ptr<ot::Span> Tracer::StartSpanWithOptions(ot::string_view operation_name,
                                                        const ot::StartSpanOptions &options) const
     noexcept try {
+  spans_started_.add();
   // Get a new span id.
   auto span_id = get_id_();
 
@@ -51,14 +128,38 @@ std::unique_ptr<ot::Span> Tracer::StartSpanWithOptions(ot::string_view operation
     }
   }
 
+  // Shed load before doing any of the work of building the trace.
+  double keep_rate = 1.0;
+  if (load_shedder_ != nullptr) {
+    bool shed;
+    // Decided by the first span of the trace in this process, including one with a remote parent,
+    // since whether a trace is shed isn't propagated.
+    if (parent_id == 0 || (span_context.pendingTrace() == nullptr && !span_context.shed())) {
+      keep_rate = load_shedder_->keepRate();
+      shed = !load_shedder_->keep(trace_id);
+      span_context.setShed(shed);
+    } else {
+      shed = span_context.shed();
+    }
+    if (shed) {
+      spans_sampled_out_.add();
+      return std::move(std::unique_ptr<ot::Span>{new NoopSpan{
+          shared_from_this(), span_id, trace_id, parent_id, std::move(span_context), options}});
+    }
+  }
+
   if (sampler_.sample(span_context)) {
     auto span = std::unique_ptr<ot::Span>{
         new Span{shared_from_this(), buffer_, get_time_, span_id, trace_id, parent_id,
                  std::move(span_context), get_time_(), opts_.service, opts_.type, operation_name,
                  operation_name, opts_.operation_name_override}};
     sampler_.tag(span);
+    if (keep_rate < 1.0) {
+      span->SetTag(load_shedding_rate_metric_key, keep_rate);
+    }
     return std::move(span);
   } else {
+    spans_sampled_out_.add();
     return std::move(std::unique_ptr<ot::Span>{new NoopSpan{
         shared_from_this(), span_id, trace_id, parent_id, std::move(span_context), options}});
   }
@@ -108,5 +209,13 @@ ot::expected<std::unique_ptr<ot::SpanContext>> Tracer::Extract(
 
 void Tracer::Close() noexcept {}
 
+TracerTelemetry Tracer::snapshot() const {
+  TracerTelemetry telemetry;
+  telemetry.spans_started = spans_started_.value();
+  telemetry.spans_sampled_out = spans_sampled_out_.value();
+  buffer_->addTelemetry(telemetry);
+  return telemetry;
+}
+
 }  // namespace opentracing
 }  // namespace datadog
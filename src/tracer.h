@@ -3,9 +3,11 @@
 
 #include <datadog/opentracing.h>
 #include "clock.h"
+#include "load_shedder.h"
 #include "sample.h"
 #include "span.h"
 #include "span_buffer.h"
+#include "telemetry.h"
 #include "writer.h"
 
 #include <functional>
@@ -30,9 +32,11 @@ class Tracer : public ot::Tracer, public std::enable_shared_from_this<Tracer> {
   // Creates a Tracer by copying the given options.
   Tracer(TracerOptions options);
 
-  // Creates a Tracer by copying the given options and injecting the given dependencies.
+  // Creates a Tracer by copying the given options and injecting the given dependencies. If there's
+  // a load_shedder, it decides whether to keep each new root span before the sampler does.
   Tracer(TracerOptions options, std::shared_ptr<SpanBuffer> buffer, TimeProvider get_time,
-         IdProvider get_id, SampleProvider sample);
+         IdProvider get_id, SampleProvider sample,
+         std::shared_ptr<LoadShedder> load_shedder = nullptr);
 
   Tracer() = delete;
 
@@ -59,7 +63,12 @@ class Tracer : public ot::Tracer, public std::enable_shared_from_this<Tracer> {
 
   void Close() noexcept override;
 
+  // Returns what the tracer, its span buffer and its writer have done so far.
+  TracerTelemetry snapshot() const;
+
  private:
+  Tracer(TracerOptions options, std::shared_ptr<LoadShedder> load_shedder);
+
   ot::expected<void> inject(const ot::SpanContext &sc, const ot::TextMapWriter &writer) const;
 
   const TracerOptions opts_;
@@ -68,6 +77,10 @@ class Tracer : public ot::Tracer, public std::enable_shared_from_this<Tracer> {
   TimeProvider get_time_;
   IdProvider get_id_;
   SampleProvider sampler_;
+  std::shared_ptr<LoadShedder> load_shedder_;
+  // Spans started, and those that weren't recorded because they were sampled out (or shed).
+  mutable TelemetryCounter spans_started_;
+  mutable TelemetryCounter spans_sampled_out_;
 };
 
 }  // namespace opentracing
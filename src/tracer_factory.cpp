@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <stdexcept>
 #include "tracer.h"
 
 using json = nlohmann::json;
@@ -18,6 +19,48 @@ namespace opentracing {
 // "sample_rate": A double, defaults to 1.0.
 // "operation_name_override": A string, if not empty it overrides the operation name (and the
 //     overridden operation name is recorded in the tag "operation").
+// "span_buffer_shards": A number. How many shards unfinished traces are split between, each with
+//     its own lock. 0 picks a number based on the number of CPUs. Defaults to 0.
+// "partial_flush_min_spans": A number. If not 0, the finished spans of an unfinished trace are
+//     sent once there are this many. Defaults to 0.
+// "partial_flush_max_age_ms": A number. If not 0, the finished spans of an unfinished trace are
+//     sent once the trace has been unfinished for this long. Defaults to 0.
+// "pending_trace_ttl_ms": A number. If not 0, traces that are still unfinished this long after
+//     they started are expired. Defaults to 0.
+// "flush_expired_traces": A boolean. If true, the spans of expired traces are sent, otherwise
+//     they're dropped. Defaults to true.
+// "agent_api_version": A string, "v0.3" or "v0.5", the version of the agent's traces endpoint to
+//     send to. v0.5 payloads are smaller. Falls back to v0.3 if the agent doesn't support v0.5.
+//     Defaults to "v0.3".
+// "payload_compression_level": A number. If not 0, payloads are gzipped at this zlib compression
+//     level, from 1 (fastest) to 9 (smallest). Defaults to 0.
+// "payload_compression_min_bytes": A number. Payloads smaller than this aren't compressed.
+//     Defaults to 1024.
+// "agent_socket_path": A string. If not empty, traces are sent to the agent over the Unix domain
+//     socket at this path, instead of to agent_host and agent_port.
+// "agent_max_concurrent_requests": A number. How many requests to the agent may be in progress at
+//     once. Defaults to 1.
+// "payload_max_bytes": A number. If not 0, traces are split into payloads of at most this many
+//     bytes. Defaults to 0.
+// "spill_directory": A string. If set, payloads that can't be sent to the agent are kept in this
+//     directory until they can be. Only one tracer (in any process) uses it at a time.
+// "spill_max_bytes": A number. The most disk space that kept payloads may take up. Defaults to
+//     67108864 (64MiB).
+// "memory_budget_bytes": A number. If not 0, the most memory that traces waiting to be sent may
+//     take up. Defaults to 0.
+// "memory_budget_cgroup_fraction": A number. If more than 0, the memory budget is this fraction
+//     of the cgroup's memory limit, if it has one. Defaults to 0.
+// "agent_circuit_breaker_failures": A number. If not 0, traces are dropped after this many
+//     requests to the agent fail in a row, until it can be reached again. Defaults to 0.
+// "load_shedding": A boolean. If true, fewer new traces are started while the writer can't keep
+//     up. Defaults to false.
+// "write_threshold_spans": A number. If not 0, traces are sent as soon as this many spans are
+//     waiting to be, rather than at the end of the write period. Defaults to 0.
+// "write_threshold_bytes": A number. If not 0, traces are sent as soon as they take up about this
+//     many bytes. Defaults to 0.
+// "queue_drop_policy": A string, "drop_newest", "drop_oldest" or "priority". Which traces are
+//     dropped when there are too many waiting to be sent. "priority" keeps traces with errors (or
+//     that are tagged to be kept) over others. Defaults to "drop_newest".
 // Extra keys will be ignored.
 template <class TracerImpl>
 ot::expected<std::shared_ptr<ot::Tracer>> TracerFactory<TracerImpl>::MakeTracer(
@@ -53,11 +96,92 @@ ot::expected<std::shared_ptr<ot::Tracer>> TracerFactory<TracerImpl>::MakeTracer(
     if (config.find("operation_name_override") != config.end()) {
       options.operation_name_override = config["operation_name_override"];
     }
+    if (config.find("span_buffer_shards") != config.end()) {
+      options.span_buffer_shards = config["span_buffer_shards"];
+    }
+    if (config.find("partial_flush_min_spans") != config.end()) {
+      options.partial_flush_min_spans = config["partial_flush_min_spans"];
+    }
+    if (config.find("partial_flush_max_age_ms") != config.end()) {
+      options.partial_flush_max_age_ms = config["partial_flush_max_age_ms"];
+    }
+    if (config.find("pending_trace_ttl_ms") != config.end()) {
+      options.pending_trace_ttl_ms = config["pending_trace_ttl_ms"];
+    }
+    if (config.find("flush_expired_traces") != config.end()) {
+      options.flush_expired_traces = config["flush_expired_traces"];
+    }
+    if (config.find("agent_api_version") != config.end()) {
+      options.agent_api_version = config["agent_api_version"];
+      if (options.agent_api_version != "v0.3" && options.agent_api_version != "v0.5") {
+        error_message = "configuration argument 'agent_api_version' must be \"v0.3\" or \"v0.5\"";
+        return ot::make_unexpected(std::make_error_code(std::errc::invalid_argument));
+      }
+    }
+    if (config.find("payload_compression_level") != config.end()) {
+      options.payload_compression_level = config["payload_compression_level"];
+      if (options.payload_compression_level < 0 || options.payload_compression_level > 9) {
+        error_message = "configuration argument 'payload_compression_level' must be from 0 to 9";
+        return ot::make_unexpected(std::make_error_code(std::errc::invalid_argument));
+      }
+    }
+    if (config.find("payload_compression_min_bytes") != config.end()) {
+      options.payload_compression_min_bytes = config["payload_compression_min_bytes"];
+    }
+    if (config.find("agent_socket_path") != config.end()) {
+      options.agent_socket_path = config["agent_socket_path"];
+    }
+    if (config.find("agent_max_concurrent_requests") != config.end()) {
+      options.agent_max_concurrent_requests = config["agent_max_concurrent_requests"];
+    }
+    if (config.find("payload_max_bytes") != config.end()) {
+      options.payload_max_bytes = config["payload_max_bytes"];
+    }
+    if (config.find("spill_directory") != config.end()) {
+      options.spill_directory = config["spill_directory"];
+    }
+    if (config.find("spill_max_bytes") != config.end()) {
+      options.spill_max_bytes = config["spill_max_bytes"];
+    }
+    if (config.find("memory_budget_bytes") != config.end()) {
+      options.memory_budget_bytes = config["memory_budget_bytes"];
+    }
+    if (config.find("memory_budget_cgroup_fraction") != config.end()) {
+      options.memory_budget_cgroup_fraction = config["memory_budget_cgroup_fraction"];
+    }
+    if (config.find("agent_circuit_breaker_failures") != config.end()) {
+      options.agent_circuit_breaker_failures = config["agent_circuit_breaker_failures"];
+    }
+    if (config.find("load_shedding") != config.end()) {
+      options.load_shedding = config["load_shedding"];
+    }
+    if (config.find("write_threshold_spans") != config.end()) {
+      options.write_threshold_spans = config["write_threshold_spans"];
+    }
+    if (config.find("write_threshold_bytes") != config.end()) {
+      options.write_threshold_bytes = config["write_threshold_bytes"];
+    }
+    if (config.find("queue_drop_policy") != config.end()) {
+      options.queue_drop_policy = config["queue_drop_policy"];
+      if (options.queue_drop_policy != "drop_newest" &&
+          options.queue_drop_policy != "drop_oldest" && options.queue_drop_policy != "priority") {
+        error_message =
+            "configuration argument 'queue_drop_policy' must be \"drop_newest\", \"drop_oldest\" "
+            "or \"priority\"";
+        return ot::make_unexpected(std::make_error_code(std::errc::invalid_argument));
+      }
+    }
   } catch (const nlohmann::detail::type_error &) {
     error_message = "configuration has an argument with an incorrect type";
     return ot::make_unexpected(std::make_error_code(std::errc::invalid_argument));
   }
-  return std::shared_ptr<ot::Tracer>{new TracerImpl{options}};
+  try {
+    return std::shared_ptr<ot::Tracer>{new TracerImpl{options}};
+  } catch (const std::runtime_error &error) {
+    // Eg. the spill directory can't be created, or the connection to the agent can't be set up.
+    error_message = error.what();
+    return ot::make_unexpected(std::make_error_code(std::errc::invalid_argument));
+  }
 } catch (const std::bad_alloc &) {
   return ot::make_unexpected(std::make_error_code(std::errc::not_enough_memory));
 }
@@ -1,5 +1,8 @@
 #include "transport.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
 #include <cstring>
 #include <stdexcept>
 #include <string>
@@ -28,6 +31,13 @@ CurlHandle::CurlHandle() {
     throw std::runtime_error(std::string("Unable to set curl write callback: ") +
                              curl_easy_strerror(rcode));
   }
+  // Curl keeps the connection open between requests unless told not to, but the idle time between
+  // flushes can be long enough for it to be dropped along the way. TCP keep-alive probes stop
+  // that. Not supported by old versions of curl, which just won't probe.
+  curl_easy_setopt(handle_, CURLOPT_TCP_KEEPALIVE, 1L);
+  // Without this, curl sends "Expect: 100-continue" with large bodies and waits for the agent to
+  // respond before sending the body, costing a round trip. Curl doesn't send empty headers.
+  setHeader("Expect", "");
 }
 
 CurlHandle::~CurlHandle() { tearDownHandle(); }
@@ -47,30 +57,156 @@ CURLcode CurlHandle::setopt(CURLoption key, long value) {
 
 void CurlHandle::setHeaders(std::map<std::string, std::string> headers) {
   for (auto& header : headers) {
-    headers_[header.first] = header.second;  // Overwrite.
+    setHeader(header.first, header.second);
   }
 }
 
+void CurlHandle::setHeader(const std::string& name, const std::string& value) {
+  std::string& line = headers_[name];
+  const char* previous_data = line.data();
+  bool added = line.empty();
+  // Overwrite. Only allocates if the line doesn't fit in its current memory. Curl doesn't send a
+  // header with nothing after the colon, so that's how an empty value removes it.
+  line.assign(name).append(value.empty() ? ":" : ": ").append(value);
+  if (added || line.data() != previous_data) {
+    header_list_stale_ = true;
+  }
+}
+
+CURLcode CurlHandle::updateHeaderList() {
+  if (header_list_stale_) {
+    // curl_slist is a plain linked list, so it can point to our lines rather than to copies.
+    header_list_.resize(headers_.size());
+    size_t i = 0;
+    for (auto& header : headers_) {
+      header_list_[i].data = &header.second[0];
+      header_list_[i].next = i + 1 < header_list_.size() ? &header_list_[i + 1] : nullptr;
+      i++;
+    }
+    CURLcode rcode = curl_easy_setopt(handle_, CURLOPT_HTTPHEADER,
+                                      header_list_.empty() ? nullptr : &header_list_[0]);
+    if (rcode != CURLE_OK) {
+      std::strncpy(curl_error_buffer_, "Unable to write headers", CURL_ERROR_SIZE - 1);
+      return rcode;
+    }
+    header_list_stale_ = false;
+  }
+  return CURLE_OK;
+}
+
 CURLcode CurlHandle::perform() {
-  // TODO[willgittoes-dd]: Find a way to not copy these strings each time, without unreasonable
-  // coupling to libcurl internals.
-  struct curl_slist* http_headers = nullptr;
-  for (auto& pair : headers_) {
-    std::string header = pair.first + ": " + pair.second;
-    http_headers = curl_slist_append(http_headers, header.c_str());
-  }
-  CURLcode rcode = curl_easy_setopt(handle_, CURLOPT_HTTPHEADER, http_headers);
+  CURLcode rcode = updateHeaderList();
   if (rcode != CURLE_OK) {
-    std::strncpy(curl_error_buffer_, "Unable to write headers", CURL_ERROR_SIZE - 1);
-    curl_slist_free_all(http_headers);
     return rcode;
   }
-  rcode = curl_easy_perform(handle_);
-  curl_slist_free_all(http_headers);
-  return rcode;
+  return curl_easy_perform(handle_);
 };
 
+CURLcode CurlHandle::getinfo(CURLINFO key, long* value) {
+  return curl_easy_getinfo(handle_, key, value);
+}
+
 std::string CurlHandle::getError() { return std::string(curl_error_buffer_); };
 
+CurlMultiHandle::CurlMultiHandle() {
+  if (pipe(wake_up_pipe_) != 0) {
+    throw std::runtime_error(std::string("Unable to create pipe: ") + std::strerror(errno));
+  }
+  // Neither end may block: wakeUp can be called any number of times before poll drains the pipe.
+  for (int fd : wake_up_pipe_) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  curl_global_init(CURL_GLOBAL_ALL);
+  handle_ = curl_multi_init();
+  if (handle_ == nullptr) {
+    close(wake_up_pipe_[0]);
+    close(wake_up_pipe_[1]);
+    curl_global_cleanup();
+    throw std::runtime_error("Unable to create curl multi handle");
+  }
+}
+
+CurlMultiHandle::~CurlMultiHandle() {
+  for (auto& request : requests_) {
+    curl_multi_remove_handle(handle_, request.first);
+  }
+  curl_multi_cleanup(handle_);
+  curl_global_cleanup();
+  close(wake_up_pipe_[0]);
+  close(wake_up_pipe_[1]);
+}
+
+CURLMcode CurlMultiHandle::add(Handle* handle) {
+  auto curl_handle = dynamic_cast<CurlHandle*>(handle);
+  if (curl_handle == nullptr) {
+    return CURLM_BAD_EASY_HANDLE;
+  }
+  if (curl_handle->updateHeaderList() != CURLE_OK) {
+    return CURLM_INTERNAL_ERROR;
+  }
+  CURLMcode rcode = curl_multi_add_handle(handle_, curl_handle->handle_);
+  if (rcode == CURLM_OK) {
+    requests_[curl_handle->handle_] = handle;
+  }
+  return rcode;
+}
+
+CURLMcode CurlMultiHandle::remove(Handle* handle) {
+  auto curl_handle = dynamic_cast<CurlHandle*>(handle);
+  if (curl_handle == nullptr || requests_.erase(curl_handle->handle_) == 0) {
+    return CURLM_OK;  // Not in progress.
+  }
+  return curl_multi_remove_handle(handle_, curl_handle->handle_);
+}
+
+CURLMcode CurlMultiHandle::poll(std::chrono::milliseconds timeout,
+                                std::vector<std::pair<Handle*, CURLcode>>& done) {
+  int running = 0;
+  CURLMcode rcode = curl_multi_perform(handle_, &running);
+  if (rcode != CURLM_OK) {
+    return rcode;
+  }
+  size_t num_done = done.size();
+  takeDone(done);
+  if (done.size() > num_done) {
+    return CURLM_OK;
+  }
+  // Curl shortens the timeout if one of the requests needs attention (eg. to time out) sooner.
+  curl_waitfd wake_up{wake_up_pipe_[0], CURL_WAIT_POLLIN, 0};
+  rcode = curl_multi_wait(handle_, &wake_up, 1, int(timeout.count()), nullptr);
+  if (rcode != CURLM_OK) {
+    return rcode;
+  }
+  char buffer[64];
+  while (read(wake_up_pipe_[0], buffer, sizeof(buffer)) > 0) {
+  }
+  rcode = curl_multi_perform(handle_, &running);
+  takeDone(done);
+  return rcode;
+}
+
+void CurlMultiHandle::takeDone(std::vector<std::pair<Handle*, CURLcode>>& done) {
+  int remaining = 0;
+  while (CURLMsg* message = curl_multi_info_read(handle_, &remaining)) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+    auto request = requests_.find(message->easy_handle);
+    if (request == requests_.end()) {
+      continue;
+    }
+    done.emplace_back(request->second, message->data.result);
+    curl_multi_remove_handle(handle_, message->easy_handle);
+    requests_.erase(request);
+  }
+}
+
+void CurlMultiHandle::wakeUp() {
+  char byte = 0;
+  ssize_t written = write(wake_up_pipe_[1], &byte, 1);
+  (void)written;  // If the pipe is full, poll will wake up anyway.
+}
+
 }  // namespace opentracing
 }  // namespace datadog
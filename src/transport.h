@@ -2,8 +2,10 @@
 #define DD_OPENTRACING_TRANSPORT_H
 
 #include <curl/curl.h>
+#include <chrono>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace datadog {
 namespace opentracing {
@@ -16,11 +18,20 @@ class Handle {
   virtual CURLcode setopt(CURLoption key, const char* value) = 0;
   virtual CURLcode setopt(CURLoption key, long value) = 0;
   virtual void setHeaders(std::map<std::string, std::string> headers) = 0;
+  // Sets a single header, replacing any previous value.
+  virtual void setHeader(const std::string& name, const std::string& value) = 0;
   virtual CURLcode perform() = 0;
+  // Gets information about the last transfer, eg. CURLINFO_RESPONSE_CODE.
+  virtual CURLcode getinfo(CURLINFO key, long* value) = 0;
   virtual std::string getError() = 0;
 };
 
 // A Handle that uses real curl to really send things.
+//
+// The connection to the agent is kept open between requests, so that each one doesn't need a new
+// one. The list of headers given to curl is built once, and only rebuilt when a header is added;
+// changing the value of an existing header (eg. the trace count on each request) patches it in
+// place.
 class CurlHandle : public Handle {
  public:
   // May throw runtime_error.
@@ -29,20 +40,75 @@ class CurlHandle : public Handle {
   CURLcode setopt(CURLoption key, const char* value) override;
   CURLcode setopt(CURLoption key, long value) override;
   void setHeaders(std::map<std::string, std::string> headers) override;
+  void setHeader(const std::string& name, const std::string& value) override;
   CURLcode perform() override;
+  CURLcode getinfo(CURLINFO key, long* value) override;
   std::string getError() override;
 
  private:
+  friend class CurlMultiHandle;
+
+  // Gives curl the list of headers, if it has changed since it was last given.
+  CURLcode updateHeaderList();
   // For things that need cleaning up if the constructor fails as well as on destruction.
   void tearDownHandle();
 
   CURL* handle_;
-  // Not unordered, just so that the headers are always in the same order. Makes testing just a bit
-  // easier, and the number of headers is so low that the log(n) insert doesn't matter.
+  // Each header's name, and its line ("name: value"). Not unordered, just so that the headers are
+  // always in the same order. Makes testing just a bit easier, and the number of headers is so low
+  // that the log(n) insert doesn't matter.
   std::map<std::string, std::string> headers_;
+  // The list of headers given to curl, which points to the lines in headers_. Rebuilt before a
+  // request if a line has been added, or has moved in memory.
+  std::vector<curl_slist> header_list_;
+  bool header_list_stale_ = true;
   char curl_error_buffer_[CURL_ERROR_SIZE];
 };
 
+// Sends the requests of several Handles at once, from a single thread. This interface exists to
+// make testing AgentWriter easier.
+class MultiHandle {
+ public:
+  MultiHandle(){};
+  virtual ~MultiHandle(){};
+  // Starts sending the handle's request. The handle mustn't be changed or destroyed until the
+  // request is done (returned by poll) or removed.
+  virtual CURLMcode add(Handle* handle) = 0;
+  // Abandons the handle's request, if it's in progress.
+  virtual CURLMcode remove(Handle* handle) = 0;
+  // Sends and receives whatever it can without blocking. If no request is done, waits up to
+  // timeout for one of them to progress (or for wakeUp). Appends each request that's done to
+  // done, with its result.
+  virtual CURLMcode poll(std::chrono::milliseconds timeout,
+                         std::vector<std::pair<Handle*, CURLcode>>& done) = 0;
+  // Makes a call to poll that's waiting return early. May be called from any thread.
+  virtual void wakeUp() = 0;
+};
+
+// A MultiHandle that uses curl's multi interface. Only sends requests of CurlHandles.
+class CurlMultiHandle : public MultiHandle {
+ public:
+  // May throw runtime_error.
+  CurlMultiHandle();
+  ~CurlMultiHandle() override;
+  CURLMcode add(Handle* handle) override;
+  CURLMcode remove(Handle* handle) override;
+  CURLMcode poll(std::chrono::milliseconds timeout,
+                 std::vector<std::pair<Handle*, CURLcode>>& done) override;
+  void wakeUp() override;
+
+ private:
+  // Moves the requests that curl says are done from requests_ to done.
+  void takeDone(std::vector<std::pair<Handle*, CURLcode>>& done);
+
+  CURLM* handle_;
+  // The requests in progress, by their curl handle.
+  std::map<CURL*, Handle*> requests_;
+  // A pipe that poll waits on along with the requests' sockets, so that wakeUp can interrupt it.
+  // Used rather than curl_multi_wakeup, which needs curl 7.68.
+  int wake_up_pipe_[2];
+};
+
 }  // namespace opentracing
 }  // namespace datadog
 
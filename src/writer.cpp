@@ -1,45 +1,182 @@
 #include "writer.h"
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <limits>
+#include <list>
 #include "version_number.h"
 
 namespace datadog {
 namespace opentracing {
 
 namespace {
-const std::string agent_api_path = "/v0.3/traces";
+const std::string agent_api_path_v0_3 = "/v0.3/traces";
+const std::string agent_api_path_v0_5 = "/v0.5/traces";
 const std::string agent_protocol = "http://";
+const std::string trace_count_header = "X-Datadog-Trace-Count";
+const std::string content_encoding_header = "Content-Encoding";
 const size_t max_queued_traces = 7000;
+// How a spilled payload is encoded, kept in SpilledPayload::format.
+const uint32_t spilled_v0_5 = 1;
+const uint32_t spilled_gzip = 2;
 // Retry sending traces to agent a couple of times. Any more than that and the agent won't accept
 // them.
 // write_period 1s + timeout 2s + (retry & timeout) 2.5s + (retry and timeout) 4.5s = 10s.
 const std::vector<std::chrono::milliseconds> default_retry_periods{
     std::chrono::milliseconds(500), std::chrono::milliseconds(2500)};
+// However the retries are spaced out, a payload isn't sent again more than this long after it's
+// encoded, so that (with the write period and the timeout) it's still within those 10s.
+const std::chrono::seconds max_retry_age{7};
+// At most this many failed payloads wait to be sent again by a writer with one handle. Any more
+// are given up on.
+const size_t max_queued_retries = 8;
 // Agent communication timeout.
 const long default_timeout_ms = 2000L;
+// A write makes room for its trace by evicting at most this many queued traces.
+const int max_evictions_per_write = 8;
+// A write of a trace with errors looks at most this many spans of queued traces, in all, for a
+// trace without errors to evict. Bounds the time it takes, since each is looked at in turn.
+const size_t max_priority_eviction_scan_spans = 64;
+// Tags that mark a span as worth keeping, along with its error field.
+const std::string error_tag = "error";
+const std::string sampling_priority_tag = "sampling.priority";
+const std::string manual_keep_tag = "manual.keep";
+const double user_keep_sampling_priority = 2;
+
+const std::string &apiPath(AgentApiVersion api_version) {
+  return api_version == AgentApiVersion::v0_5 ? agent_api_path_v0_5 : agent_api_path_v0_3;
+}
+
+std::unique_ptr<MultiHandle> makeMultiHandle(const AgentWriterOptions &options) {
+  if (options.max_concurrent_requests <= 1) {
+    return nullptr;
+  }
+  return std::unique_ptr<MultiHandle>{new CurlMultiHandle{}};
+}
+
+std::vector<std::unique_ptr<Handle>> makeHandles(const AgentWriterOptions &options) {
+  std::vector<std::unique_ptr<Handle>> handles;
+  for (size_t i = 0; i < std::max<size_t>(options.max_concurrent_requests, 1); i++) {
+    handles.emplace_back(new CurlHandle{});
+  }
+  return handles;
+}
+
+// Whether the trace has a span with an error, or one that the user has asked to be kept. Looks at
+// no more than max_spans spans, which it counts down, and assumes the trace has priority if it
+// can't tell within them.
+bool isPriorityTrace(const Trace &trace, size_t &max_spans) {
+  for (auto &span : *trace) {
+    if (max_spans == 0) {
+      return true;
+    }
+    max_spans--;
+    if (span->error != 0 || span->meta.count(manual_keep_tag) != 0) {
+      return true;
+    }
+    auto tag = span->meta.find(error_tag);
+    if (tag != span->meta.end() && tag->second == "true") {
+      return true;
+    }
+    tag = span->meta.find(sampling_priority_tag);
+    if (tag != span->meta.end() &&
+        std::strtod(tag->second.c_str(), nullptr) >= user_keep_sampling_priority) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the agent responded that it failed, or is too busy, to take the request (with a 5xx or
+// 429 status), so that it should be sent again later. Logs the status if so.
+bool agentFailed(Handle &handle) {
+  long response_code = 0;
+  if (handle.getinfo(CURLINFO_RESPONSE_CODE, &response_code) != CURLE_OK ||
+      (response_code < 500 && response_code != 429)) {
+    return false;
+  }
+  std::cerr << "Error sending traces to agent: agent responded with status " << response_code
+            << std::endl;
+  return true;
+}
+
+std::vector<std::unique_ptr<Handle>> singleHandle(std::unique_ptr<Handle> handle) {
+  std::vector<std::unique_ptr<Handle>> handles;
+  handles.push_back(std::move(handle));
+  return handles;
+}
 }  // namespace
 
-AgentWriter::AgentWriter(std::string host, uint32_t port, std::chrono::milliseconds write_period)
-    : AgentWriter(std::unique_ptr<Handle>{new CurlHandle{}}, config::tracer_version, write_period,
-                  max_queued_traces, default_retry_periods, host, port){};
+AgentWriter::AgentWriter(std::string host, uint32_t port, std::chrono::milliseconds write_period,
+                         AgentWriterOptions options)
+    : AgentWriter(makeMultiHandle(options), makeHandles(options), config::tracer_version,
+                  write_period, max_queued_traces, default_retry_periods, host, port, options){};
 
 AgentWriter::AgentWriter(std::unique_ptr<Handle> handle, std::string tracer_version,
                          std::chrono::milliseconds write_period, size_t max_queued_traces,
                          std::vector<std::chrono::milliseconds> retry_periods, std::string host,
-                         uint32_t port)
+                         uint32_t port, AgentWriterOptions options)
+    : AgentWriter(nullptr, singleHandle(std::move(handle)), tracer_version, write_period,
+                  max_queued_traces, retry_periods, host, port, options){};
+
+AgentWriter::AgentWriter(std::unique_ptr<MultiHandle> multi_handle,
+                         std::vector<std::unique_ptr<Handle>> handles, std::string tracer_version,
+                         std::chrono::milliseconds write_period, size_t max_queued_traces,
+                         std::vector<std::chrono::milliseconds> retry_periods, std::string host,
+                         uint32_t port, AgentWriterOptions options)
     : tracer_version_(tracer_version),
       write_period_(write_period),
-      max_queued_traces_(max_queued_traces),
-      retry_periods_(retry_periods) {
-  setUpHandle(handle, host, port);
-  startWriting(std::move(handle));
+      retry_periods_(retry_periods),
+      api_version_(options.api_version),
+      prewarm_connection_(options.prewarm_connection),
+      max_payload_size_(options.max_payload_size == 0 ? std::numeric_limits<size_t>::max()
+                                                      : options.max_payload_size),
+      compressor_(options.compression),
+      multi_handle_(std::move(multi_handle)),
+      memory_budget_(options.memory_budget),
+      breaker_(options.circuit_breaker),
+      load_shedder_(options.load_shedder),
+      write_threshold_spans_(options.write_threshold_spans),
+      write_threshold_bytes_(options.write_threshold_bytes),
+      drop_policy_(options.drop_policy),
+      traces_(max_queued_traces) {
+  if (handles.empty()) {
+    throw std::runtime_error("AgentWriter needs at least one handle");
+  }
+  if (!options.spill.directory.empty()) {
+    spill_.reset(new SpillQueue{options.spill});
+    if (!spill_->ownsDirectory()) {
+      spill_.reset();
+    }
+  }
+  for (auto &handle : handles) {
+    setUpHandle(handle, host, port, options.socket_path);
+  }
+  if (multi_handle_ != nullptr) {
+    startWritingConcurrently(std::move(handles));
+  } else {
+    startWriting(std::move(handles[0]));
+  }
 }
 
-void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port) {
+void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port,
+                              const std::string &socket_path) {
   // Some options are the same for all actions, set them here.
   // Set the agent URI.
   std::stringstream agent_uri;
-  agent_uri << agent_protocol << host << ":" << std::to_string(port) << agent_api_path;
-  auto rcode = handle->setopt(CURLOPT_URL, agent_uri.str().c_str());
+  if (socket_path.empty()) {
+    agent_uri << agent_protocol << host << ":" << std::to_string(port);
+  } else {
+    auto rcode = handle->setopt(CURLOPT_UNIX_SOCKET_PATH, socket_path.c_str());
+    if (rcode != CURLE_OK) {
+      throw std::runtime_error(std::string("Unable to set agent socket path: ") +
+                               curl_easy_strerror(rcode));
+    }
+    // The host is only used for the Host header.
+    agent_uri << agent_protocol << "localhost";
+  }
+  agent_url_ = agent_uri.str();
+  auto rcode = useApiVersion(*handle, api_version_);
   if (rcode != CURLE_OK) {
     throw std::runtime_error(std::string("Unable to set agent URL: ") + curl_easy_strerror(rcode));
   }
@@ -54,6 +191,115 @@ void AgentWriter::setUpHandle(std::unique_ptr<Handle> &handle, std::string host,
                       {"Datadog-Meta-Tracer-Version", tracer_version_}});
 }  // namespace opentracing
 
+CURLcode AgentWriter::useApiVersion(Handle &handle, AgentApiVersion api_version) {
+  return handle.setopt(CURLOPT_URL, (agent_url_ + apiPath(api_version)).c_str());
+}
+
+void AgentWriter::encode(Request &request) {
+  if (request.api_version != api_version_) {
+    CURLcode rcode = useApiVersion(*request.handle, api_version_);
+    if (rcode != CURLE_OK) {
+      std::cerr << "Error setting agent URL: " << curl_easy_strerror(rcode) << std::endl;
+    } else {
+      request.api_version = api_version_;
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+  request.payload.clear();
+  if (request.api_version == AgentApiVersion::v0_5) {
+    request.end = string_table_encoder_.encode(request.payload, request.batch, request.begin,
+                                               max_payload_size_);
+  } else {
+    request.end = encodeTraces(request.payload, request.batch, request.begin, max_payload_size_);
+  }
+  request.body = &request.payload;
+  if (compressor_.enabled() && compressor_.compress(request.payload, request.compressed_payload)) {
+    request.body = &request.compressed_payload;
+  }
+  request.encoded_at = std::chrono::steady_clock::now();
+  setContentEncoding(request);
+  bytes_encoded_.fetch_add(request.payload.size(), std::memory_order_relaxed);
+  encode_time_ns_.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(request.encoded_at - start).count(),
+      std::memory_order_relaxed);
+}
+
+void AgentWriter::setContentEncoding(Request &request) {
+  // A spilled payload that's been sent may have been compressed.
+  if (compressor_.enabled() || spill_ != nullptr) {
+    // Curl doesn't send headers with empty values.
+    request.handle->setHeader(content_encoding_header,
+                              request.body == &request.compressed_payload ? "gzip" : "");
+  }
+}
+
+bool AgentWriter::fallBack(Request &request) {
+  long response_code = 0;
+  if (request.api_version != AgentApiVersion::v0_5 ||
+      request.handle->getinfo(CURLINFO_RESPONSE_CODE, &response_code) != CURLE_OK ||
+      response_code != 404) {
+    return false;
+  }
+  stopUsingV0_5();
+  encode(request);
+  return true;
+}
+
+void AgentWriter::stopUsingV0_5() {
+  if (api_version_ == AgentApiVersion::v0_5) {
+    // The agent is too old for v0.5, so send all later traces to v0.3.
+    std::cerr << "Agent doesn't support " << agent_api_path_v0_5 << ", using "
+              << agent_api_path_v0_3 << " instead" << std::endl;
+    api_version_ = AgentApiVersion::v0_3;
+  }
+}
+
+void AgentWriter::popSpilled(Request &request) {
+  long response_code = 0;
+  if (request.handle->getinfo(CURLINFO_RESPONSE_CODE, &response_code) != CURLE_OK ||
+      response_code < 400) {
+    spill_->pop(request.spilled);
+    return;
+  }
+  if (response_code == 404 && request.api_version == AgentApiVersion::v0_5) {
+    // Its traces can't be encoded again for v0.3, since only the payload was kept.
+    stopUsingV0_5();
+  }
+  std::cerr << "Agent rejected a spilled payload of " << request.spilled.num_traces
+            << " trace(s) with status " << response_code << ", dropping it" << std::endl;
+  spill_->pop(request.spilled, true);
+}
+
+void AgentWriter::spill(Request &request) {
+  if (spill_ == nullptr || request.begin == request.end) {
+    return;
+  }
+  uint32_t format = (request.api_version == AgentApiVersion::v0_5 ? spilled_v0_5 : 0) |
+                    (request.body == &request.compressed_payload ? spilled_gzip : 0);
+  spill_->push(*request.body, uint32_t(request.end - request.begin), format);
+}
+
+bool AgentWriter::loadSpilled(Request &request) {
+  if (spill_ == nullptr || !spill_->front(request.payload, request.spilled)) {
+    return false;
+  }
+  auto api_version = (request.spilled.format & spilled_v0_5) != 0 ? AgentApiVersion::v0_5
+                                                                  : AgentApiVersion::v0_3;
+  if (request.api_version != api_version) {
+    CURLcode rcode = useApiVersion(*request.handle, api_version);
+    if (rcode != CURLE_OK) {
+      std::cerr << "Error setting agent URL: " << curl_easy_strerror(rcode) << std::endl;
+      return false;
+    }
+    request.api_version = api_version;
+  }
+  request.handle->setHeader(content_encoding_header,
+                            (request.spilled.format & spilled_gzip) != 0 ? "gzip" : "");
+  request.body = &request.payload;
+  request.replaying = true;
+  return true;
+}
+
 AgentWriter::~AgentWriter() { stop(); }
 
 void AgentWriter::stop() {
@@ -65,112 +311,822 @@ void AgentWriter::stop() {
     stop_writing_ = true;
   }
   condition_.notify_all();
+  if (multi_handle_ != nullptr) {
+    multi_handle_->wakeUp();
+  }
   worker_->join();
 }
 
 void AgentWriter::write(Trace trace) {
-  std::unique_lock<std::mutex> lock(mutex_);
   if (stop_writing_) {
     return;
   }
-  if (traces_.size() >= max_queued_traces_) {
+  if (breaker_.isOpen()) {
+    breaker_.recordDroppedTraces(1);
     return;
   }
-  traces_.push_back(std::move(trace));
+  if (load_shedder_ != nullptr) {
+    written_traces_.fetch_add(1, std::memory_order_relaxed);
+  }
+  size_t size = 0;
+  if (memory_budget_ != nullptr || write_threshold_bytes_ != 0) {
+    size = estimatedSize(trace);
+  }
+  Eviction eviction;
+  eviction.scan_spans = max_priority_eviction_scan_spans;
+  if (memory_budget_ != nullptr) {
+    while (!memory_budget_->reserve(size)) {
+      if (evict(trace, eviction)) {
+        continue;
+      }
+      dropped_memory_budget_.add();
+      if (load_shedder_ != nullptr) {
+        overload_dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (eviction.unqueued == nullptr) {
+        return;  // Dropped.
+      }
+      // Dropped, and the queued trace that couldn't be put back is written instead. Its memory is
+      // still reserved.
+      trace = std::move(eviction.unqueued);
+      size = estimatedSize(trace);
+      break;
+    }
+  }
+  // Counted before the trace is queued, so that the worker can't take it before it's counted.
+  size_t num_spans = 0;
+  size_t queued_spans = 0;
+  if (write_threshold_spans_ != 0) {
+    num_spans = trace->size();
+    queued_spans = queued_spans_.fetch_add(num_spans, std::memory_order_relaxed) + num_spans;
+  }
+  size_t queued_bytes = 0;
+  if (write_threshold_bytes_ != 0) {
+    queued_bytes = queued_bytes_.fetch_add(size, std::memory_order_relaxed) + size;
+  }
+  while (!traces_.push(std::move(trace))) {
+    if (evict(trace, eviction)) {
+      continue;
+    }
+    // Dropped, since the queue is full.
+    dropped_queue_full_.add();
+    if (write_threshold_spans_ != 0) {
+      queued_spans_.fetch_sub(num_spans, std::memory_order_relaxed);
+    }
+    if (write_threshold_bytes_ != 0) {
+      queued_bytes_.fetch_sub(size, std::memory_order_relaxed);
+    }
+    if (memory_budget_ != nullptr) {
+      memory_budget_->release(size);
+    }
+    if (load_shedder_ != nullptr) {
+      overload_dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (eviction.unqueued == nullptr) {
+      return;
+    }
+    // The queued trace that couldn't be put back is written instead, in the place of this one. Its
+    // memory is still reserved.
+    trace = std::move(eviction.unqueued);
+    if (write_threshold_spans_ != 0) {
+      num_spans = trace->size();
+      queued_spans = queued_spans_.fetch_add(num_spans, std::memory_order_relaxed) + num_spans;
+    }
+    if (memory_budget_ != nullptr || write_threshold_bytes_ != 0) {
+      size = estimatedSize(trace);
+    }
+    if (write_threshold_bytes_ != 0) {
+      queued_bytes = queued_bytes_.fetch_add(size, std::memory_order_relaxed) + size;
+    }
+  }
+  bool reached = (write_threshold_spans_ != 0 && queued_spans >= write_threshold_spans_) ||
+                 (write_threshold_bytes_ != 0 && queued_bytes >= write_threshold_bytes_);
+  if (reached && !write_early_.load(std::memory_order_relaxed) &&
+      !write_early_.exchange(true)) {
+    // Only this write wakes the worker. Taking the lock means that the worker can't miss the
+    // signal between checking for it and waiting.
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    condition_.notify_all();
+    if (multi_handle_ != nullptr) {
+      multi_handle_->wakeUp();
+    }
+  }
 };
 
+CompressionStats AgentWriter::compressionStats() const { return compressor_.stats(); }
+
+void AgentWriter::clearBatch(std::vector<Trace> &batch) {
+  if (memory_budget_ != nullptr) {
+    size_t size = 0;
+    for (auto &trace : batch) {
+      size += estimatedSize(trace);
+    }
+    memory_budget_->release(size);
+  }
+  batch.clear();  // Frees the traces, keeps the capacity.
+}
+
+bool AgentWriter::popQueued(Trace &trace) {
+  if (!traces_.pop(trace)) {
+    return false;
+  }
+  if (write_threshold_spans_ != 0) {
+    queued_spans_.fetch_sub(trace->size(), std::memory_order_relaxed);
+  }
+  if (write_threshold_bytes_ != 0) {
+    queued_bytes_.fetch_sub(estimatedSize(trace), std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool AgentWriter::evict(const Trace &incoming, Eviction &eviction) {
+  if (eviction.evictions++ >= max_evictions_per_write) {
+    return false;
+  }
+  Trace trace;
+  if (drop_policy_ == DropPolicy::drop_oldest) {
+    if (!popQueued(trace)) {
+      return false;
+    }
+    evicted_oldest_.add();
+    discard(trace);
+    return true;
+  }
+  if (drop_policy_ != DropPolicy::priority) {
+    return false;
+  }
+  if (!eviction.checked_priority) {
+    size_t max_spans = std::numeric_limits<size_t>::max();
+    eviction.priority = isPriorityTrace(incoming, max_spans);
+    eviction.checked_priority = true;
+  }
+  if (!eviction.priority) {
+    return false;
+  }
+  // Look for the oldest trace without errors, moving those with them to the back of the queue.
+  while (eviction.scan_spans > 0 && popQueued(trace)) {
+    if (!isPriorityTrace(trace, eviction.scan_spans)) {
+      evicted_low_priority_.add();
+      discard(trace);
+      return true;
+    }
+    size_t num_spans = trace->size();
+    size_t size = write_threshold_bytes_ != 0 ? estimatedSize(trace) : 0;
+    if (!traces_.push(std::move(trace))) {
+      // A concurrent write took its place. Rather than dropping a trace with errors to make room
+      // for another, this gives up, and the caller writes it instead of the incoming trace.
+      eviction.unqueued = std::move(trace);
+      return false;
+    }
+    if (write_threshold_spans_ != 0) {
+      queued_spans_.fetch_add(num_spans, std::memory_order_relaxed);
+    }
+    if (write_threshold_bytes_ != 0) {
+      queued_bytes_.fetch_add(size, std::memory_order_relaxed);
+    }
+  }
+  return false;
+}
+
+void AgentWriter::discard(Trace &trace) {
+  if (memory_budget_ != nullptr) {
+    memory_budget_->release(estimatedSize(trace));
+  }
+  if (load_shedder_ != nullptr) {
+    overload_dropped_traces_.fetch_add(1, std::memory_order_relaxed);
+  }
+  trace.reset();
+}
+
+void AgentWriter::dropQueuedTraces(std::vector<Trace> &batch) {
+  Trace trace;
+  while (popQueued(trace)) {
+    batch.push_back(std::move(trace));
+  }
+  breaker_.recordDroppedTraces(batch.size());
+  clearBatch(batch);
+}
+
+void AgentWriter::reportLoad() {
+  if (load_shedder_ == nullptr) {
+    return;
+  }
+  uint64_t written = written_traces_.load(std::memory_order_relaxed);
+  uint64_t dropped = overload_dropped_traces_.load(std::memory_order_relaxed);
+  load_shedder_->update(double(traces_.size()) / double(std::max<size_t>(traces_.capacity(), 1)),
+                        written - reported_written_traces_, dropped - reported_dropped_traces_);
+  reported_written_traces_ = written;
+  reported_dropped_traces_ = dropped;
+}
+
+bool AgentWriter::scheduleRetry(Request &request,
+                                std::chrono::steady_clock::time_point now) const {
+  if (request.failures >= retry_periods_.size()) {
+    return false;
+  }
+  auto retry_at = now + retry_periods_[request.failures];
+  if (retry_at - request.encoded_at > max_retry_age) {
+    return false;
+  }
+  request.failures++;
+  request.retry_at = retry_at;
+  return true;
+}
+
+CircuitBreakerStats AgentWriter::circuitBreakerStats() const { return breaker_.stats(); }
+
+DropStats AgentWriter::dropStats() const {
+  DropStats stats;
+  stats.queue_full = dropped_queue_full_.value();
+  stats.memory_budget = dropped_memory_budget_.value();
+  stats.evicted_oldest = evicted_oldest_.value();
+  stats.evicted_low_priority = evicted_low_priority_.value();
+  return stats;
+}
+
+void AgentWriter::addTelemetry(TracerTelemetry &telemetry) const {
+  auto drops = dropStats();
+  telemetry.queued_traces += traces_.size();
+  telemetry.traces_dropped_queue_full += drops.queue_full;
+  telemetry.traces_dropped_memory_budget += drops.memory_budget;
+  telemetry.traces_evicted_oldest += drops.evicted_oldest;
+  telemetry.traces_evicted_low_priority += drops.evicted_low_priority;
+  auto breaker = breaker_.stats();
+  telemetry.traces_dropped_agent_down += breaker.dropped_traces;
+  telemetry.agent_circuit_breaker_open |= breaker.state != CircuitBreakerState::closed;
+  telemetry.agent_circuit_breaker_times_opened += breaker.times_opened;
+  telemetry.bytes_encoded += bytes_encoded_.load(std::memory_order_relaxed);
+  auto compression = compressor_.stats();
+  telemetry.payloads_compressed += compression.compressed_payloads;
+  telemetry.payloads_compression_skipped += compression.skipped_payloads;
+  telemetry.compression_input_bytes += compression.input_bytes;
+  telemetry.compression_output_bytes += compression.output_bytes;
+  telemetry.compression_time_ns += compression.cpu_time.count();
+  telemetry.posts_succeeded += posts_succeeded_.load(std::memory_order_relaxed);
+  telemetry.posts_failed += posts_failed_.load(std::memory_order_relaxed);
+  telemetry.post_retries += post_retries_.load(std::memory_order_relaxed);
+  telemetry.encode_time_ns += encode_time_ns_.load(std::memory_order_relaxed);
+  telemetry.post_time_ns += post_time_ns_.load(std::memory_order_relaxed);
+}
+
+void AgentWriter::recordPost(bool succeeded, std::chrono::steady_clock::duration duration) {
+  (succeeded ? posts_succeeded_ : posts_failed_).fetch_add(1, std::memory_order_relaxed);
+  post_time_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+                          std::memory_order_relaxed);
+}
+
+SpillStats AgentWriter::spillStats() const {
+  return spill_ != nullptr ? spill_->stats() : SpillStats{};
+}
+
+void AgentWriter::setPeriodicTask(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(periodic_task_mutex_);
+  periodic_task_ = std::move(task);
+}
+
 void AgentWriter::startWriting(std::unique_ptr<Handle> handle) {
   // Start worker that sends Traces to agent.
   // We can capture 'this' because destruction of this stops the thread and the lambda.
   worker_ = std::make_unique<std::thread>(
       [this](std::unique_ptr<Handle> handle) {
-        std::stringstream buffer;
-        size_t num_traces = 0;
+        Request request;
+        request.handle = std::move(handle);
+        request.api_version = api_version_;
+        // Reused for every batch, so that taking the queued traces doesn't allocate.
+        std::vector<Trace> &batch = request.batch;
+        batch.reserve(traces_.capacity());
+        // Payloads that failed, each with its traces, waiting to be sent again. They borrow the
+        // handle from request to be sent.
+        std::list<Request> retries;
+        // Posts the request, and lets the breaker know how it went.
+        auto post = [&](Request &request) {
+          auto start = std::chrono::steady_clock::now();
+          bool sent = AgentWriter::postTraces(request.handle, *request.body, request.numTraces());
+          if (request.prewarm) {
+            return sent;
+          }
+          recordPost(sent, std::chrono::steady_clock::now() - start);
+          if (sent) {
+            breaker_.recordSuccess();
+          } else {
+            breaker_.recordFailure(std::chrono::steady_clock::now());
+          }
+          return sent;
+        };
+        // Sends the encoded payload. Returns false if it should be retried.
+        auto send = [&](Request &request) {
+          if (!post(request)) {
+            return false;
+          }
+          if (fallBack(request)) {
+            return post(request);
+          }
+          return true;
+        };
+        // Moves the handle from one request to the other, pointing it at the other's endpoint.
+        auto lend = [&](Request &from, Request &to) {
+          to.handle = std::move(from.handle);
+          if (to.api_version == from.api_version) {
+            return true;
+          }
+          CURLcode rcode = useApiVersion(*to.handle, to.api_version);
+          if (rcode != CURLE_OK) {
+            std::cerr << "Error setting agent URL: " << curl_easy_strerror(rcode) << std::endl;
+            return false;
+          }
+          return true;
+        };
+        // Sends a payload that failed again. Returns false if it fails again.
+        auto resend = [&](Request &retry) {
+          post_retries_.fetch_add(1, std::memory_order_relaxed);
+          bool sent = false;
+          if (lend(request, retry)) {
+            setContentEncoding(retry);
+            sent = send(retry);
+            // Falling back to v0.3 may have split the payload, so send the rest of its traces too.
+            while (sent && retry.end < retry.batch.size()) {
+              retry.begin = retry.end;
+              retry.failures = 0;
+              encode(retry);
+              sent = send(retry);
+            }
+          }
+          lend(retry, request);
+          return sent;
+        };
+        // Keeps the payload of a retry that's given up on in the spill queue, and the rest of its
+        // traces, if falling back to v0.3 split it.
+        auto spillRetry = [&](Request &retry) {
+          spill(retry);
+          if (spill_ == nullptr || retry.end >= retry.batch.size()) {
+            return;
+          }
+          if (lend(request, retry)) {
+            for (retry.begin = retry.end; retry.begin < retry.batch.size();
+                 retry.begin = retry.end) {
+              encode(retry);
+              spill(retry);
+            }
+          }
+          lend(retry, request);
+        };
+        // Keeps the request's payload and its traces aside to be sent again when the retry is due.
+        // Returns false if it's given up on instead.
+        auto retryLater = [&]() {
+          if (breaker_.isOpen() || retries.size() >= max_queued_retries ||
+              !scheduleRetry(request, std::chrono::steady_clock::now())) {
+            return false;
+          }
+          retries.emplace_back();
+          Request &retry = retries.back();
+          retry.api_version = request.api_version;
+          retry.failures = request.failures;
+          retry.retry_at = request.retry_at;
+          retry.encoded_at = request.encoded_at;
+          for (size_t i = request.begin; i < request.end; i++) {
+            retry.batch.push_back(std::move(batch[i]));
+          }
+          retry.end = retry.batch.size();
+          PayloadBuffer &body = request.body == &request.compressed_payload
+                                    ? retry.compressed_payload
+                                    : retry.payload;
+          body.write(request.body->data(), request.body->size());
+          retry.body = &body;
+          request.failures = 0;
+          return true;
+        };
+        // Sends the spilled payloads, oldest first. Returns false if one couldn't be sent.
+        auto replay = [&]() {
+          while (!stop_writing_ && loadSpilled(request)) {
+            bool sent = post(request);
+            request.replaying = false;
+            if (!sent) {
+              return false;
+            }
+            popSpilled(request);
+          }
+          return true;
+        };
+        if (prewarm_connection_) {
+          // Send an empty payload, so that the connection is open (and the API version is known)
+          // before there are traces to send.
+          encode(request);
+          request.prewarm = true;
+          send(request);
+          request.prewarm = false;
+        }
+        auto next_write = std::chrono::steady_clock::now() + write_period_;
+        // Whether a flush has sent what was queued, and only waits for the retries now.
+        bool flush_waits_for_retries = false;
         while (true) {
-          // Encode traces when there are new ones.
+          // Not under mutex_, since the task may write traces.
+          {
+            std::lock_guard<std::mutex> lock(periodic_task_mutex_);
+            if (periodic_task_) {
+              periodic_task_();
+            }
+          }
+          bool flushing;
           {
-            // Wait to be told about new traces (or to stop).
+            // Wait for the next write or retry, or to be told to flush (or to stop).
             std::unique_lock<std::mutex> lock(mutex_);
-            condition_.wait_for(lock, write_period_,
-                                [&]() -> bool { return flush_worker_ || stop_writing_; });
+            auto wake_up_at = next_write;
+            for (auto &retry : retries) {
+              wake_up_at = std::min(wake_up_at, retry.retry_at);
+            }
+            condition_.wait_until(lock, wake_up_at, [&]() -> bool {
+              return (flush_worker_ && !flush_waits_for_retries) || write_early_ || stop_writing_;
+            });
             if (stop_writing_) {
-              return;  // Stop the thread.
+              break;  // Stop the thread.
             }
-            num_traces = traces_.size();
-            if (num_traces == 0) {
+            flushing = flush_worker_;
+          }  // lock on mutex_ ends.
+          auto now = std::chrono::steady_clock::now();
+          if ((flushing && !flush_waits_for_retries) || write_early_ || now >= next_write) {
+            next_write = now + write_period_;
+            reportLoad();  // Before the queue is emptied.
+            if (breaker_.isOpen()) {
+              // Drop what was queued before the breaker opened, and see if the agent's back yet.
+              dropQueuedTraces(batch);
+              if (breaker_.startProbe(now)) {
+                request.begin = 0;
+                encode(request);
+                send(request);
+              }
+            }
+            // While payloads can't be sent, they're spilled without waiting for the agent.
+            bool agent_up = !breaker_.isOpen() && replay();
+            // Take the queued traces and encode them. No lock is needed, since the queue is
+            // lock-free. Writes that evict traces may take from it meanwhile (and put some back).
+            write_early_ = false;
+            Trace trace;
+            while (batch.size() < batch.capacity() && popQueued(trace)) {
+              batch.push_back(std::move(trace));
+            }
+            // Send spans, a payload at a time. One that fails is sent again later, rather than
+            // holding up the rest.
+            for (request.begin = 0; request.begin < batch.size() && !stop_writing_;
+                 request.begin = request.end) {
+              if (breaker_.isOpen()) {
+                breaker_.recordDroppedTraces(batch.size() - request.begin);
+                break;
+              }
+              encode(request);
+              if (!agent_up) {
+                spill(request);
+              } else if (!send(request) && !retryLater()) {
+                spill(request);
+                agent_up = spill_ == nullptr;
+              }
+            }
+            clearBatch(batch);
+          }
+          // Send the retries that are due. They're given up on if the agent's down, or if sending
+          // later payloads held them up until they're too old.
+          for (auto retry = retries.begin(); retry != retries.end() && !stop_writing_;) {
+            now = std::chrono::steady_clock::now();
+            if (retry->retry_at > now && !breaker_.isOpen()) {
+              ++retry;
               continue;
             }
-            // Clear the buffer but keep the allocated memory.
-            buffer.clear();
-            buffer.str(std::string{});
-            msgpack::pack(buffer, traces_);
-            traces_.clear();
-          }  // lock on mutex_ ends.
-          // Send spans, not in critical period.
-          retryFiniteOnFail([&]() { return AgentWriter::postTraces(handle, buffer, num_traces); });
-          // Let thread calling 'flush' that we're done flushing.
+            bool sent = !breaker_.isOpen() && now - retry->encoded_at <= max_retry_age &&
+                        resend(*retry);
+            if (!sent && !breaker_.isOpen() &&
+                scheduleRetry(*retry, std::chrono::steady_clock::now())) {
+              ++retry;
+              continue;
+            }
+            if (!sent) {
+              spillRetry(*retry);
+            }
+            clearBatch(retry->batch);
+            retry = retries.erase(retry);
+          }
+          if (flushing) {
+            flush_waits_for_retries = !retries.empty();
+            if (!flush_waits_for_retries) {
+              // Let thread calling 'flush' that we're done flushing.
+              {
+                std::unique_lock<std::mutex> lock(mutex_);
+                flush_worker_ = false;
+              }
+              condition_.notify_all();
+            }
+          }
+        }
+        // Stopped. Keep the payloads that were waiting to be sent again.
+        for (auto &retry : retries) {
+          spillRetry(retry);
+        }
+      },
+      std::move(handle));
+}
+
+void AgentWriter::startWritingConcurrently(std::vector<std::unique_ptr<Handle>> handles) {
+  worker_ = std::make_unique<std::thread>(
+      [this](std::vector<std::unique_ptr<Handle>> handles) {
+        // A request is idle when it isn't in flight and has no traces waiting to be retried.
+        std::vector<Request> requests(handles.size());
+        for (size_t i = 0; i < handles.size(); i++) {
+          requests[i].handle = std::move(handles[i]);
+          requests[i].api_version = api_version_;
+        }
+        // Starts sending the request's payload. Returns false if it couldn't be started.
+        auto send = [&](Request &request) {
+          try {
+            if (!request.replaying && request.api_version != api_version_) {
+              encode(request);  // The agent didn't support v0.5 while this was waiting.
+            }
+            if (!setUpRequest(*request.handle, *request.body, request.numTraces())) {
+              return false;
+            }
+          } catch (const std::bad_alloc &) {
+            return false;
+          }
+          CURLMcode rcode = multi_handle_->add(request.handle.get());
+          if (rcode != CURLM_OK) {
+            std::cerr << "Error sending traces to agent: " << curl_multi_strerror(rcode)
+                      << std::endl;
+            return false;
+          }
+          request.in_flight = true;
+          request.sent_at = std::chrono::steady_clock::now();
+          return true;
+        };
+        // Once a payload has been sent, starts sending the next payload of the batch, or leaves
+        // the request idle if there isn't one. If it failed, schedules a retry instead, unless it
+        // has been retried enough (or is empty, or the agent is down) and is given up on.
+        auto settle = [&](Request &request, bool sent) {
+          request.prewarm = false;
+          while (true) {
+            if (!sent && request.begin != request.end && !breaker_.isOpen() &&
+                scheduleRetry(request, std::chrono::steady_clock::now())) {
+              return;
+            }
+            if (!sent) {
+              spill(request);
+            }
+            request.begin = request.end;
+            request.failures = 0;
+            if (breaker_.isOpen()) {
+              breaker_.recordDroppedTraces(request.batch.size() - request.begin);
+              request.begin = request.batch.size();
+            }
+            if (request.begin >= request.batch.size()) {
+              clearBatch(request.batch);
+              request.begin = request.end = 0;
+              return;
+            }
+            encode(request);
+            sent = send(request);
+            if (sent) {
+              return;
+            }
+          }
+        };
+        auto waiting = [](const Request &request) {
+          return !request.in_flight && !request.batch.empty();
+        };
+        if (prewarm_connection_) {
+          // Send an empty payload, so that the connection is open (and the API version is known)
+          // before there are traces to send.
+          encode(requests[0]);
+          requests[0].prewarm = true;
+          if (!send(requests[0])) {
+            settle(requests[0], false);
+          }
+        }
+        std::vector<std::pair<Handle *, CURLcode>> done;
+        auto next_write = std::chrono::steady_clock::now() + write_period_;
+        // Whether traces were left queued last time because no request was idle.
+        bool backlog = false;
+        // Whether sending spilled payloads has stopped until the next write, since one failed.
+        bool replay_paused = false;
+        // Traces dropped while the breaker is open.
+        std::vector<Trace> dropped;
+        while (true) {
+          bool flushing;
           {
             std::unique_lock<std::mutex> lock(mutex_);
-            flush_worker_ = false;
+            if (stop_writing_) {
+              break;
+            }
+            flushing = flush_worker_;
+          }
+          auto now = std::chrono::steady_clock::now();
+          if (flushing || backlog || write_early_ || now >= next_write) {
+            if (now >= next_write) {
+              next_write = now + write_period_;
+              replay_paused = false;
+            }
+            reportLoad();
+            {
+              std::lock_guard<std::mutex> lock(periodic_task_mutex_);
+              if (periodic_task_) {
+                periodic_task_();
+              }
+            }
+            if (breaker_.isOpen()) {
+              dropQueuedTraces(dropped);
+            }
+            // Take the queued traces into the idle requests and send them. No lock is needed,
+            // since the queue is lock-free. Writes that evict traces may take from it meanwhile.
+            write_early_ = false;
+            backlog = true;
+            for (auto &request : requests) {
+              if (request.in_flight || !request.batch.empty()) {
+                continue;
+              }
+              Trace trace;
+              while (request.batch.size() < traces_.capacity() && popQueued(trace)) {
+                request.batch.push_back(std::move(trace));
+              }
+              if (request.batch.empty()) {
+                backlog = false;  // The queue's empty.
+                break;
+              }
+              encode(request);
+              if (!send(request)) {
+                settle(request, false);
+              }
+            }
+            backlog = backlog && traces_.size() > 0;
+          }
+          // Send the retries that are due, and find out when the next one is.
+          auto wake_up_at = next_write;
+          for (auto &request : requests) {
+            if (waiting(request) && breaker_.isOpen()) {
+              settle(request, false);  // Given up on, since the agent's down.
+            } else if (waiting(request) && request.retry_at <= now) {
+              post_retries_.fetch_add(1, std::memory_order_relaxed);
+              if (!send(request)) {
+                settle(request, false);
+              }
+            }
+            if (waiting(request)) {
+              wake_up_at = std::min(wake_up_at, request.retry_at);
+            }
+          }
+          if (flushing && traces_.size() == 0 &&
+              std::none_of(requests.begin(), requests.end(), [&](const Request &request) {
+                return request.in_flight || waiting(request);
+              })) {
+            // Let thread calling 'flush' that we're done flushing.
+            {
+              std::unique_lock<std::mutex> lock(mutex_);
+              flush_worker_ = false;
+            }
+            condition_.notify_all();
+          }
+          // While the agent's down, probe it with an empty payload on an idle request.
+          if (breaker_.isOpen()) {
+            auto idle = std::find_if(requests.begin(), requests.end(), [](const Request &request) {
+              return !request.in_flight && request.batch.empty();
+            });
+            if (idle != requests.end() && breaker_.startProbe(now)) {
+              idle->begin = 0;
+              encode(*idle);
+              if (!send(*idle)) {
+                breaker_.recordFailure(now);
+              }
+            }
+            if (breaker_.isOpen() && breaker_.nextProbe() > now) {
+              wake_up_at = std::min(wake_up_at, breaker_.nextProbe());
+            }
+          }
+          // Send the spilled payloads one at a time, oldest first, on an idle request.
+          if (spill_ != nullptr && !replay_paused && !breaker_.isOpen() &&
+              std::none_of(requests.begin(), requests.end(),
+                           [](const Request &request) { return request.replaying; })) {
+            for (auto &request : requests) {
+              if (request.in_flight || !request.batch.empty()) {
+                continue;
+              }
+              if (loadSpilled(request) && !send(request)) {
+                request.replaying = false;
+                replay_paused = true;
+              }
+              break;
+            }
+          }
+          // Wait for requests to progress, the next retry or write, or to be woken up by flush or
+          // stop.
+          auto timeout = std::max(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      wake_up_at - std::chrono::steady_clock::now()),
+                                  std::chrono::milliseconds(0));
+          CURLMcode rcode = multi_handle_->poll(timeout, done);
+          if (rcode != CURLM_OK) {
+            std::cerr << "Error sending traces to agent: " << curl_multi_strerror(rcode)
+                      << std::endl;
+          }
+          for (auto &result : done) {
+            auto request = std::find_if(
+                requests.begin(), requests.end(),
+                [&](const Request &request) { return request.handle.get() == result.first; });
+            if (request == requests.end()) {
+              continue;
+            }
+            request->in_flight = false;
+            bool sent = result.second == CURLE_OK && !agentFailed(*request->handle);
+            if (!request->prewarm) {
+              recordPost(sent, std::chrono::steady_clock::now() - request->sent_at);
+              if (sent) {
+                breaker_.recordSuccess();
+              } else {
+                breaker_.recordFailure(std::chrono::steady_clock::now());
+              }
+            }
+            if (request->replaying) {
+              request->replaying = false;
+              if (sent) {
+                popSpilled(*request);
+              } else {
+                replay_paused = true;
+              }
+              continue;
+            }
+            if (!sent) {
+              if (result.second != CURLE_OK) {
+                std::cerr << "Error sending traces to agent: "
+                          << curl_easy_strerror(result.second) << std::endl
+                          << request->handle->getError() << std::endl;
+              }
+              settle(*request, false);
+            } else if (fallBack(*request)) {
+              if (!send(*request)) {
+                settle(*request, false);
+              }
+            } else {
+              replay_paused = false;  // The agent's back.
+              settle(*request, true);
+            }
+          }
+          done.clear();
+        }
+        // Stopped. Abandon the requests in flight, since their handles are about to go, and keep
+        // their payloads, and those that were waiting to be sent again. Spilled payloads being
+        // sent are still in the spill queue.
+        for (auto &request : requests) {
+          if (request.in_flight) {
+            multi_handle_->remove(request.handle.get());
+          }
+          if (!request.replaying) {
+            spill(request);
           }
-          condition_.notify_all();
+          clearBatch(request.batch);
         }
       },
-      std::move(handle));
+      std::move(handles));
 }
 
 void AgentWriter::flush() try {
   std::unique_lock<std::mutex> lock(mutex_);
   flush_worker_ = true;
   condition_.notify_all();
+  if (multi_handle_ != nullptr) {
+    multi_handle_->wakeUp();
+  }
   // Wait until flush is complete.
   condition_.wait(lock, [&]() -> bool { return !flush_worker_ || stop_writing_; });
 } catch (const std::bad_alloc &) {
 }
 
-void AgentWriter::retryFiniteOnFail(std::function<bool()> f) const {
-  for (std::chrono::milliseconds backoff : retry_periods_) {
-    if (f()) {
-      return;
-    }
-    {
-      // Just check for stop_writing_ between attempts. No need to allow wake-from-sleep
-      // stop_writing signal during retry period since that should always be short.
-      std::unique_lock<std::mutex> lock(mutex_);
-      if (stop_writing_) {
-        return;
-      }
-    }
-    std::this_thread::sleep_for(backoff);
-  }
-  f();  // Final try after final sleep.
-}
-
-bool AgentWriter::postTraces(std::unique_ptr<Handle> &handle, std::stringstream &buffer,
-                             size_t num_traces) try {
-  handle->setHeaders({{"X-Datadog-Trace-Count", std::to_string(num_traces)}});
+bool AgentWriter::setUpRequest(Handle &handle, const PayloadBuffer &payload,
+                               size_t num_traces) {
+  // Patches the value of the header, which is otherwise the same for every request.
+  handle.setHeader(trace_count_header, std::to_string(num_traces));
 
   // We have to set the size manually, because msgpack uses null characters.
-  std::string post_fields = buffer.str();
-  CURLcode rcode = handle->setopt(CURLOPT_POSTFIELDSIZE, post_fields.size());
+  CURLcode rcode = handle.setopt(CURLOPT_POSTFIELDSIZE, long(payload.size()));
   if (rcode != CURLE_OK) {
     std::cerr << "Error setting agent request size: " << curl_easy_strerror(rcode) << std::endl;
     return false;
   }
 
-  rcode = handle->setopt(CURLOPT_POSTFIELDS, post_fields.data());
+  // Curl doesn't copy the data, it's read from the payload directly.
+  rcode = handle.setopt(CURLOPT_POSTFIELDS, payload.data());
   if (rcode != CURLE_OK) {
     std::cerr << "Error setting agent request body: " << curl_easy_strerror(rcode) << std::endl;
     return false;
   }
+  return true;
+}
 
-  rcode = handle->perform();
+bool AgentWriter::postTraces(std::unique_ptr<Handle> &handle, const PayloadBuffer &payload,
+                             size_t num_traces) try {
+  if (!setUpRequest(*handle, payload, num_traces)) {
+    return false;
+  }
+  CURLcode rcode = handle->perform();
   if (rcode != CURLE_OK) {
     std::cerr << "Error sending traces to agent: " << curl_easy_strerror(rcode) << std::endl
               << handle->getError() << std::endl;
     return false;
   }
-  return true;
+  return !agentFailed(*handle);
 } catch (const std::bad_alloc &) {
   // Drop spans, but live to fight another day.
   return true;  // Don't attempt to retry.
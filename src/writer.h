@@ -2,12 +2,24 @@
 #define DD_OPENTRACING_WRITER_H
 
 #include <curl/curl.h>
+#include <datadog/opentracing.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <deque>
+#include <functional>
 #include <mutex>
 #include <sstream>
 #include <thread>
+#include "bounded_queue.h"
+#include "circuit_breaker.h"
+#include "compression.h"
+#include "encoder.h"
+#include "load_shedder.h"
+#include "memory_budget.h"
+#include "payload_buffer.h"
 #include "span.h"
+#include "spill_queue.h"
+#include "telemetry.h"
 #include "transport.h"
 
 namespace datadog {
@@ -25,6 +37,84 @@ class Writer {
 
   // Writes the given Trace.
   virtual void write(Trace trace) = 0;
+
+  // Calls the given function periodically on the Writer's own thread, if it has one, so that
+  // housekeeping can be done off of the hot path. Replaces any function given previously. Passing
+  // nullptr stops the calls, and waits for a call that is in progress to return.
+  virtual void setPeriodicTask(std::function<void()> task) {}
+
+  // Adds what it has done to the telemetry.
+  virtual void addTelemetry(TracerTelemetry &telemetry) const {}
+};
+
+// The versions of the agent's traces endpoint that AgentWriter can send to. v0_5 payloads are
+// smaller, but need a newer agent.
+enum class AgentApiVersion { v0_3, v0_5 };
+
+// Which trace AgentWriter drops when a new one doesn't fit in its queue (or memory budget).
+enum class DropPolicy {
+  // The new trace.
+  drop_newest,
+  // The oldest queued traces, to make room for the new one.
+  drop_oldest,
+  // Queued traces without errors, to make room for a new trace with a span that has an error or
+  // that the user wants kept. Otherwise the new trace.
+  priority
+};
+
+// The traces that an AgentWriter has dropped, rather than sent, by why. May be a little behind
+// while traces are being written.
+struct DropStats {
+  // New traces that didn't fit in the queue.
+  uint64_t queue_full = 0;
+  // New traces that didn't fit in the memory budget.
+  uint64_t memory_budget = 0;
+  // Queued traces dropped to make room for newer ones, by DropPolicy::drop_oldest.
+  uint64_t evicted_oldest = 0;
+  // Queued traces dropped to make room for ones with errors (or that the user wants kept), by
+  // DropPolicy::priority.
+  uint64_t evicted_low_priority = 0;
+};
+
+// How an AgentWriter sends traces to the agent.
+struct AgentWriterOptions {
+  // If the agent doesn't support v0_5 (responds with 404), the writer falls back to v0_3 for good.
+  AgentApiVersion api_version = AgentApiVersion::v0_3;
+  // Payloads are gzipped if this is enabled.
+  CompressionOptions compression;
+  // If not empty, the agent is reached through the Unix domain socket at this path, rather than
+  // over TCP to the host and port.
+  std::string socket_path;
+  // If true, an empty payload is sent as soon as the writer starts, so that the connection to the
+  // agent is already open when the first traces are sent.
+  bool prewarm_connection = false;
+  // How many requests to the agent may be in progress at once. If more than 1, requests are sent
+  // without blocking the writer's thread, so a slow agent doesn't hold up later traces. Only used
+  // by the constructor that makes the handles.
+  size_t max_concurrent_requests = 1;
+  // If not 0, traces are split into payloads of at most this many bytes (before compression), so
+  // that the agent doesn't reject them, and a failure only re-sends one of them. A trace that's
+  // bigger than this on its own is sent anyway.
+  size_t max_payload_size = 0;
+  // If spill.directory isn't empty, payloads that can't be sent (after retrying) are kept on disk
+  // there, and sent once the agent can be reached again, oldest first. While there are payloads
+  // on disk, new ones are kept there too rather than waiting on an agent that's down.
+  SpillQueueOptions spill;
+  // If set, queued traces are counted against it, from when they're written until they've been
+  // sent. A trace that doesn't fit is dropped.
+  std::shared_ptr<MemoryBudget> memory_budget;
+  // If circuit_breaker.failure_threshold isn't 0, traces are dropped when they're written, rather
+  // than encoded and retried, while the agent is down. Those traces aren't spilled.
+  CircuitBreakerOptions circuit_breaker;
+  // If set, the writer reports to it how full its queue is, and how many traces it drops because
+  // the queue (or memory budget) is full, each time the worker thread wakes up.
+  std::shared_ptr<LoadShedder> load_shedder;
+  // If not 0, queued traces are sent as soon as there are this many spans, or they take up about
+  // this many bytes, rather than waiting for the write period.
+  size_t write_threshold_spans = 0;
+  size_t write_threshold_bytes = 0;
+  // Which traces are dropped when the queue (or memory budget) is full.
+  DropPolicy drop_policy = DropPolicy::drop_newest;
 };
 
 // A Writer that sends Traces (collections of Spans) to a Datadog agent.
@@ -32,18 +122,30 @@ class AgentWriter : public Writer {
  public:
   // Creates an AgentWriter that uses curl to send Traces to a Datadog agent. May throw a
   // runtime_exception.
-  AgentWriter(std::string host, uint32_t port, std::chrono::milliseconds write_period);
+  AgentWriter(std::string host, uint32_t port, std::chrono::milliseconds write_period,
+              AgentWriterOptions options = {});
 
   AgentWriter(std::unique_ptr<Handle> handle, std::string tracer_version,
               std::chrono::milliseconds write_period, size_t max_queued_traces,
               std::vector<std::chrono::milliseconds> retry_periods, std::string host,
-              uint32_t port);
+              uint32_t port, AgentWriterOptions options = {});
+
+  // Sends up to handles.size() requests at once, using the multi_handle. If multi_handle is null,
+  // sends one request at a time with the first handle. May throw a runtime_exception.
+  AgentWriter(std::unique_ptr<MultiHandle> multi_handle,
+              std::vector<std::unique_ptr<Handle>> handles, std::string tracer_version,
+              std::chrono::milliseconds write_period, size_t max_queued_traces,
+              std::vector<std::chrono::milliseconds> retry_periods, std::string host,
+              uint32_t port, AgentWriterOptions options = {});
 
   // Does not flush on destruction, buffered traces may be lost. Stops all threads.
   ~AgentWriter() override;
 
   void write(Trace trace) override;
 
+  // Calls the task each time the worker thread wakes up (at least once per write period).
+  void setPeriodicTask(std::function<void()> task) override;
+
   // Send all buffered Traces to the destination now. Will block until sending is complete. This
   // isn't on the main Writer API because real code should not need to call this.
   void flush();
@@ -51,43 +153,202 @@ class AgentWriter : public Writer {
   // Permanently stops writing Traces. Calls to write() and flush() will do nothing.
   void stop();
 
+  // How much payloads have been compressed, and what it cost. May be called from any thread.
+  CompressionStats compressionStats() const;
+
+  // What's been kept on disk, and sent from there. May be called from any thread.
+  SpillStats spillStats() const;
+
+  // Whether traces are being dropped because the agent is down. May be called from any thread.
+  CircuitBreakerStats circuitBreakerStats() const;
+
+  // The traces dropped because the writer couldn't keep up. May be called from any thread.
+  DropStats dropStats() const;
+
+  // May be called from any thread.
+  void addTelemetry(TracerTelemetry &telemetry) const override;
+
  private:
+  // A request to the agent, and what's needed to send it again.
+  struct Request {
+    std::unique_ptr<Handle> handle;
+    // The traces in the request. Kept until it's done, in case they need to be encoded again.
+    std::vector<Trace> batch;
+    // The traces of the batch that are in the payload, [begin, end). The rest of the batch is sent
+    // in later payloads.
+    size_t begin = 0;
+    size_t end = 0;
+    // Reused for every request, so that their memory is only allocated when they need to grow.
+    PayloadBuffer payload;
+    PayloadBuffer compressed_payload;
+    // What's sent, payload or compressed_payload.
+    const PayloadBuffer *body = &payload;
+    // The endpoint that the payload is for, which the handle points at while the request has it.
+    AgentApiVersion api_version;
+    // Whether it's being sent by the MultiHandle.
+    bool in_flight = false;
+    // How many times sending it has failed, and when to try again if it has.
+    size_t failures = 0;
+    std::chrono::steady_clock::time_point retry_at;
+    // When the payload was encoded. It isn't retried once it's too old for the agent to accept.
+    std::chrono::steady_clock::time_point encoded_at;
+    // When it was last sent, if it's in flight.
+    std::chrono::steady_clock::time_point sent_at;
+    // Whether the payload is one from the spill queue rather than from the batch, and which.
+    bool replaying = false;
+    SpilledPayload spilled;
+    // Whether the payload is the empty one sent to open the connection. It isn't counted as a
+    // post, or by the breaker, since it doesn't send any traces.
+    bool prewarm = false;
+
+    size_t numTraces() const { return replaying ? spilled.num_traces : end - begin; }
+  };
+
   // Initialises the curl handle. May throw a runtime_exception.
-  void setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port);
+  void setUpHandle(std::unique_ptr<Handle> &handle, std::string host, uint32_t port,
+                   const std::string &socket_path);
+  // Points the handle at the agent's endpoint for the given version.
+  CURLcode useApiVersion(Handle &handle, AgentApiVersion api_version);
+  // Encodes as many of the request's traces from begin as fit in a payload for api_version_,
+  // gzipping them if compression is enabled.
+  void encode(Request &request);
+  // Sets the Content-Encoding header on the handle for the request's body, if it can vary.
+  void setContentEncoding(Request &request);
+  // If the request was sent to v0.5 and the agent doesn't support it, switches to v0.3 for good
+  // and encodes the request again. Returns true if it needs to be sent again.
+  bool fallBack(Request &request);
+  // Sends later traces to v0.3, if they were being sent to v0.5, and says so.
+  void stopUsingV0_5();
+  // Removes the spilled payload that the request sent from the spill queue. If the agent rejected
+  // it (with a 4xx status), it's dropped and counted as rejected, since sending it again wouldn't
+  // help.
+  void popSpilled(Request &request);
+  // Keeps the request's payload in the spill queue, if there is one.
+  void spill(Request &request);
+  // Puts the oldest payload in the spill queue in the request. Returns false if there isn't one.
+  bool loadSpilled(Request &request);
+  // Frees the traces of the batch, and releases their memory from the budget.
+  void clearBatch(std::vector<Trace> &batch);
+  // Takes the queued traces into the (empty) batch and drops them, since the agent is down.
+  void dropQueuedTraces(std::vector<Trace> &batch);
+  // Tells the load shedder, if there is one, how saturated the writer is.
+  void reportLoad();
+  // Takes a trace from the queue, and stops counting it towards the write thresholds. Returns
+  // false if the queue is empty.
+  bool popQueued(Trace &trace);
+  // What a write has done so far to make room for its trace.
+  struct Eviction {
+    int evictions = 0;
+    // Whether the trace has priority (see DropPolicy::priority), once it has been checked.
+    bool checked_priority = false;
+    bool priority = false;
+    // How many more spans of queued traces may be looked at for one without priority.
+    size_t scan_spans;
+    // A queued trace with priority that was taken from the queue while looking, and couldn't be
+    // put back. The write drops its own trace and writes this one instead.
+    Trace unqueued;
+  };
+  // Drops a queued trace, if drop_policy_ allows it, to make room for the incoming one. Returns
+  // false if none was dropped.
+  bool evict(const Trace &incoming, Eviction &eviction);
+  // Frees a trace that was taken from the queue to be dropped, and releases its memory.
+  void discard(Trace &trace);
+  // Sets when the request should be sent again, after it failed at the given time. Returns false
+  // if it has been retried enough, or would be too old for the agent by then, and is given up on.
+  bool scheduleRetry(Request &request, std::chrono::steady_clock::time_point now) const;
 
   // Starts asynchronously writing traces. They will be written periodically (set by write_period_)
-  // or when flush() is called manually.
+  // or when flush() is called manually. Payloads that fail are kept aside and sent again when
+  // they're due, while later traces keep being sent.
   void startWriting(std::unique_ptr<Handle> handle);
-  // Posts the given Traces to the Agent. Returns true if it succeeds, otherwise false.
-  static bool postTraces(std::unique_ptr<Handle> &handle, std::stringstream &buffer,
+  // Like startWriting, but with a request in progress on each of the handles at once.
+  void startWritingConcurrently(std::vector<std::unique_ptr<Handle>> handles);
+  // Sets the payload and trace count on the handle. Returns true if it succeeds, otherwise false.
+  static bool setUpRequest(Handle &handle, const PayloadBuffer &payload, size_t num_traces);
+  // Counts a request to the agent that took the given time, and whether it succeeded.
+  void recordPost(bool succeeded, std::chrono::steady_clock::duration duration);
+  // Posts the given Traces to the Agent. Returns true if it succeeds, otherwise false (including
+  // if the agent responds that it failed, or is too busy).
+  static bool postTraces(std::unique_ptr<Handle> &handle, const PayloadBuffer &payload,
                          size_t num_traces);
-  // Retries the given function a finite number of times according to retry_periods_. Retries when
-  // f() returns false.
-  void retryFiniteOnFail(std::function<bool()> f) const;
 
   const std::string tracer_version_;
   // How often to send Traces.
   const std::chrono::milliseconds write_period_;
-  const size_t max_queued_traces_;
   // How long to wait before retrying each time. If empty, only try once.
   const std::vector<std::chrono::milliseconds> retry_periods_;
+  // The agent's URL, without the path.
+  std::string agent_url_;
+  // Which agent endpoint traces are sent to. Only changed by the worker thread once it's started.
+  AgentApiVersion api_version_;
+  const bool prewarm_connection_;
+  // Traces are split into payloads of at most this many bytes, unless a trace is bigger.
+  const size_t max_payload_size_;
+  // Only used by the worker thread, except for its stats.
+  GzipCompressor compressor_;
+  // Only used by the worker thread.
+  StringTableEncoder string_table_encoder_;
+  // Sends requests concurrently. Null if they're sent one at a time.
+  std::unique_ptr<MultiHandle> multi_handle_;
+  // Only used by the worker thread, except for its stats. Null if payloads aren't spilled.
+  std::unique_ptr<SpillQueue> spill_;
+  // Null if there's no memory budget.
+  std::shared_ptr<MemoryBudget> memory_budget_;
+  // Only updated by the worker thread.
+  CircuitBreaker breaker_;
+  // Null if there's no load shedding.
+  std::shared_ptr<LoadShedder> load_shedder_;
+  // Traces written, and dropped because the writer can't keep up, if there's a load shedder.
+  std::atomic<uint64_t> written_traces_{0};
+  std::atomic<uint64_t> overload_dropped_traces_{0};
+  // Their values when the load was last reported. Only used by the worker thread.
+  uint64_t reported_written_traces_ = 0;
+  uint64_t reported_dropped_traces_ = 0;
+  // Queued traces are sent early once these are reached. 0 if they aren't used.
+  const size_t write_threshold_spans_;
+  const size_t write_threshold_bytes_;
+  // The spans, and estimated bytes, in the queue. Each is only counted if its threshold is used.
+  std::atomic<size_t> queued_spans_{0};
+  std::atomic<size_t> queued_bytes_{0};
+  // Set by the write that reaches a threshold, and cleared when the worker takes the queue, so
+  // that the worker is only woken once each time.
+  std::atomic<bool> write_early_{false};
+  const DropPolicy drop_policy_;
+  // The fields of DropStats. Counted by the threads writing traces.
+  TelemetryCounter dropped_queue_full_;
+  TelemetryCounter dropped_memory_budget_;
+  TelemetryCounter evicted_oldest_;
+  TelemetryCounter evicted_low_priority_;
+  // Only updated by the worker thread. See TracerTelemetry.
+  std::atomic<uint64_t> bytes_encoded_{0};
+  std::atomic<uint64_t> posts_succeeded_{0};
+  std::atomic<uint64_t> posts_failed_{0};
+  std::atomic<uint64_t> post_retries_{0};
+  std::atomic<uint64_t> encode_time_ns_{0};
+  std::atomic<uint64_t> post_time_ns_{0};
 
-  // The thread on which traces are encoded and send to the agent. Receives traces on the
-  // traces_ queue as notified by condition_. Encodes traces to buffer_ and sends to the
-  // agent.
+  // The thread on which traces are encoded and send to the agent. Takes traces from the traces_
+  // queue periodically, or when notified by condition_. Encodes traces to a payload and sends to
+  // the agent.
   std::unique_ptr<std::thread> worker_ = nullptr;
-  // Locks access to the traces_ queue and the stop_writing_ and flush_worker_ signals.
+  // Locks access to the stop_writing_ and flush_worker_ signals.
   mutable std::mutex mutex_;
-  // Notifies worker thread when there are new traces in the queue or it should stop.
+  // Notifies worker thread when it should flush or stop.
   std::condition_variable condition_;
   // These two bools, stop_writing_ and flush_worker_, act as signals. They are the predicates on
-  // which the condition_ variable acts.
-  // If set to true, stops worker. Locked by mutex_;
-  bool stop_writing_ = false;
+  // which the condition_ variable acts (along with write_early_).
+  // If set to true, stops worker. Only set while mutex_ is locked, but may be read without it.
+  std::atomic<bool> stop_writing_{false};
   // If set to true, flushes worker (which sets it false again). Locked by mutex_;
   bool flush_worker_ = false;
-  // Multiple producer (potentially), single consumer. Locked by mutex_.
-  std::deque<Trace> traces_;
+  // Multiple producer, multiple consumer: the worker takes traces from it, and so do writes that
+  // evict queued traces (see DropPolicy), which may also put them back. Lock-free, so that threads
+  // writing traces never wait for the worker. Traces are dropped if it's full.
+  BoundedQueue<Trace> traces_;
+
+  // Locks periodic_task_, and is held while it runs.
+  std::mutex periodic_task_mutex_;
+  std::function<void()> periodic_task_;
 };
 
 }  // namespace opentracing
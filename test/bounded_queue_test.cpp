@@ -0,0 +1,106 @@
+#include "../src/bounded_queue.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("bounded queue") {
+  BoundedQueue<std::unique_ptr<int>> queue{5};
+
+  SECTION("is first in, first out") {
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(queue.push(std::unique_ptr<int>{new int{i}}));
+    }
+    REQUIRE(queue.size() == 3);
+    std::unique_ptr<int> item;
+    for (int i = 0; i < 3; i++) {
+      REQUIRE(queue.pop(item));
+      REQUIRE(*item == i);
+    }
+    REQUIRE(queue.size() == 0);
+    REQUIRE(!queue.pop(item));
+  }
+
+  SECTION("rejects items when full") {
+    for (int i = 0; i < 5; i++) {
+      REQUIRE(queue.push(std::unique_ptr<int>{new int{i}}));
+    }
+    std::unique_ptr<int> rejected{new int{5}};
+    REQUIRE(!queue.push(std::move(rejected)));
+    REQUIRE(rejected != nullptr);  // Still ours.
+    REQUIRE(queue.size() == 5);
+    // Space again once an item's removed.
+    std::unique_ptr<int> item;
+    REQUIRE(queue.pop(item));
+    REQUIRE(*item == 0);
+    REQUIRE(queue.push(std::move(rejected)));
+  }
+
+  SECTION("can be reused many times over") {
+    std::unique_ptr<int> item;
+    for (int i = 0; i < 100; i++) {
+      REQUIRE(queue.push(std::unique_ptr<int>{new int{i}}));
+      REQUIRE(queue.push(std::unique_ptr<int>{new int{i + 1000}}));
+      REQUIRE(queue.pop(item));
+      REQUIRE(*item == i);
+      REQUIRE(queue.pop(item));
+      REQUIRE(*item == i + 1000);
+    }
+  }
+
+  SECTION("with no capacity is always full") {
+    BoundedQueue<std::unique_ptr<int>> empty_queue{0};
+    REQUIRE(!empty_queue.push(std::unique_ptr<int>{new int{1}}));
+    std::unique_ptr<int> item;
+    REQUIRE(!empty_queue.pop(item));
+  }
+
+  SECTION("can be used by many producers and one consumer") {
+    const int num_producers = 8;
+    const int items_per_producer = 20000;
+    BoundedQueue<int> int_queue{64};
+    std::vector<std::thread> producers;
+    std::atomic<int> rejected{0};
+    for (int p = 0; p < num_producers; p++) {
+      producers.emplace_back([&, p]() {
+        for (int i = 0; i < items_per_producer; i++) {
+          int value = p * items_per_producer + i;
+          if (!int_queue.push(std::move(value))) {
+            rejected++;
+          }
+        }
+      });
+    }
+    std::vector<int> received;
+    std::atomic<bool> producing{true};
+    std::thread consumer{[&]() {
+      int item;
+      while (producing || int_queue.size() > 0) {
+        if (int_queue.pop(item)) {
+          received.push_back(item);
+        }
+      }
+    }};
+    for (auto& producer : producers) {
+      producer.join();
+    }
+    producing = false;
+    consumer.join();
+    // Every item was either received exactly once, or rejected.
+    REQUIRE(received.size() + rejected == num_producers * items_per_producer);
+    std::vector<int> sorted = received;
+    std::sort(sorted.begin(), sorted.end());
+    REQUIRE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+    // Items from each producer are received in the order they were pushed.
+    std::vector<int> last(num_producers, -1);
+    for (int item : received) {
+      int producer = item / items_per_producer;
+      REQUIRE(item > last[producer]);
+      last[producer] = item;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+#include "../src/circuit_breaker.h"
+
+#include <iostream>
+#include <sstream>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("circuit breaker") {
+  // Redirect cerr, so the the terminal output doesn't imply failure.
+  std::stringstream error_message;
+  std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+  CircuitBreakerOptions options;
+  options.failure_threshold = 3;
+  options.min_probe_interval = std::chrono::milliseconds(100);
+  options.max_probe_interval = std::chrono::milliseconds(350);
+  auto now = std::chrono::steady_clock::now();
+  auto ms = [](int n) { return std::chrono::milliseconds(n); };
+
+  SECTION("opens after enough failures in a row") {
+    CircuitBreaker breaker{options};
+    breaker.recordFailure(now);
+    breaker.recordFailure(now);
+    breaker.recordSuccess();
+    breaker.recordFailure(now);
+    breaker.recordFailure(now);
+    REQUIRE(!breaker.isOpen());
+    breaker.recordFailure(now);
+    REQUIRE(breaker.isOpen());
+    auto stats = breaker.stats();
+    REQUIRE(stats.state == CircuitBreakerState::open);
+    REQUIRE(stats.times_opened == 1);
+  }
+
+  SECTION("probes on a backoff schedule until the agent is back") {
+    CircuitBreaker breaker{options};
+    for (int i = 0; i < 3; i++) {
+      breaker.recordFailure(now);
+    }
+    REQUIRE(!breaker.startProbe(now + ms(99)));
+    REQUIRE(breaker.startProbe(now + ms(100)));
+    REQUIRE(breaker.stats().state == CircuitBreakerState::half_open);
+    REQUIRE(!breaker.startProbe(now + ms(100)));  // Only one at a time.
+    now += ms(100);
+    // Twice as long each time it fails, up to the maximum.
+    for (int interval : {200, 350, 350}) {
+      breaker.recordFailure(now);
+      REQUIRE(breaker.stats().state == CircuitBreakerState::open);
+      REQUIRE(breaker.nextProbe() == now + ms(interval));
+      now += ms(interval);
+      REQUIRE(breaker.startProbe(now));
+    }
+    breaker.recordSuccess();
+    REQUIRE(!breaker.isOpen());
+    REQUIRE(breaker.stats().times_opened == 1);
+    // And starts from the beginning the next time it opens.
+    for (int i = 0; i < 3; i++) {
+      breaker.recordFailure(now);
+    }
+    REQUIRE(breaker.nextProbe() == now + ms(100));
+    REQUIRE(breaker.stats().times_opened == 2);
+  }
+
+  SECTION("ignores failures of requests from before it opened") {
+    CircuitBreaker breaker{options};
+    for (int i = 0; i < 3; i++) {
+      breaker.recordFailure(now);
+    }
+    breaker.recordFailure(now + ms(50));
+    REQUIRE(breaker.nextProbe() == now + ms(100));
+  }
+
+  SECTION("never opens without a threshold") {
+    CircuitBreaker breaker{CircuitBreakerOptions{}};
+    for (int i = 0; i < 1000; i++) {
+      breaker.recordFailure(now);
+    }
+    REQUIRE(!breaker.isOpen());
+    REQUIRE(!breaker.startProbe(now + std::chrono::hours(1)));
+  }
+
+  std::cerr.rdbuf(stderr);
+}
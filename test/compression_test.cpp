@@ -0,0 +1,74 @@
+#include "../src/compression.h"
+#include "stub_agent.h"
+
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("gzip compressor") {
+  CompressionOptions options;
+  options.level = 6;
+  options.min_size = 100;
+  GzipCompressor compressor{options};
+  PayloadBuffer payload;
+  PayloadBuffer output;
+  std::string data;
+  for (int i = 0; i < 1000; i++) {
+    data += "service.name resource " + std::to_string(i);
+  }
+
+  SECTION("compresses to gzip") {
+    payload.write(data.data(), data.size());
+    REQUIRE(compressor.compress(payload, output));
+    REQUIRE(output.size() < payload.size());
+    std::string decompressed;
+    REQUIRE(StubAgent::gunzip(std::string(output.data(), output.size()), decompressed));
+    REQUIRE(decompressed == data);
+
+    SECTION("and can be reused") {
+      payload.clear();
+      payload.write(data.data(), data.size() / 2);
+      REQUIRE(compressor.compress(payload, output));
+      REQUIRE(StubAgent::gunzip(std::string(output.data(), output.size()), decompressed));
+      REQUIRE(decompressed == data.substr(0, data.size() / 2));
+    }
+  }
+
+  SECTION("skips small payloads") {
+    payload.write(data.data(), 99);
+    REQUIRE(!compressor.compress(payload, output));
+    payload.write(data.data(), 1);
+    REQUIRE(compressor.compress(payload, output));
+  }
+
+  SECTION("does nothing when disabled") {
+    GzipCompressor disabled{CompressionOptions{}};
+    REQUIRE(!disabled.enabled());
+    payload.write(data.data(), data.size());
+    REQUIRE(!disabled.compress(payload, output));
+  }
+
+  SECTION("counts what it does") {
+    payload.write(data.data(), 10);
+    compressor.compress(payload, output);
+    payload.clear();
+    payload.write(data.data(), data.size());
+    compressor.compress(payload, output);
+    auto stats = compressor.stats();
+    REQUIRE(stats.compressed_payloads == 1);
+    REQUIRE(stats.skipped_payloads == 1);
+    REQUIRE(stats.input_bytes == data.size());
+    REQUIRE(stats.output_bytes == output.size());
+    REQUIRE(stats.ratio() < 0.5);
+    REQUIRE(stats.cpu_time.count() >= 0);
+  }
+
+  SECTION("rejects invalid levels") {
+    options.level = 10;
+    REQUIRE_THROWS(GzipCompressor{options});
+    options.level = -1;
+    REQUIRE_THROWS(GzipCompressor{options});
+  }
+}
@@ -0,0 +1,241 @@
+#include "../src/encoder.h"
+#include "mocks.h"
+
+#include <limits>
+#include <random>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+namespace {
+
+// Lengths either side of each msgpack str and map size boundary. The longest are only used
+// occasionally, to keep the test quick.
+const std::vector<size_t> string_lengths{0, 1, 31, 32, 255, 256};
+const std::vector<size_t> long_string_lengths{65535, 65536};
+const std::vector<size_t> meta_sizes{0, 1, 15, 16, 17};
+const std::vector<uint64_t> uint_values{0,      1,          127,        128,
+                                        255,    256,        65535,      65536,
+                                        1ull << 32, std::numeric_limits<uint64_t>::max()};
+const std::vector<int64_t> int_values{0,
+                                      1,
+                                      -1,
+                                      -32,
+                                      -33,
+                                      127,
+                                      128,
+                                      std::numeric_limits<int32_t>::min(),
+                                      std::numeric_limits<int32_t>::max(),
+                                      std::numeric_limits<int64_t>::min(),
+                                      std::numeric_limits<int64_t>::max()};
+
+template <class T>
+const T& pick(std::mt19937& random, const std::vector<T>& values) {
+  return values[random() % values.size()];
+}
+
+// A string of arbitrary bytes, including nulls and invalid UTF-8.
+std::string randomString(std::mt19937& random) {
+  std::string value(random() % 64 == 0 ? pick(random, long_string_lengths)
+                                        : pick(random, string_lengths),
+                    '\0');
+  for (auto& c : value) {
+    c = char(random());
+  }
+  return value;
+}
+
+std::unique_ptr<SpanData> randomSpan(std::mt19937& random) {
+  auto span = std::unique_ptr<TestSpanData>{new TestSpanData{
+      randomString(random), randomString(random), randomString(random), randomString(random),
+      pick(random, uint_values), pick(random, uint_values), pick(random, uint_values),
+      pick(random, int_values), pick(random, int_values), int32_t(pick(random, int_values))}};
+  size_t meta_size = pick(random, meta_sizes);
+  for (size_t i = 0; i < meta_size; i++) {
+    span->meta[std::to_string(i) + randomString(random)] = randomString(random);
+  }
+  return std::move(span);
+}
+
+std::vector<std::vector<TestSpanData>> decode(const PayloadBuffer& payload) {
+  std::vector<std::vector<TestSpanData>> traces;
+  msgpack::unpack(payload.data(), payload.size()).get().convert(traces);
+  return traces;
+}
+
+void requireEqual(const TestSpanData& a, const TestSpanData& b) {
+  REQUIRE(a.name == b.name);
+  REQUIRE(a.service == b.service);
+  REQUIRE(a.resource == b.resource);
+  REQUIRE(a.type == b.type);
+  REQUIRE(a.start == b.start);
+  REQUIRE(a.duration == b.duration);
+  REQUIRE(a.meta == b.meta);
+  REQUIRE(a.span_id == b.span_id);
+  REQUIRE(a.trace_id == b.trace_id);
+  REQUIRE(a.parent_id == b.parent_id);
+  REQUIRE(a.error == b.error);
+}
+
+}  // namespace
+
+TEST_CASE("encoder") {
+  PayloadBuffer encoded;
+  PayloadBuffer packed;
+
+  SECTION("encodes the same as msgpack") {
+    std::mt19937 random{42};
+    for (int i = 0; i < 50; i++) {
+      std::vector<Trace> traces;
+      // Up to 17 traces, to cross the fixarray boundary.
+      size_t num_traces = random() % 18;
+      for (size_t t = 0; t < num_traces; t++) {
+        Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+        size_t num_spans = random() % 18;
+        for (size_t s = 0; s < num_spans; s++) {
+          trace->push_back(randomSpan(random));
+        }
+        traces.push_back(std::move(trace));
+      }
+      encoded.clear();
+      packed.clear();
+      encodeTraces(encoded, traces);
+      msgpack::pack(packed, traces);
+
+      auto expected = decode(packed);
+      auto result = decode(encoded);
+      REQUIRE(result.size() == expected.size());
+      for (size_t t = 0; t < result.size(); t++) {
+        REQUIRE(result[t].size() == expected[t].size());
+        for (size_t s = 0; s < result[t].size(); s++) {
+          requireEqual(result[t][s], expected[t][s]);
+        }
+      }
+    }
+  }
+
+  SECTION("encodes with a string table to the same spans") {
+    std::mt19937 random{7};
+    StringTableEncoder encoder;
+    for (int i = 0; i < 50; i++) {
+      std::vector<Trace> traces;
+      size_t num_traces = random() % 18;
+      for (size_t t = 0; t < num_traces; t++) {
+        Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+        size_t num_spans = random() % 18;
+        for (size_t s = 0; s < num_spans; s++) {
+          trace->push_back(randomSpan(random));
+        }
+        traces.push_back(std::move(trace));
+      }
+      encoded.clear();
+      packed.clear();
+      encoder.encode(encoded, traces);
+      encodeTraces(packed, traces);
+
+      auto expected = decode(packed);
+      auto result = decodeStringTableTraces(encoded.data(), encoded.size());
+      REQUIRE(result.size() == expected.size());
+      for (size_t t = 0; t < result.size(); t++) {
+        REQUIRE(result[t].size() == expected[t].size());
+        for (size_t s = 0; s < result[t].size(); s++) {
+          requireEqual(result[t][s], expected[t][s]);
+        }
+      }
+    }
+  }
+
+  SECTION("splits traces into payloads of a maximum size") {
+    std::mt19937 random{3};
+    std::vector<Trace> traces;
+    for (size_t t = 0; t < 40; t++) {
+      Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+      size_t num_spans = random() % 6;
+      for (size_t s = 0; s < num_spans; s++) {
+        trace->push_back(randomSpan(random));
+      }
+      traces.push_back(std::move(trace));
+    }
+    packed.clear();
+    encodeTraces(packed, traces);
+    auto expected = decode(packed);
+    StringTableEncoder encoder;
+    for (bool string_table : {false, true}) {
+      // The size of all the traces in one payload.
+      encoded.clear();
+      if (string_table) {
+        encoder.encode(encoded, traces);
+      } else {
+        encodeTraces(encoded, traces);
+      }
+      size_t total_size = encoded.size();
+      for (size_t max_size : {size_t(1), size_t(4096), size_t(65536), total_size}) {
+        std::vector<std::vector<TestSpanData>> result;
+        size_t payloads = 0;
+        for (size_t begin = 0; begin < traces.size(); payloads++) {
+          encoded.clear();
+          size_t end = string_table ? encoder.encode(encoded, traces, begin, max_size)
+                                    : encodeTraces(encoded, traces, begin, max_size);
+          REQUIRE(end > begin);
+          // Only a single trace may be too big.
+          REQUIRE((end == begin + 1 || encoded.size() <= max_size));
+          auto payload = string_table ? decodeStringTableTraces(encoded.data(), encoded.size())
+                                      : decode(encoded);
+          REQUIRE(payload.size() == end - begin);
+          for (auto& trace : payload) {
+            result.push_back(trace);
+          }
+          begin = end;
+        }
+        if (max_size == 1) {
+          REQUIRE(payloads == traces.size());
+        } else if (max_size == total_size) {
+          REQUIRE(payloads == 1);
+        }
+        REQUIRE(result.size() == expected.size());
+        for (size_t t = 0; t < result.size(); t++) {
+          REQUIRE(result[t].size() == expected[t].size());
+          for (size_t s = 0; s < result[t].size(); s++) {
+            requireEqual(result[t][s], expected[t][s]);
+          }
+        }
+      }
+    }
+  }
+
+  SECTION("writes each string to the table once") {
+    std::vector<Trace> traces;
+    for (uint64_t i = 1; i <= 3; i++) {
+      Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+      auto span = std::unique_ptr<TestSpanData>{
+          new TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}};
+      span->meta["service"] = "http";
+      trace->push_back(std::move(span));
+      traces.push_back(std::move(trace));
+    }
+    StringTableEncoder encoder;
+    encoder.encode(encoded, traces);
+    auto handle = msgpack::unpack(encoded.data(), encoded.size());
+    std::vector<std::string> strings;
+    handle.get().via.array.ptr[0].convert(strings);
+    REQUIRE(strings ==
+            std::vector<std::string>{"", "service", "service.name", "resource", "http", "web"});
+  }
+
+  SECTION("encodes many traces") {
+    std::vector<Trace> traces;
+    for (int i = 0; i < 70000; i++) {
+      traces.emplace_back(new std::vector<std::unique_ptr<SpanData>>{});
+    }
+    encodeTraces(encoded, traces);
+    REQUIRE(decode(encoded).size() == 70000);
+  }
+
+  SECTION("appends to what's already in the payload") {
+    encoded.write("x", 1);
+    std::vector<Trace> traces;
+    encodeTraces(encoded, traces);
+    REQUIRE(std::string(encoded.data(), encoded.size()) == "x\x90");
+  }
+}
@@ -0,0 +1,73 @@
+#include "../src/load_shedder.h"
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("load shedder") {
+  LoadSheddingOptions options;
+  options.high_watermark = 0.8;
+  options.low_watermark = 0.2;
+  options.recovery_updates = 2;
+  options.min_keep_rate = 0.25;
+  LoadShedder shedder{options};
+
+  SECTION("keeps everything until the writer is saturated") {
+    shedder.update(0.5, 100, 0);
+    REQUIRE(shedder.keepRate() == 1.0);
+    for (uint64_t id = 1; id <= 1000; id++) {
+      REQUIRE(shedder.keep(id));
+    }
+  }
+
+  SECTION("halves the rate while the queue is full, down to the minimum") {
+    shedder.update(0.9, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.5);
+    shedder.update(1.0, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+    shedder.update(1.0, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+  }
+
+  SECTION("counts dropped traces as saturation") {
+    shedder.update(0.0, 100, 80);
+    REQUIRE(shedder.keepRate() == 0.5);
+    shedder.update(0.0, 100, 10);
+    REQUIRE(shedder.keepRate() == 0.5);
+  }
+
+  SECTION("keeps about the rate's fraction of traces") {
+    shedder.update(1.0, 0, 0);
+    int kept = 0;
+    for (uint64_t id = 1; id <= 10000; id++) {
+      kept += shedder.keep(id * 7919) ? 1 : 0;
+    }
+    REQUIRE(kept > 4500);
+    REQUIRE(kept < 5500);
+  }
+
+  SECTION("recovers with hysteresis") {
+    shedder.update(1.0, 0, 0);
+    shedder.update(1.0, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+    // Between the watermarks, the rate holds.
+    shedder.update(0.5, 0, 0);
+    shedder.update(0.5, 0, 0);
+    shedder.update(0.5, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+    // It takes a couple of calm updates in a row to double it.
+    shedder.update(0.1, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+    shedder.update(0.5, 0, 0);
+    shedder.update(0.1, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.25);
+    shedder.update(0.1, 0, 0);
+    REQUIRE(shedder.keepRate() == 0.5);
+    shedder.update(0.1, 0, 0);
+    shedder.update(0.1, 0, 0);
+    REQUIRE(shedder.keepRate() == 1.0);
+    shedder.update(0.1, 0, 0);
+    shedder.update(0.1, 0, 0);
+    REQUIRE(shedder.keepRate() == 1.0);
+  }
+}
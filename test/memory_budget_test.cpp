@@ -0,0 +1,143 @@
+#include "../src/memory_budget.h"
+#include "mocks.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <thread>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("memory budget") {
+  SECTION("refuses reservations that would go over the limit") {
+    MemoryBudget budget{100};
+    REQUIRE(budget.reserve(60));
+    REQUIRE(!budget.reserve(41));
+    REQUIRE(budget.reserve(40));
+    REQUIRE(budget.usedBytes() == 100);
+    REQUIRE(budget.rejections() == 1);
+    budget.release(60);
+    REQUIRE(budget.usedBytes() == 40);
+    REQUIRE(budget.reserve(41));
+  }
+
+  SECTION("without a limit, only counts") {
+    MemoryBudget budget{0};
+    REQUIRE(budget.reserve(size_t(1) << 40));
+    REQUIRE(budget.usedBytes() == size_t(1) << 40);
+    REQUIRE(budget.rejections() == 0);
+  }
+
+  SECTION("stays within the limit when used from many threads") {
+    MemoryBudget budget{1000};
+    std::atomic<bool> over{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+      threads.emplace_back([&]() {
+        for (int j = 0; j < 1000; j++) {
+          if (budget.reserve(300)) {
+            over = over || budget.usedBytes() > 1000;
+            budget.release(300);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    REQUIRE(!over);
+    REQUIRE(budget.usedBytes() == 0);
+  }
+}
+
+TEST_CASE("estimated size") {
+  TestSpanData span{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0};
+  size_t size = estimatedSize(span);
+  REQUIRE(size >= sizeof(SpanData));
+
+  SECTION("counts long strings") {
+    span.resource = std::string(1000, 'r');
+    REQUIRE(estimatedSize(span) >= size + 1000);
+  }
+
+  SECTION("counts tags") {
+    span.meta["key"] = std::string(1000, 'v');
+    size_t tagged = estimatedSize(span);
+    REQUIRE(tagged >= size + 1000);
+    span.meta["other key"] = "value";
+    REQUIRE(estimatedSize(span) > tagged);
+  }
+
+  SECTION("of a trace counts its spans") {
+    Trace trace{new std::vector<std::unique_ptr<SpanData>>{}};
+    size_t empty = estimatedSize(trace);
+    for (int i = 0; i < 10; i++) {
+      trace->emplace_back(new TestSpanData{span});
+    }
+    REQUIRE(estimatedSize(trace) >= empty + 10 * size);
+    REQUIRE(estimatedSize(Trace{}) == 0);
+  }
+}
+
+TEST_CASE("cgroup memory limit") {
+  char directory_template[] = "/tmp/dd-opentracing-cgroup-test-XXXXXX";
+  std::string root = mkdtemp(directory_template);
+  auto writeFile = [](const std::string& path, const std::string& contents) {
+    std::ofstream file{path};
+    file << contents;
+  };
+
+  SECTION("is 0 if there's no cgroup") { REQUIRE(cgroupMemoryLimit(root) == 0); }
+
+  SECTION("is read from cgroup v2") {
+    writeFile(root + "/memory.max", "536870912\n");
+    REQUIRE(cgroupMemoryLimit(root) == 536870912);
+    writeFile(root + "/memory.max", "max\n");
+    REQUIRE(cgroupMemoryLimit(root) == 0);
+    unlink((root + "/memory.max").c_str());
+  }
+
+  SECTION("is read from cgroup v1") {
+    mkdir((root + "/memory").c_str(), 0700);
+    writeFile(root + "/memory/memory.limit_in_bytes", "268435456\n");
+    REQUIRE(cgroupMemoryLimit(root) == 268435456);
+    // What's reported when there's no limit.
+    writeFile(root + "/memory/memory.limit_in_bytes", "9223372036854771712\n");
+    REQUIRE(cgroupMemoryLimit(root) == 0);
+    unlink((root + "/memory/memory.limit_in_bytes").c_str());
+    rmdir((root + "/memory").c_str());
+  }
+
+  SECTION("is read from the process's own cgroup") {
+    std::string proc_cgroup = root + "/cgroup";
+    writeFile(proc_cgroup, "0::/system.slice/nginx.service\n");
+    mkdir((root + "/system.slice").c_str(), 0700);
+    mkdir((root + "/system.slice/nginx.service").c_str(), 0700);
+    writeFile(root + "/system.slice/nginx.service/memory.max", "536870912\n");
+    REQUIRE(cgroupMemoryLimit(root, proc_cgroup) == 536870912);
+    // An ancestor's lower limit applies too.
+    writeFile(root + "/system.slice/memory.max", "268435456\n");
+    REQUIRE(cgroupMemoryLimit(root, proc_cgroup) == 268435456);
+    unlink((root + "/system.slice/memory.max").c_str());
+    unlink((root + "/system.slice/nginx.service/memory.max").c_str());
+    rmdir((root + "/system.slice/nginx.service").c_str());
+    rmdir((root + "/system.slice").c_str());
+
+    // With cgroup v1, it's the memory controller's cgroup.
+    writeFile(proc_cgroup, "5:cpu,cpuacct:/other\n4:memory:/docker/abc\n0::/\n");
+    mkdir((root + "/memory").c_str(), 0700);
+    mkdir((root + "/memory/docker").c_str(), 0700);
+    mkdir((root + "/memory/docker/abc").c_str(), 0700);
+    writeFile(root + "/memory/docker/abc/memory.limit_in_bytes", "134217728\n");
+    REQUIRE(cgroupMemoryLimit(root, proc_cgroup) == 134217728);
+    unlink((root + "/memory/docker/abc/memory.limit_in_bytes").c_str());
+    rmdir((root + "/memory/docker/abc").c_str());
+    rmdir((root + "/memory/docker").c_str());
+    rmdir((root + "/memory").c_str());
+    unlink(proc_cgroup.c_str());
+  }
+
+  rmdir(root.c_str());
+}
@@ -2,10 +2,12 @@
 #define DD_OPENTRACING_TEST_MOCKS_H
 
 #include <curl/curl.h>
+#include <algorithm>
 #include <iostream>
 #include <list>
 #include <map>
 #include <sstream>
+#include <stdexcept>
 #include <unordered_map>
 #include "../src/writer.h"
 
@@ -27,29 +29,32 @@ struct TestSpanData : public SpanData {
                      parent_id, error);
 };
 
+// A SpanBuffer that keeps all spans, finished or not, by trace id.
 struct MockBuffer : public SpanBuffer {
   MockBuffer(){};
 
-  void registerSpan(const SpanData& span) override {
-    uint64_t trace_id = span.traceId();
-    auto trace = traces.find(trace_id);
-    if (trace == traces.end()) {
-      traces.emplace(std::make_pair(trace_id, PendingTrace{}));
-      trace = traces.find(trace_id);
+  std::shared_ptr<PendingTrace> registerSpan(const SpanData& span,
+                                             std::shared_ptr<PendingTrace> local_trace) override {
+    auto& trace = traces[span.traceId()];
+    if (trace == nullptr) {
+      trace =
+          local_trace != nullptr ? local_trace : std::make_shared<PendingTrace>(span.traceId());
     }
-    trace->second.all_spans.insert(span.spanId());
+    trace->open_spans++;
+    return trace;
   }
 
-  void finishSpan(std::unique_ptr<SpanData> span) override {
-    auto trace = traces.find(span->traceId());
-    if (trace == traces.end()) {
+  void finishSpan(const std::shared_ptr<PendingTrace>& trace,
+                  std::unique_ptr<SpanData> span) override {
+    if (trace == nullptr) {
       std::cerr << "Missing trace for finished span" << std::endl;
       return;
     }
-    trace->second.finished_spans->push_back(std::move(span));
+    trace->open_spans--;
+    trace->finished_spans->push_back(std::move(span));
   }
 
-  std::unordered_map<uint64_t, PendingTrace> traces;
+  std::unordered_map<uint64_t, std::shared_ptr<PendingTrace>> traces;
 };
 
 // A Writer implementation that allows access to the Spans recorded.
@@ -78,6 +83,38 @@ void advanceSeconds(TimePoint& t, int s) {
   t.relative_time += by;
 }
 
+// Decodes a payload for the agent's /v0.5/traces endpoint, see StringTableEncoder.
+std::vector<std::vector<TestSpanData>> decodeStringTableTraces(const char* data, size_t size) {
+  msgpack::object_handle handle = msgpack::unpack(data, size);
+  const msgpack::object& payload = handle.get();
+  if (payload.type != msgpack::type::ARRAY || payload.via.array.size != 2) {
+    throw std::runtime_error("payload isn't a string table and traces");
+  }
+  std::vector<std::string> strings;
+  payload.via.array.ptr[0].convert(strings);
+  auto string = [&](const msgpack::object& index) { return strings.at(index.as<uint32_t>()); };
+  std::vector<std::vector<TestSpanData>> traces;
+  const msgpack::object& encoded_traces = payload.via.array.ptr[1];
+  for (uint32_t t = 0; t < encoded_traces.via.array.size; t++) {
+    const msgpack::object& encoded_trace = encoded_traces.via.array.ptr[t];
+    traces.emplace_back();
+    for (uint32_t s = 0; s < encoded_trace.via.array.size; s++) {
+      const msgpack::object* field = encoded_trace.via.array.ptr[s].via.array.ptr;
+      traces.back().emplace_back(string(field[11]), string(field[0]), string(field[2]),
+                                 string(field[1]), field[3].as<uint64_t>(),
+                                 field[4].as<uint64_t>(), field[5].as<uint64_t>(),
+                                 field[6].as<int64_t>(), field[7].as<int64_t>(),
+                                 field[8].as<int32_t>());
+      const msgpack::object& meta = field[9];
+      for (uint32_t m = 0; m < meta.via.map.size; m++) {
+        traces.back().back().meta[string(meta.via.map.ptr[m].key)] =
+            string(meta.via.map.ptr[m].val);
+      }
+    }
+  }
+  return traces;
+}
+
 // Enums not hashable on some recent GCC versions:
 // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=60970
 struct EnumClassHash {
@@ -125,12 +162,25 @@ struct MockHandle : public Handle {
     }
   }
 
+  void setHeader(const std::string& name, const std::string& value) override {
+    headers[name] = value;  // Overwrite.
+  }
+
   CURLcode perform() override {
     std::unique_lock<std::mutex> lock(mutex);
     perform_called.notify_all();
     return nextPerformResult();
   }
 
+  CURLcode getinfo(CURLINFO key, long* value) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (key != CURLINFO_RESPONSE_CODE) {
+      return CURLE_UNKNOWN_OPTION;
+    }
+    *value = response_code;
+    return CURLE_OK;
+  }
+
   // Could be spurious.
   void waitUntilPerformIsCalled() {
     std::unique_lock<std::mutex> lock(mutex);
@@ -162,6 +212,8 @@ struct MockHandle : public Handle {
   std::map<std::string, std::string> headers;
   std::string error = "";
   CURLcode rcode = CURLE_OK;
+  // The HTTP status of every response.
+  long response_code = 200;
   std::atomic<bool>* is_destructed = nullptr;
   // Each time an perform is called, the next perform_result is used to determine if it
   // succeeds or fails. Loops. Default is for all operations to succeed.
@@ -181,6 +233,50 @@ struct MockHandle : public Handle {
   std::condition_variable perform_called;
 };
 
+// A MultiHandle for MockHandles. Each request is performed as soon as it's added, and is done the
+// next time poll is called.
+struct MockMultiHandle : public MultiHandle {
+  CURLMcode add(Handle* handle) override {
+    CURLcode result = handle->perform();
+    std::unique_lock<std::mutex> lock(mutex);
+    done_.emplace_back(handle, result);
+    woken_up.notify_all();
+    return CURLM_OK;
+  }
+
+  CURLMcode remove(Handle* handle) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_.erase(std::remove_if(done_.begin(), done_.end(),
+                               [&](const std::pair<Handle*, CURLcode>& request) {
+                                 return request.first == handle;
+                               }),
+                done_.end());
+    return CURLM_OK;
+  }
+
+  CURLMcode poll(std::chrono::milliseconds timeout,
+                 std::vector<std::pair<Handle*, CURLcode>>& done) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    woken_up.wait_for(lock, timeout, [&]() { return !done_.empty() || wake_up_; });
+    wake_up_ = false;
+    done.insert(done.end(), done_.begin(), done_.end());
+    done_.clear();
+    return CURLM_OK;
+  }
+
+  void wakeUp() override {
+    std::unique_lock<std::mutex> lock(mutex);
+    wake_up_ = true;
+    woken_up.notify_all();
+  }
+
+ private:
+  std::mutex mutex;
+  std::condition_variable woken_up;
+  std::vector<std::pair<Handle*, CURLcode>> done_;
+  bool wake_up_ = false;
+};
+
 }  // namespace opentracing
 }  // namespace datadog
 
@@ -9,4 +9,17 @@ TEST_CASE("tracer") {
     auto tracer = makeTracer(TracerOptions{});
     REQUIRE(tracer);
   }
+
+  SECTION("has a snapshot of its telemetry") {
+    auto tracer = makeTracer(TracerOptions{});
+    auto span = tracer->StartSpan("span");
+    auto telemetry = snapshot(*tracer);
+    REQUIRE(telemetry.spans_started == 1);
+    REQUIRE(telemetry.pending_traces == 1);
+    span->Finish();
+    telemetry = snapshot(*tracer);
+    REQUIRE(telemetry.spans_finished == 1);
+    REQUIRE(telemetry.traces_completed == 1);
+    REQUIRE(telemetry.pending_traces == 0);
+  }
 }
@@ -0,0 +1,94 @@
+#include "../src/payload_buffer.h"
+
+#include <msgpack.hpp>
+#include <string>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("payload buffer") {
+  PayloadBuffer payload{3, 16};
+
+  SECTION("keeps what's written, contiguously") {
+    payload.write("abc", 3);
+    payload.write("\0de", 3);
+    REQUIRE(payload.size() == 6);
+    REQUIRE(std::string(payload.data(), payload.size()) == std::string("abc\0de", 6));
+  }
+
+  SECTION("hands out space to be filled in") {
+    payload.write("ab", 2);
+    char* space = payload.append(20);
+    for (int i = 0; i < 20; i++) {
+      space[i] = 'c';
+    }
+    REQUIRE(std::string(payload.data(), payload.size()) == "ab" + std::string(20, 'c'));
+  }
+
+  SECTION("can be encoded into by msgpack") {
+    std::vector<std::string> value{"hello", "world"};
+    msgpack::pack(payload, value);
+    auto handle = msgpack::unpack(payload.data(), payload.size());
+    REQUIRE(handle.get().as<std::vector<std::string>>() == value);
+  }
+
+  SECTION("keeps its memory when cleared") {
+    std::string data(100, 'x');
+    payload.write(data.data(), data.size());
+    size_t capacity = payload.capacity();
+    const char* memory = payload.data();
+    payload.clear();
+    REQUIRE(payload.size() == 0);
+    REQUIRE(payload.capacity() == capacity);
+    payload.write(data.data(), data.size());
+    REQUIRE(payload.data() == memory);  // Not reallocated.
+  }
+
+  SECTION("shrinks after a spike") {
+    std::string spike(1000, 'x');
+    payload.write(spike.data(), spike.size());
+    payload.clear();
+    size_t capacity = payload.capacity();
+    REQUIRE(capacity >= 1000);
+    std::string small(20, 'x');
+    for (int i = 0; i < 2; i++) {
+      payload.write(small.data(), small.size());
+      payload.clear();
+      REQUIRE(payload.capacity() == capacity);
+    }
+    payload.write(small.data(), small.size());
+    payload.clear();
+    // Shrunk to fit the small uses, with some room to spare.
+    REQUIRE(payload.capacity() >= 40);
+    REQUIRE(payload.capacity() < capacity);
+  }
+
+  SECTION("doesn't shrink if usage is only sometimes small") {
+    std::string big(1000, 'x');
+    std::string small(20, 'x');
+    payload.write(big.data(), big.size());
+    payload.clear();
+    size_t capacity = payload.capacity();
+    for (int i = 0; i < 10; i++) {
+      payload.write(small.data(), small.size());
+      payload.clear();
+      payload.write(small.data(), small.size());
+      payload.clear();
+      payload.write(big.data(), big.size());
+      payload.clear();
+    }
+    REQUIRE(payload.capacity() == capacity);
+  }
+
+  SECTION("doesn't shrink below the minimum capacity") {
+    PayloadBuffer big_payload{1, 4096};
+    std::string data(4000, 'x');
+    big_payload.write(data.data(), data.size());
+    big_payload.clear();
+    size_t capacity = big_payload.capacity();
+    big_payload.write("x", 1);
+    big_payload.clear();
+    REQUIRE(big_payload.capacity() == capacity);
+  }
+}
@@ -67,6 +67,8 @@ TEST_CASE("SpanContext") {
       REQUIRE(received_context->id() == 420);
       REQUIRE(received_context->trace_id() == 123);
       REQUIRE(getBaggage(received_context) == dict{{"ayy", "lmao"}, {"hi", "haha"}});
+      // The context's span isn't local.
+      REQUIRE(received_context->pendingTrace() == nullptr);
 
       SECTION("even with extra keys") {
         carrier.Set("some junk thingy", "ayy lmao");
@@ -80,6 +82,20 @@ TEST_CASE("SpanContext") {
     }
   }
 
+  SECTION("doesn't propagate whether the trace was shed") {
+    context.setShed(true);
+    REQUIRE(context.withId(421).shed());
+    REQUIRE(context.serialize(carrier));
+    for (auto& key_value : carrier.text_map) {
+      REQUIRE(key_value.first.find("shed") == std::string::npos);
+    }
+    auto sc = SpanContext::deserialize(carrier);
+    auto received_context = dynamic_cast<SpanContext*>(sc->get());
+    REQUIRE(received_context);
+    REQUIRE(!received_context->shed());
+    REQUIRE(getBaggage(received_context) == dict{{"ayy", "lmao"}, {"hi", "haha"}});
+  }
+
   SECTION("serialise fails") {
     SECTION("when setting trace id fails") {
       carrier.set_fails_after = 0;
@@ -28,7 +28,7 @@ TEST_CASE("sample") {
     span->FinishWithOptions(finish_options);
 
     REQUIRE(buffer->traces.size() == 1);
-    auto &result = buffer->traces[100].finished_spans->at(0);
+    auto &result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->type == "web");
     REQUIRE(result->service == "service_name");
     REQUIRE(result->name == "/should_be_kept");
@@ -64,7 +64,7 @@ TEST_CASE("sample") {
     REQUIRE((size >= 24 && size <= 26));
     auto rate_string = std::to_string(rate);
     std::for_each(buffer->traces.begin(), buffer->traces.end(), [&](auto &trace_iter) {
-      auto &span = trace_iter.second.finished_spans->at(0);
+      auto &span = trace_iter.second->finished_spans->at(0);
       REQUIRE(span->name == "/constant_rate_sample");
       REQUIRE(span->meta["_sample_rate"] == rate_string);
     });
@@ -87,11 +87,11 @@ TEST_CASE("sample") {
     REQUIRE(buffer->traces.size() == 1);
 
     // Both spans should be recorded under the same trace.
-    REQUIRE(buffer->traces[trace_id].finished_spans->size() == 2);
+    REQUIRE(buffer->traces[trace_id]->finished_spans->size() == 2);
 
     // The trace id should be the same.
-    auto &root_span = buffer->traces[trace_id].finished_spans->at(1);
-    auto &child_span = buffer->traces[trace_id].finished_spans->at(0);
+    auto &root_span = buffer->traces[trace_id]->finished_spans->at(1);
+    auto &child_span = buffer->traces[trace_id]->finished_spans->at(0);
     REQUIRE(root_span->traceId() == child_span->traceId());
     // The span id should be different.
     REQUIRE(root_span->spanId() != child_span->spanId());
@@ -116,7 +116,7 @@ TEST_CASE("sample") {
     REQUIRE((size >= 24 && size <= 26));
     auto rate_string = std::to_string(rate);
     std::for_each(buffer->traces.begin(), buffer->traces.end(), [&](auto &trace_iter) {
-      auto &span = trace_iter.second.finished_spans->at(0);
+      auto &span = trace_iter.second->finished_spans->at(0);
       REQUIRE(span->name == "/child_span");
       REQUIRE(span->meta["_sample_rate"] == rate_string);
     });
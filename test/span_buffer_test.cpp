@@ -13,8 +13,8 @@ TEST_CASE("span buffer") {
   SECTION("can write a single-span trace") {
     auto span = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420, 0,
                                                123, 456, 0);
-    buffer.registerSpan(*span);
-    buffer.finishSpan(std::move(span));
+    auto trace = buffer.registerSpan(*span, nullptr);
+    buffer.finishSpan(trace, std::move(span));
     REQUIRE(writer->traces.size() == 1);
     REQUIRE(writer->traces[0].size() == 1);
     auto& result = writer->traces[0][0];
@@ -34,12 +34,12 @@ TEST_CASE("span buffer") {
   SECTION("can write a multi-span trace") {
     auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
                                                    0, 123, 456, 0);
-    buffer.registerSpan(*rootSpan);
+    auto trace = buffer.registerSpan(*rootSpan, nullptr);
     auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                    421, 0, 124, 455, 0);
-    buffer.registerSpan(*childSpan);
-    buffer.finishSpan(std::move(childSpan));
-    buffer.finishSpan(std::move(rootSpan));
+                                                    421, 420, 124, 455, 0);
+    REQUIRE(buffer.registerSpan(*childSpan, trace) == trace);
+    buffer.finishSpan(trace, std::move(childSpan));
+    buffer.finishSpan(trace, std::move(rootSpan));
     REQUIRE(writer->traces.size() == 1);
     REQUIRE(writer->traces[0].size() == 2);
     // Although order doesn't actually matter.
@@ -50,12 +50,12 @@ TEST_CASE("span buffer") {
   SECTION("can write a multi-span trace, even if the root finishes before a child") {
     auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
                                                    0, 123, 456, 0);
-    buffer.registerSpan(*rootSpan);
+    auto trace = buffer.registerSpan(*rootSpan, nullptr);
     auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                    421, 0, 124, 455, 0);
-    buffer.registerSpan(*childSpan);
-    buffer.finishSpan(std::move(rootSpan));
-    buffer.finishSpan(std::move(childSpan));
+                                                    421, 420, 124, 455, 0);
+    buffer.registerSpan(*childSpan, trace);
+    buffer.finishSpan(trace, std::move(rootSpan));
+    buffer.finishSpan(trace, std::move(childSpan));
     REQUIRE(writer->traces.size() == 1);
     REQUIRE(writer->traces[0].size() == 2);
     // Although order doesn't actually matter.
@@ -66,47 +66,33 @@ TEST_CASE("span buffer") {
   SECTION("doesn't write an unfinished trace") {
     auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
                                                    0, 123, 456, 0);
-    buffer.registerSpan(*rootSpan);
+    auto trace = buffer.registerSpan(*rootSpan, nullptr);
     auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                    421, 0, 124, 455, 0);
-    buffer.registerSpan(*childSpan);
-    buffer.finishSpan(std::move(childSpan));
+                                                    421, 420, 124, 455, 0);
+    buffer.registerSpan(*childSpan, trace);
+    buffer.finishSpan(trace, std::move(childSpan));
     REQUIRE(writer->traces.size() == 0);  // rootSpan still outstanding
     auto childSpan2 = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                     422, 0, 125, 457, 0);
-    buffer.registerSpan(*childSpan2);
-    buffer.finishSpan(std::move(rootSpan));
+                                                     422, 420, 125, 457, 0);
+    buffer.registerSpan(*childSpan2, trace);
+    buffer.finishSpan(trace, std::move(rootSpan));
     // Root span finished, but *after* childSpan2 was registered, so childSpan2 still oustanding.
     REQUIRE(writer->traces.size() == 0);
     // Ok now we're done!
-    buffer.finishSpan(std::move(childSpan2));
+    buffer.finishSpan(trace, std::move(childSpan2));
     REQUIRE(writer->traces.size() == 1);
     REQUIRE(writer->traces[0].size() == 3);
   }
 
-  SECTION("discards spans written without a corresponding startSpan call") {
+  SECTION("discards spans finished without a trace") {
     // Redirect cerr, so the the terminal output doesn't imply failure.
     std::stringstream error_message;
     std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
 
-    SECTION("not even a trace") {
-      auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                     420, 0, 123, 456, 0);
-      buffer.finishSpan(std::move(rootSpan));
-      REQUIRE(writer->traces.size() == 0);
-    }
-    SECTION("there's a trace but no startSpan call") {
-      auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                     420, 0, 123, 456, 0);
-      buffer.registerSpan(*rootSpan);
-      auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                      421, 0, 124, 455, 0);
-      buffer.finishSpan(std::move(childSpan));
-      buffer.finishSpan(std::move(rootSpan));
-      REQUIRE(writer->traces.size() == 1);
-      REQUIRE(writer->traces[0].size() == 1);  // Only rootSpan got written.
-      REQUIRE(writer->traces[0][0]->span_id == 420);
-    }
+    auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
+                                                   0, 123, 456, 0);
+    buffer.finishSpan(nullptr, std::move(rootSpan));
+    REQUIRE(writer->traces.size() == 0);
 
     std::cerr.rdbuf(stderr);  // Restore stderr.
   }
@@ -114,50 +100,435 @@ TEST_CASE("span buffer") {
   SECTION("spans written after a trace is submitted just start a new trace") {
     auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
                                                    0, 123, 456, 0);
-    buffer.registerSpan(*rootSpan);
-    buffer.finishSpan(std::move(rootSpan));
+    auto trace = buffer.registerSpan(*rootSpan, nullptr);
+    buffer.finishSpan(trace, std::move(rootSpan));
     REQUIRE(writer->traces.size() == 1);
     auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
-                                                    421, 0, 123, 456, 0);
-    buffer.registerSpan(*childSpan);
-    buffer.finishSpan(std::move(childSpan));
+                                                    421, 420, 123, 456, 0);
+    buffer.registerSpan(*childSpan, trace);
+    buffer.finishSpan(trace, std::move(childSpan));
+    REQUIRE(writer->traces.size() == 2);
+    REQUIRE(writer->traces[1].size() == 1);
+    REQUIRE(writer->traces[1][0]->span_id == 421);
+  }
+
+  SECTION("counts spans and traces for telemetry") {
+    auto rootSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420,
+                                                   0, 123, 456, 0);
+    auto trace = buffer.registerSpan(*rootSpan, nullptr);
+    auto remoteSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 430,
+                                                     431, 1, 123, 456, 0);
+    auto remote_trace = buffer.registerSpan(*remoteSpan, nullptr);
+    TracerTelemetry telemetry;
+    buffer.addTelemetry(telemetry);
+    REQUIRE(telemetry.pending_traces == 2);
+    buffer.finishSpan(trace, std::move(rootSpan));
+    telemetry = TracerTelemetry{};
+    buffer.addTelemetry(telemetry);
+    REQUIRE(telemetry.spans_finished == 1);
+    REQUIRE(telemetry.traces_completed == 1);
+    REQUIRE(telemetry.pending_traces == 1);
+    // A span registered after its trace was sent makes the trace pending again.
+    auto childSpan = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
+                                                    421, 420, 123, 456, 0);
+    buffer.registerSpan(*childSpan, trace);
+    telemetry = TracerTelemetry{};
+    buffer.addTelemetry(telemetry);
+    REQUIRE(telemetry.pending_traces == 2);
+    buffer.finishSpan(trace, std::move(childSpan));
+    buffer.finishSpan(remote_trace, std::move(remoteSpan));
+    telemetry = TracerTelemetry{};
+    buffer.addTelemetry(telemetry);
+    REQUIRE(telemetry.spans_finished == 3);
+    REQUIRE(telemetry.traces_completed == 3);
+    REQUIRE(telemetry.pending_traces == 0);
+  }
+
+  SECTION("spans with a remote parent are matched up by trace id") {
+    // Two spans that are children of the same remote span (eg. from an extracted context).
+    auto span1 = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 421,
+                                                1, 123, 456, 0);
+    auto trace1 = buffer.registerSpan(*span1, nullptr);
+    auto span2 = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 422,
+                                                1, 123, 456, 0);
+    auto trace2 = buffer.registerSpan(*span2, nullptr);
+    REQUIRE(trace1 == trace2);
+    // And a local child of one of them.
+    auto child = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 423,
+                                                421, 123, 456, 0);
+    buffer.registerSpan(*child, trace1);
+    buffer.finishSpan(trace1, std::move(span1));
+    buffer.finishSpan(trace2, std::move(span2));
+    REQUIRE(writer->traces.size() == 0);
+    buffer.finishSpan(trace1, std::move(child));
+    REQUIRE(writer->traces.size() == 1);
+    REQUIRE(writer->traces[0].size() == 3);
+
+    // Once written, further spans with a remote parent start a new trace.
+    auto span3 = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 424,
+                                                1, 123, 456, 0);
+    auto trace3 = buffer.registerSpan(*span3, nullptr);
+    REQUIRE(trace3 != trace1);
+    buffer.finishSpan(trace3, std::move(span3));
     REQUIRE(writer->traces.size() == 2);
+    REQUIRE(writer->traces[1].size() == 1);
   }
 
+  SECTION("partial flushing") {
+    TimePoint time{std::chrono::system_clock::now(), std::chrono::steady_clock::now()};
+    TimeProvider get_time = [&time]() { return time; };  // Mock clock.
+    WritingSpanBufferOptions options;
+    auto root = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420, 0,
+                                               123, 456, 0);
+    auto addChild = [&](WritingSpanBuffer& buffer, std::shared_ptr<PendingTrace> trace,
+                        uint64_t span_id) {
+      auto child = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
+                                                  span_id, 420, 123, 456, 0);
+      buffer.registerSpan(*child, trace);
+      buffer.finishSpan(trace, std::move(child));
+    };
+
+    SECTION("is off by default") {
+      WritingSpanBuffer partial_buffer{writer_ptr, options, get_time};
+      auto trace = partial_buffer.registerSpan(*root, nullptr);
+      for (uint64_t span_id = 421; span_id < 521; span_id++) {
+        addChild(partial_buffer, trace, span_id);
+      }
+      advanceSeconds(time, 3600);
+      addChild(partial_buffer, trace, 521);
+      REQUIRE(writer->traces.size() == 0);
+      partial_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 1);
+      REQUIRE(writer->traces[0].size() == 102);
+    }
+
+    SECTION("sends finished spans once there are enough of them") {
+      options.partial_flush_min_spans = 3;
+      WritingSpanBuffer partial_buffer{writer_ptr, options, get_time};
+      auto trace = partial_buffer.registerSpan(*root, nullptr);
+      addChild(partial_buffer, trace, 421);
+      addChild(partial_buffer, trace, 422);
+      REQUIRE(writer->traces.size() == 0);
+      addChild(partial_buffer, trace, 423);
+      REQUIRE(writer->traces.size() == 1);
+      REQUIRE(writer->traces[0].size() == 3);
+      addChild(partial_buffer, trace, 424);
+      REQUIRE(writer->traces.size() == 1);
+      // The rest are sent when the trace finishes.
+      partial_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 2);
+      REQUIRE(writer->traces[1].size() == 2);
+      REQUIRE(writer->traces[1][0]->span_id == 424);
+      REQUIRE(writer->traces[1][1]->span_id == 420);
+    }
+
+    SECTION("sends finished spans of a trace that has been open too long") {
+      options.partial_flush_max_age = std::chrono::seconds(10);
+      WritingSpanBuffer partial_buffer{writer_ptr, options, get_time};
+      auto trace = partial_buffer.registerSpan(*root, nullptr);
+      addChild(partial_buffer, trace, 421);
+      advanceSeconds(time, 9);
+      addChild(partial_buffer, trace, 422);
+      REQUIRE(writer->traces.size() == 0);
+      advanceSeconds(time, 1);
+      addChild(partial_buffer, trace, 423);
+      REQUIRE(writer->traces.size() == 1);
+      REQUIRE(writer->traces[0].size() == 3);
+      // The age is counted from the last time spans were sent.
+      advanceSeconds(time, 9);
+      addChild(partial_buffer, trace, 424);
+      REQUIRE(writer->traces.size() == 1);
+      advanceSeconds(time, 1);
+      addChild(partial_buffer, trace, 425);
+      REQUIRE(writer->traces.size() == 2);
+      REQUIRE(writer->traces[1].size() == 2);
+      partial_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 3);
+      REQUIRE(writer->traces[2].size() == 1);
+    }
+  }
+
+  SECTION("memory budget") {
+    WritingSpanBufferOptions options;
+    auto root = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420, 420, 0,
+                                               123, 456, 0);
+    size_t span_size = estimatedSize(*root);
+    options.memory_budget = std::make_shared<MemoryBudget>(2 * span_size + span_size / 2);
+    WritingSpanBuffer budget_buffer{writer_ptr, options};
+    auto trace = budget_buffer.registerSpan(*root, nullptr);
+    for (uint64_t span_id = 421; span_id <= 423; span_id++) {
+      auto child = std::make_unique<TestSpanData>("type", "service", "resource", "name", 420,
+                                                  span_id, 420, 123, 456, 0);
+      budget_buffer.registerSpan(*child, trace);
+      budget_buffer.finishSpan(trace, std::move(child));
+    }
+    // The third didn't fit, so it was sent with the others.
+    REQUIRE(writer->traces.size() == 1);
+    REQUIRE(writer->traces[0].size() == 3);
+    REQUIRE(options.memory_budget->usedBytes() == 0);
+    REQUIRE(options.memory_budget->rejections() == 1);
+    budget_buffer.finishSpan(trace, std::move(root));
+    REQUIRE(writer->traces.size() == 2);
+    REQUIRE(options.memory_budget->usedBytes() == 0);
+  }
+
+  SECTION("expiring traces") {
+    // Redirect cerr, so the the terminal output doesn't imply failure.
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    TimePoint time{std::chrono::system_clock::now(), std::chrono::steady_clock::now()};
+    TimeProvider get_time = [&time]() { return time; };  // Mock clock.
+    WritingSpanBufferOptions options;
+    options.pending_trace_ttl = std::chrono::seconds(60);
+    auto makeSpan = [](uint64_t trace_id, uint64_t span_id, uint64_t parent_id) {
+      return std::make_unique<TestSpanData>("type", "service", "resource", "name", trace_id,
+                                            span_id, parent_id, 123, 456, 0);
+    };
+
+    SECTION("doesn't happen without a TTL") {
+      WritingSpanBuffer expiring_buffer{writer_ptr, WritingSpanBufferOptions{}, get_time};
+      auto root = makeSpan(420, 420, 0);
+      auto trace = expiring_buffer.registerSpan(*root, nullptr);
+      advanceSeconds(time, 3600);
+      REQUIRE(expiring_buffer.expireTraces() == 0);
+      expiring_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 1);
+    }
+
+    SECTION("sends the finished spans of traces that are unfinished after the TTL") {
+      WritingSpanBuffer expiring_buffer{writer_ptr, options, get_time};
+      // A local trace with a span that's never finished.
+      auto root = makeSpan(420, 420, 0);
+      auto trace = expiring_buffer.registerSpan(*root, nullptr);
+      auto child = makeSpan(420, 421, 420);
+      expiring_buffer.registerSpan(*child, trace);
+      expiring_buffer.finishSpan(trace, std::move(child));
+      // And one with a remote parent, started later.
+      advanceSeconds(time, 30);
+      auto remote_child = makeSpan(430, 431, 1);
+      auto remote_trace = expiring_buffer.registerSpan(*remote_child, nullptr);
+      // And one that finishes.
+      auto complete_root = makeSpan(440, 440, 0);
+      auto complete_trace = expiring_buffer.registerSpan(*complete_root, nullptr);
+      expiring_buffer.finishSpan(complete_trace, std::move(complete_root));
+      REQUIRE(writer->traces.size() == 1);
+
+      advanceSeconds(time, 29);
+      REQUIRE(expiring_buffer.expireTraces() == 0);
+      advanceSeconds(time, 1);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(writer->traces.size() == 2);
+      REQUIRE(writer->traces[1].size() == 1);
+      REQUIRE(writer->traces[1][0]->span_id == 421);
+      REQUIRE(expiring_buffer.expiredTraces() == 1);
+      REQUIRE(expiring_buffer.expiredSpans() == 1);
+      TracerTelemetry telemetry;
+      expiring_buffer.addTelemetry(telemetry);
+      REQUIRE(telemetry.traces_expired == 1);
+      REQUIRE(telemetry.pending_traces == 1);  // The trace with a remote parent.
+      // Spans of the expired trace that finish later are sent by themselves.
+      expiring_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 3);
+      REQUIRE(writer->traces[2].size() == 1);
+      REQUIRE(writer->traces[2][0]->span_id == 420);
+      REQUIRE(expiring_buffer.expiredSpans() == 2);
+
+      advanceSeconds(time, 30);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(expiring_buffer.expiredTraces() == 2);
+      // No finished spans to send.
+      REQUIRE(writer->traces.size() == 3);
+      // New spans of the remote trace start a new trace.
+      auto remote_child2 = makeSpan(430, 432, 1);
+      REQUIRE(expiring_buffer.registerSpan(*remote_child2, nullptr) != remote_trace);
+    }
+
+    SECTION("expires spans that start after their trace completed or expired") {
+      WritingSpanBuffer expiring_buffer{writer_ptr, options, get_time};
+      auto root = makeSpan(420, 420, 0);
+      auto trace = expiring_buffer.registerSpan(*root, nullptr);
+      expiring_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 1);
+      // A span that starts after the trace completed, and is never finished, holds up its child.
+      advanceSeconds(time, 30);
+      auto late = makeSpan(420, 421, 420);
+      REQUIRE(expiring_buffer.registerSpan(*late, trace) == trace);
+      auto late_child = makeSpan(420, 422, 421);
+      expiring_buffer.registerSpan(*late_child, trace);
+      expiring_buffer.finishSpan(trace, std::move(late_child));
+      REQUIRE(writer->traces.size() == 1);
+      // The TTL starts again from when the trace was reopened.
+      advanceSeconds(time, 59);
+      REQUIRE(expiring_buffer.expireTraces() == 0);
+      advanceSeconds(time, 1);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(writer->traces.size() == 2);
+      REQUIRE(writer->traces[1][0]->span_id == 422);
+      expiring_buffer.finishSpan(trace, std::move(late));
+      REQUIRE(writer->traces.size() == 3);
+      // The same goes for a span that starts after the trace expired.
+      auto later = makeSpan(420, 423, 420);
+      expiring_buffer.registerSpan(*later, trace);
+      auto later_child = makeSpan(420, 424, 423);
+      expiring_buffer.registerSpan(*later_child, trace);
+      expiring_buffer.finishSpan(trace, std::move(later_child));
+      REQUIRE(writer->traces.size() == 3);
+      advanceSeconds(time, 60);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(writer->traces.size() == 4);
+      REQUIRE(writer->traces[3][0]->span_id == 424);
+      REQUIRE(expiring_buffer.expiredTraces() == 2);
+    }
+
+    SECTION("counts reopened traces as pending until they complete or expire") {
+      WritingSpanBuffer expiring_buffer{writer_ptr, options, get_time};
+      auto pendingTraces = [&]() {
+        TracerTelemetry telemetry;
+        expiring_buffer.addTelemetry(telemetry);
+        return telemetry.pending_traces;
+      };
+      auto root = makeSpan(420, 420, 0);
+      auto trace = expiring_buffer.registerSpan(*root, nullptr);
+      auto child = makeSpan(420, 421, 420);
+      expiring_buffer.registerSpan(*child, trace);
+      advanceSeconds(time, 60);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(pendingTraces() == 0);
+      expiring_buffer.finishSpan(trace, std::move(child));
+      expiring_buffer.finishSpan(trace, std::move(root));
+      // Reopened after it expired, then completed.
+      auto late = makeSpan(420, 422, 420);
+      expiring_buffer.registerSpan(*late, trace);
+      REQUIRE(pendingTraces() == 1);
+      expiring_buffer.finishSpan(trace, std::move(late));
+      REQUIRE(pendingTraces() == 0);
+      // Reopened after it completed, then expired.
+      auto leaked = makeSpan(420, 423, 420);
+      expiring_buffer.registerSpan(*leaked, trace);
+      REQUIRE(pendingTraces() == 1);
+      advanceSeconds(time, 60);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      REQUIRE(pendingTraces() == 0);
+    }
+
+    SECTION("can drop the spans of expired traces") {
+      options.flush_expired_traces = false;
+      WritingSpanBuffer expiring_buffer{writer_ptr, options, get_time};
+      auto root = makeSpan(420, 420, 0);
+      auto trace = expiring_buffer.registerSpan(*root, nullptr);
+      auto child = makeSpan(420, 421, 420);
+      expiring_buffer.registerSpan(*child, trace);
+      expiring_buffer.finishSpan(trace, std::move(child));
+      advanceSeconds(time, 60);
+      REQUIRE(expiring_buffer.expireTraces() == 1);
+      expiring_buffer.finishSpan(trace, std::move(root));
+      REQUIRE(writer->traces.size() == 0);
+      REQUIRE(expiring_buffer.expiredSpans() == 2);
+    }
+
+    SECTION("is done periodically by the writer") {
+      auto agent_writer = std::make_shared<AgentWriter>(
+          std::unique_ptr<Handle>{new MockHandle{}}, "v0.1.0", std::chrono::seconds(3600), 100,
+          std::vector<std::chrono::milliseconds>{}, "hostname", 6319);
+      {
+        WritingSpanBuffer expiring_buffer{agent_writer, options, get_time};
+        auto root = makeSpan(420, 420, 0);
+        auto trace = expiring_buffer.registerSpan(*root, nullptr);
+        advanceSeconds(time, 60);
+        // Wakes the writer twice, so that it's run the task at least once.
+        agent_writer->flush();
+        agent_writer->flush();
+        REQUIRE(expiring_buffer.expiredTraces() == 1);
+      }
+      // The buffer is gone, but the writer can still be used.
+      agent_writer->flush();
+    }
+
+    std::cerr.rdbuf(stderr);  // Restore stderr.
+  }
+
+  SECTION("traces are kept apart regardless of the number of shards") {
+    for (size_t num_shards : {1, 2, 7}) {
+      auto sharded_writer = std::make_shared<MockWriter>();
+      WritingSpanBufferOptions options;
+      options.num_shards = num_shards;
+      WritingSpanBuffer sharded_buffer{sharded_writer, options};
+      REQUIRE(sharded_buffer.numShards() == num_shards);
+      std::vector<std::unique_ptr<TestSpanData>> spans;
+      std::vector<std::shared_ptr<PendingTrace>> traces;
+      for (uint64_t trace_id = 1; trace_id <= 20; trace_id++) {
+        // All with remote parents, so that they're looked up by trace id.
+        for (uint64_t span_id = trace_id * 100; span_id < trace_id * 100 + 3; span_id++) {
+          spans.emplace_back(std::make_unique<TestSpanData>(
+              "type", "service", "resource", "name", trace_id, span_id, 1, 123, 456, 0));
+          traces.push_back(sharded_buffer.registerSpan(*spans.back(), nullptr));
+        }
+      }
+      // Finish all but the last span of each trace, then the last spans.
+      for (size_t i = 0; i < spans.size(); i++) {
+        if (i % 3 != 2) {
+          sharded_buffer.finishSpan(traces[i], std::move(spans[i]));
+        }
+      }
+      REQUIRE(sharded_writer->traces.size() == 0);
+      for (size_t i = 2; i < spans.size(); i += 3) {
+        sharded_buffer.finishSpan(traces[i], std::move(spans[i]));
+      }
+      REQUIRE(sharded_writer->traces.size() == 20);
+      for (auto& trace : sharded_writer->traces) {
+        REQUIRE(trace.size() == 3);
+        for (auto& span : trace) {
+          REQUIRE(span->trace_id == trace[0]->trace_id);
+        }
+      }
+    }
+  }
+
+  SECTION("picks a number of shards if none is given") { REQUIRE(buffer.numShards() > 0); }
+
   SECTION("thread safe") {
     std::vector<std::thread> trace_writers;
     // Buffer 5 traces at once.
     for (uint64_t trace_id = 10; trace_id <= 50; trace_id += 10) {
       trace_writers.emplace_back(
           [&](uint64_t trace_id) {
-            // For each trace, buffer 5 spans at once.
+            // Each trace has a local root, with 5 local children and 5 children of a remote span,
+            // all buffered at once.
+            auto root = std::make_unique<TestSpanData>("type", "service", "resource", "name",
+                                                       trace_id, trace_id, 0, 123, 456, 0);
+            auto root_trace = buffer.registerSpan(*root, nullptr);
+            std::vector<std::shared_ptr<PendingTrace>> traces(10);
             std::vector<std::thread> span_writers;
-            for (uint64_t span_id = trace_id; span_id < trace_id + 5; span_id++) {
+            for (uint64_t i = 0; i < 10; i++) {
               span_writers.emplace_back(
-                  [&](uint64_t span_id) {
+                  [&](uint64_t i) {
+                    bool local = i < 5;
                     auto span = std::make_unique<TestSpanData>(
-                        "type", "service", "resource", "name", trace_id, span_id, 0, 123, 456, 0);
-                    buffer.registerSpan(*span);
+                        "type", "service", "resource", "name", trace_id, trace_id + i + 1,
+                        local ? trace_id : 1, 123, 456, 0);
+                    traces[i] = buffer.registerSpan(*span, local ? root_trace : nullptr);
                   },
-                  span_id);
+                  i);
             }
             // Wait for all spans to be registered before finishing them.
             for (std::thread& span_writer : span_writers) {
               span_writer.join();
             }
             span_writers.clear();
-            for (uint64_t span_id = trace_id; span_id < trace_id + 5; span_id++) {
+            for (uint64_t i = 0; i < 10; i++) {
               span_writers.emplace_back(
-                  [&](uint64_t span_id) {
+                  [&](uint64_t i) {
                     auto span = std::make_unique<TestSpanData>(
-                        "type", "service", "resource", "name", trace_id, span_id, 0, 123, 456, 0);
-                    buffer.finishSpan(std::move(span));
+                        "type", "service", "resource", "name", trace_id, trace_id + i + 1,
+                        i < 5 ? trace_id : 1, 123, 456, 0);
+                    buffer.finishSpan(traces[i], std::move(span));
                   },
-                  span_id);
+                  i);
             }
             for (std::thread& span_writer : span_writers) {
               span_writer.join();
             }
+            buffer.finishSpan(root_trace, std::move(root));
           },
           trace_id);
     }
@@ -165,9 +536,13 @@ TEST_CASE("span buffer") {
       trace_writer.join();
     }
     // Mostly we REQUIRE that this doesn't SIGABRT :D
-    REQUIRE(writer->traces.size() == 5);
-    for (int i = 0; i < 5; i++) {
-      REQUIRE(writer->traces[i].size() == 5);
+    // Each trace is written as two: the local spans, and the spans with a remote parent.
+    REQUIRE(writer->traces.size() == 10);
+    size_t num_spans = 0;
+    for (auto& trace : writer->traces) {
+      REQUIRE((trace.size() == 5 || trace.size() == 6));
+      num_spans += trace.size();
     }
+    REQUIRE(num_spans == 55);
   }
 }
@@ -37,7 +37,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 100);
     REQUIRE(result->parent_id == 0);
@@ -60,8 +60,8 @@ TEST_CASE("span") {
               ""};
     REQUIRE(buffer->traces.size() == 1);
     REQUIRE(buffer->traces.find(100) != buffer->traces.end());
-    REQUIRE(buffer->traces[100].finished_spans->size() == 0);
-    REQUIRE(buffer->traces[100].all_spans.size() == 1);
+    REQUIRE(buffer->traces[100]->finished_spans->size() == 0);
+    REQUIRE(buffer->traces[100]->open_spans == 1);
   }
 
   SECTION("timed correctly") {
@@ -83,7 +83,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->duration == 10000000000);
   }
 
@@ -131,7 +131,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces[span_id].finished_spans->back();
+      auto& result = buffer->traces[span_id]->finished_spans->back();
       REQUIRE(result->meta.find("http.url")->second == test_case.second);
     }
   }
@@ -159,7 +159,7 @@ TEST_CASE("span") {
     std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
     REQUIRE(buffer->traces.size() == 1);
     REQUIRE(buffer->traces.find(100) != buffer->traces.end());
-    REQUIRE(buffer->traces[100].finished_spans->size() == 1);
+    REQUIRE(buffer->traces[100]->finished_spans->size() == 1);
   }
 
   SECTION("handles tags") {
@@ -194,7 +194,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     // Check "map" seperately, because JSON key order is non-deterministic therefore we can't do
     // simple string matching.
     REQUIRE(json::parse(result->meta["map"]) ==
@@ -236,7 +236,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     // Datadog special tags aren't kept, they just set the Span values.
     REQUIRE(result->meta == std::unordered_map<std::string, std::string>{
                                 {"tag with no special meaning", "ayy lmao"}});
@@ -265,7 +265,7 @@ TEST_CASE("span") {
     const ot::FinishSpanOptions finish_options;
     span.FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->meta ==
             std::unordered_map<std::string, std::string>{{"operation", "original span name"}});
     REQUIRE(result->name == "overridden operation name");
@@ -295,7 +295,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces[100].finished_spans->at(0);
+      auto& result = buffer->traces[100]->finished_spans->at(0);
       REQUIRE(result->name == "operation name");
       REQUIRE(result->resource == "operation name");
     }
@@ -305,7 +305,7 @@ TEST_CASE("span") {
       const ot::FinishSpanOptions finish_options;
       span.FinishWithOptions(finish_options);
 
-      auto& result = buffer->traces[100].finished_spans->at(0);
+      auto& result = buffer->traces[100]->finished_spans->at(0);
       REQUIRE(result->name == "operation name");
       REQUIRE(result->resource == "resource tag override");
     }
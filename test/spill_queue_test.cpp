@@ -0,0 +1,213 @@
+#include "../src/spill_queue.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+namespace {
+PayloadBuffer makePayload(char c, size_t size) {
+  PayloadBuffer payload;
+  payload.write(std::string(size, c).data(), size);
+  return payload;
+}
+
+// Returns the first byte of the oldest payload in the queue, or 0 if it's empty.
+char frontOf(SpillQueue &queue) {
+  PayloadBuffer payload;
+  SpilledPayload spilled;
+  if (!queue.front(payload, spilled)) {
+    return 0;
+  }
+  return payload.data()[0];
+}
+
+std::vector<std::string> listFiles(const std::string &directory) {
+  std::vector<std::string> files;
+  DIR *dir = opendir(directory.c_str());
+  while (dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      files.push_back(directory + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+// Overwrites a byte of a file, as if the process had died part way through writing it.
+void corrupt(const std::string &path, long offset) {
+  FILE *file = std::fopen(path.c_str(), "r+b");
+  std::fseek(file, offset, SEEK_SET);
+  std::fputc(0xff, file);
+  std::fclose(file);
+}
+}  // namespace
+
+TEST_CASE("spill queue") {
+  char directory_template[] = "/tmp/dd-opentracing-spill-test-XXXXXX";
+  std::string directory = mkdtemp(directory_template);
+  // Each segment holds exactly 3 of the payloads below: 2 headers of 32 bytes, then 3 records of
+  // 20 + 300 bytes.
+  SpillQueueOptions options;
+  options.directory = directory;
+  options.segment_size = 1024;
+  options.max_bytes = 2048;
+  const size_t payload_size = 300;
+  const long record_size = 20 + payload_size;
+  std::unique_ptr<SpillQueue> queue{new SpillQueue{options}};
+
+  SECTION("returns payloads in the order they were pushed") {
+    for (char c : std::string("abcd")) {
+      REQUIRE(queue->push(makePayload(c, payload_size), 1, 7));
+    }
+    for (char c : std::string("abcd")) {
+      PayloadBuffer payload;
+      SpilledPayload spilled;
+      REQUIRE(queue->front(payload, spilled));
+      REQUIRE(std::string(payload.data(), payload.size()) == std::string(payload_size, c));
+      REQUIRE(spilled.num_traces == 1);
+      REQUIRE(spilled.format == 7);
+      REQUIRE(frontOf(*queue) == c);  // Until it's popped.
+      queue->pop(spilled, c == 'd');
+    }
+    REQUIRE(queue->empty());
+    REQUIRE(frontOf(*queue) == 0);
+    auto stats = queue->stats();
+    REQUIRE(stats.spilled_payloads == 4);
+    REQUIRE(stats.replayed_payloads == 3);
+    REQUIRE(stats.rejected_payloads == 1);
+    REQUIRE(stats.queued_payloads == 0);
+    // The segment that was all read has been deleted.
+    REQUIRE(listFiles(directory).size() == 1);
+  }
+
+  SECTION("picks up the payloads left by an earlier queue") {
+    for (char c : std::string("abcd")) {
+      queue->push(makePayload(c, payload_size), 1, 0);
+    }
+    PayloadBuffer payload;
+    SpilledPayload spilled;
+    queue->front(payload, spilled);
+    queue->pop(spilled);
+    queue.reset();
+    queue.reset(new SpillQueue{options});
+    REQUIRE(queue->stats().queued_payloads == 3);
+    REQUIRE(frontOf(*queue) == 'b');
+    // New payloads go after them.
+    queue->push(makePayload('e', payload_size), 1, 0);
+    for (char c : std::string("bcde")) {
+      REQUIRE(queue->front(payload, spilled));
+      REQUIRE(payload.data()[0] == c);
+      queue->pop(spilled);
+    }
+    REQUIRE(queue->empty());
+  }
+
+  SECTION("ignores a record that was only partly written") {
+    queue->push(makePayload('a', payload_size), 1, 0);
+    queue->push(makePayload('b', payload_size), 1, 0);
+    queue.reset();
+    corrupt(listFiles(directory)[0], 64 + 2 * record_size - 1);
+    queue.reset(new SpillQueue{options});
+    REQUIRE(queue->stats().queued_payloads == 1);
+    // The space is reused.
+    queue->push(makePayload('c', payload_size), 1, 0);
+    PayloadBuffer payload;
+    SpilledPayload spilled;
+    for (char c : std::string("ac")) {
+      REQUIRE(queue->front(payload, spilled));
+      REQUIRE(payload.data()[0] == c);
+      queue->pop(spilled);
+    }
+    REQUIRE(queue->empty());
+  }
+
+  SECTION("falls back to the other copy of a segment header that was only partly written") {
+    for (char c : std::string("abc")) {
+      queue->push(makePayload(c, payload_size), 1, 0);
+    }
+    PayloadBuffer payload;
+    SpilledPayload spilled;
+    queue->front(payload, spilled);
+    queue->pop(spilled);  // Writes the first copy of the header.
+    queue.reset();
+    corrupt(listFiles(directory)[0], 0);
+    queue.reset(new SpillQueue{options});
+    // The other copy is from before the pop, so the payload is sent again rather than lost.
+    REQUIRE(queue->stats().queued_payloads == 3);
+    REQUIRE(frontOf(*queue) == 'a');
+  }
+
+  SECTION("evicts the oldest payloads to stay within max_bytes") {
+    for (char c : std::string("abcdefg")) {
+      REQUIRE(queue->push(makePayload(c, payload_size), 1, 0));
+    }
+    REQUIRE(listFiles(directory).size() == 2);
+    auto stats = queue->stats();
+    REQUIRE(stats.evicted_payloads == 3);
+    REQUIRE(stats.queued_payloads == 4);
+    REQUIRE(frontOf(*queue) == 'd');
+  }
+
+  SECTION("doesn't pop a payload that was evicted after it was taken") {
+    for (char c : std::string("abc")) {
+      queue->push(makePayload(c, payload_size), 1, 0);
+    }
+    PayloadBuffer payload;
+    SpilledPayload spilled;
+    queue->front(payload, spilled);
+    for (char c : std::string("defg")) {
+      queue->push(makePayload(c, payload_size), 1, 0);
+    }
+    queue->pop(spilled);
+    REQUIRE(queue->stats().queued_payloads == 4);
+    REQUIRE(frontOf(*queue) == 'd');
+  }
+
+  SECTION("only one queue uses a directory at a time") {
+    queue->push(makePayload('a', payload_size), 1, 0);
+    // Redirect cerr, so the the terminal output doesn't imply failure.
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    SpillQueue other{options};
+    std::cerr.rdbuf(stderr);
+    REQUIRE(queue->ownsDirectory());
+    REQUIRE(!other.ownsDirectory());
+    // The other queue doesn't pick up (or add to) the payloads.
+    REQUIRE(other.empty());
+    REQUIRE(!other.push(makePayload('b', payload_size), 1, 0));
+    REQUIRE(queue->stats().queued_payloads == 1);
+    REQUIRE(listFiles(directory).size() == 1);
+    // Once the first queue is gone, the directory can be used again.
+    queue.reset();
+    queue.reset(new SpillQueue{options});
+    REQUIRE(queue->ownsDirectory());
+    REQUIRE(frontOf(*queue) == 'a');
+  }
+
+  SECTION("drops payloads that don't fit in a segment") {
+    REQUIRE(!queue->push(makePayload('a', 1024), 1, 0));
+    auto stats = queue->stats();
+    REQUIRE(stats.dropped_payloads == 1);
+    REQUIRE(stats.spilled_payloads == 0);
+    REQUIRE(queue->empty());
+  }
+
+  queue.reset();
+  for (auto &file : listFiles(directory)) {
+    unlink(file.c_str());
+  }
+  unlink((directory + "/.lock").c_str());
+  rmdir(directory.c_str());
+}
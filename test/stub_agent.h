@@ -0,0 +1,394 @@
+#ifndef DD_OPENTRACING_TEST_STUB_AGENT_H
+#define DD_OPENTRACING_TEST_STUB_AGENT_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <msgpack.hpp>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace datadog {
+namespace opentracing {
+
+// How a StubAgent responds to requests.
+struct StubAgentBehaviour {
+  // How long to wait before responding to each request. Longer than the client's timeout
+  // simulates an agent that times out.
+  std::chrono::milliseconds latency{0};
+  // The HTTP status code of each response.
+  int status = 200;
+  // If not empty, requests to this path get a 404 status instead, like from an agent that doesn't
+  // have the endpoint.
+  std::string missing_path;
+  // If true, the connection is closed without a response.
+  bool hang_up = false;
+};
+
+// A request received by a StubAgent.
+struct StubAgentRequest {
+  std::string method;
+  std::string path;
+  // Header names are lower-cased.
+  std::map<std::string, std::string> headers;
+  std::string body;
+};
+
+// A stand-in for the Datadog agent, for tests and benchmarks that use a real transport. Listens
+// for HTTP on an ephemeral localhost port (or a Unix domain socket), decodes (and if need be,
+// gunzips) the msgpack trace payloads it receives and counts what was in them. Responses
+// (latency, status, hang-ups) can be controlled with setBehaviour().
+class StubAgent {
+ public:
+  // Starts listening on localhost. Throws runtime_error if it can't.
+  StubAgent() {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+      throw std::runtime_error("StubAgent: unable to create socket");
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd_, 16) != 0 ||
+        getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+      close(listen_fd_);
+      throw std::runtime_error("StubAgent: unable to listen on localhost");
+    }
+    port_ = ntohs(address.sin_port);
+    acceptor_ = std::thread{[this]() { acceptConnections(); }};
+  }
+
+  // Starts listening on a Unix domain socket at the given path, replacing any file that's there.
+  // Throws runtime_error if it can't.
+  explicit StubAgent(std::string socket_path) : socket_path_(socket_path) {
+    sockaddr_un address{};
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("StubAgent: socket path too long");
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+      throw std::runtime_error("StubAgent: unable to create socket");
+    }
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(socket_path.c_str());
+    if (bind(listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd_, 16) != 0) {
+      close(listen_fd_);
+      throw std::runtime_error("StubAgent: unable to listen on " + socket_path);
+    }
+    acceptor_ = std::thread{[this]() { acceptConnections(); }};
+  }
+
+  ~StubAgent() { stop(); }
+
+  // Stops accepting connections and closes any open ones.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (stopped_) {
+        return;
+      }
+      stopped_ = true;
+      for (int fd : connection_fds_) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    received_.notify_all();
+    acceptor_.join();
+    for (auto &connection : connections_) {
+      connection.join();
+    }
+    close(listen_fd_);
+    if (!socket_path_.empty()) {
+      unlink(socket_path_.c_str());
+    }
+  }
+
+  // The port listened on, or 0 if it's a Unix domain socket.
+  uint32_t port() const { return port_; }
+
+  void setBehaviour(StubAgentBehaviour behaviour) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    behaviour_ = behaviour;
+  }
+
+  // Blocks until the agent has received at least the given number of traces, or the timeout
+  // passes. Returns true if the traces were received.
+  bool waitForTraces(uint64_t num_traces, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    return received_.wait_for(lock, timeout,
+                              [&]() { return traces_ >= num_traces || stopped_; }) &&
+           traces_ >= num_traces;
+  }
+
+  StubAgentRequest lastRequest() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return last_request_;
+  }
+
+  uint64_t requests() const { return requests_; }
+  // Connections accepted.
+  uint64_t connections() const { return num_connections_; }
+  uint64_t traces() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return traces_;
+  }
+  uint64_t spans() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return spans_;
+  }
+  // Bytes received, headers included.
+  uint64_t bytes() const { return bytes_; }
+  // Requests whose body couldn't be decoded.
+  uint64_t decodeErrors() const { return decode_errors_; }
+  // CPU time used by the agent's threads to handle requests.
+  std::chrono::nanoseconds cpuTime() const { return std::chrono::nanoseconds{cpu_time_ns_}; }
+
+  // Decompresses a gzip request body. Returns false if it isn't valid gzip.
+  static bool gunzip(const std::string &compressed, std::string &body) {
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+      return false;
+    }
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
+    stream.avail_in = uInt(compressed.size());
+    body.clear();
+    char chunk[65536];
+    int result;
+    do {
+      stream.next_out = reinterpret_cast<Bytef *>(chunk);
+      stream.avail_out = sizeof(chunk);
+      result = inflate(&stream, Z_NO_FLUSH);
+      body.append(chunk, sizeof(chunk) - stream.avail_out);
+    } while (result == Z_OK);
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+  }
+
+ private:
+  void acceptConnections() {
+    while (true) {
+      pollfd listener{listen_fd_, POLLIN, 0};
+      int ready = poll(&listener, 1, 50);
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (stopped_) {
+        return;
+      }
+      if (ready <= 0) {
+        continue;
+      }
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      connection_fds_.push_back(fd);
+      num_connections_++;
+      connections_.emplace_back([this, fd]() { serveConnection(fd); });
+    }
+  }
+
+  // Handles requests on the connection until the client closes it, or the agent hangs up.
+  void serveConnection(int fd) {
+    std::string buffer;
+    StubAgentRequest request;
+    auto cpu_time = threadCpuTime();
+    while (readRequest(fd, buffer, request)) {
+      StubAgentBehaviour behaviour;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        behaviour = behaviour_;
+      }
+      if (behaviour.latency.count() > 0) {
+        std::this_thread::sleep_for(behaviour.latency);
+      }
+      if (behaviour.hang_up) {
+        break;
+      }
+      int status = request.path == behaviour.missing_path ? 404 : behaviour.status;
+      if (status / 100 == 2) {
+        countTraces(request);  // Only count traces that the agent accepted.
+      }
+      std::string body = status == 200 ? "OK" : "error";
+      std::string response = "HTTP/1.1 " + std::to_string(status) +
+                              " Stub\r\nContent-Type: text/plain\r\nContent-Length: " +
+                              std::to_string(body.size()) + "\r\n\r\n" + body;
+      // Recorded before responding, so that it's seen by a client that's had the response.
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        requests_++;
+        last_request_ = std::move(request);
+      }
+      sendAll(fd, response);
+      auto now = threadCpuTime();
+      cpu_time_ns_ += now - cpu_time;
+      cpu_time = now;
+      received_.notify_all();
+      request = StubAgentRequest{};
+    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    connection_fds_.erase(std::remove(connection_fds_.begin(), connection_fds_.end(), fd),
+                          connection_fds_.end());
+    close(fd);
+  }
+
+  // Reads a single request from the connection. Any bytes read past the end of the request are
+  // left in buffer. Returns false if the connection is closed first.
+  bool readRequest(int fd, std::string &buffer, StubAgentRequest &request) {
+    size_t header_end;
+    while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      if (!readMore(fd, buffer)) {
+        return false;
+      }
+    }
+    // Request line.
+    size_t line_end = buffer.find("\r\n");
+    std::string request_line = buffer.substr(0, line_end);
+    size_t method_end = request_line.find(' ');
+    size_t path_end = request_line.find(' ', method_end + 1);
+    request.method = request_line.substr(0, method_end);
+    request.path = request_line.substr(method_end + 1, path_end - method_end - 1);
+    // Headers.
+    size_t position = line_end + 2;
+    while (position < header_end) {
+      line_end = buffer.find("\r\n", position);
+      std::string line = buffer.substr(position, line_end - position);
+      position = line_end + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      size_t value_start = line.find_first_not_of(' ', colon + 1);
+      request.headers[name] = value_start == std::string::npos ? "" : line.substr(value_start);
+    }
+    bytes_ += header_end + 4;
+    buffer.erase(0, header_end + 4);
+    auto expect = request.headers.find("expect");
+    if (expect != request.headers.end() && expect->second == "100-continue") {
+      sendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    // Body.
+    size_t content_length = std::stoul(
+        request.headers.count("content-length") ? request.headers["content-length"] : "0");
+    while (buffer.size() < content_length) {
+      if (!readMore(fd, buffer)) {
+        return false;
+      }
+    }
+    request.body = buffer.substr(0, content_length);
+    buffer.erase(0, content_length);
+    bytes_ += content_length;
+    return true;
+  }
+
+  static bool readMore(int fd, std::string &buffer) {
+    char chunk[65536];
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, n);
+    return true;
+  }
+
+  static void sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return;
+      }
+      sent += n;
+    }
+  }
+
+  // Decodes a payload (an array of traces, each an array of spans, which for /v0.5 is preceded
+  // by a string table) and counts its contents.
+  void countTraces(const StubAgentRequest &request) {
+    try {
+      std::string body = request.body;
+      auto encoding = request.headers.find("content-encoding");
+      if (encoding != request.headers.end() && encoding->second == "gzip" &&
+          !gunzip(request.body, body)) {
+        decode_errors_++;
+        return;
+      }
+      msgpack::object_handle handle = msgpack::unpack(body.data(), body.size());
+      const msgpack::object *payload = &handle.get();
+      if (request.path == "/v0.5/traces" && payload->type == msgpack::type::ARRAY &&
+          payload->via.array.size == 2) {
+        payload = &payload->via.array.ptr[1];
+      }
+      const msgpack::object &traces = *payload;
+      if (traces.type != msgpack::type::ARRAY) {
+        decode_errors_++;
+        return;
+      }
+      uint64_t num_spans = 0;
+      for (uint32_t i = 0; i < traces.via.array.size; i++) {
+        if (traces.via.array.ptr[i].type == msgpack::type::ARRAY) {
+          num_spans += traces.via.array.ptr[i].via.array.size;
+        }
+      }
+      std::lock_guard<std::mutex> lock{mutex_};
+      traces_ += traces.via.array.size;
+      spans_ += num_spans;
+    } catch (const std::exception &) {
+      decode_errors_++;
+    }
+  }
+
+  static int64_t threadCpuTime() {
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return int64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+  }
+
+  int listen_fd_ = -1;
+  uint32_t port_ = 0;
+  const std::string socket_path_;
+  std::thread acceptor_;
+  // Only modified by the acceptor thread, joined after it stops.
+  std::vector<std::thread> connections_;
+
+  // Locks everything below, except the atomic counters.
+  mutable std::mutex mutex_;
+  std::condition_variable received_;
+  bool stopped_ = false;
+  std::vector<int> connection_fds_;
+  StubAgentBehaviour behaviour_;
+  StubAgentRequest last_request_;
+  uint64_t traces_ = 0;
+  uint64_t spans_ = 0;
+
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> num_connections_{0};
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<uint64_t> decode_errors_{0};
+  std::atomic<int64_t> cpu_time_ns_{0};
+};
+
+}  // namespace opentracing
+}  // namespace datadog
+
+#endif  // DD_OPENTRACING_TEST_STUB_AGENT_H
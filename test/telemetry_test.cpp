@@ -0,0 +1,35 @@
+#include "../src/telemetry.h"
+
+#include <thread>
+#include <vector>
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+using namespace datadog::opentracing;
+
+TEST_CASE("telemetry counter") {
+  TelemetryCounter counter;
+
+  SECTION("starts at 0") { REQUIRE(counter.value() == 0); }
+
+  SECTION("adds up") {
+    counter.add();
+    counter.add(41);
+    REQUIRE(counter.value() == 42);
+  }
+
+  SECTION("adds up what every thread adds") {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 32; i++) {
+      threads.emplace_back([&]() {
+        for (int j = 0; j < 1000; j++) {
+          counter.add();
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    REQUIRE(counter.value() == 32000);
+  }
+}
@@ -51,6 +51,13 @@ struct MockTracer : public ot::Tracer {
   void Close() noexcept override {}
 };
 
+// Can't be set up, eg. since the spill directory can't be created.
+struct UnusableTracer : public MockTracer {
+  UnusableTracer(TracerOptions opts_) : MockTracer(opts_) {
+    throw std::runtime_error("Unable to create spill directory /no/such/directory");
+  }
+};
+
 TEST_CASE("tracer") {
   TracerFactory<MockTracer> factory;
 
@@ -60,7 +67,27 @@ TEST_CASE("tracer") {
         "service": "my-service",
         "agent_host": "www.omfgdogs.com",
         "agent_port": 80,
-        "type": "db"
+        "type": "db",
+        "span_buffer_shards": 64,
+        "partial_flush_min_spans": 500,
+        "partial_flush_max_age_ms": 5000,
+        "pending_trace_ttl_ms": 600000,
+        "flush_expired_traces": false,
+        "agent_api_version": "v0.5",
+        "payload_compression_level": 6,
+        "payload_compression_min_bytes": 4096,
+        "agent_socket_path": "/var/run/datadog/apm.socket",
+        "agent_max_concurrent_requests": 4,
+        "payload_max_bytes": 1000000,
+        "spill_directory": "/var/spool/datadog",
+        "spill_max_bytes": 1000000,
+        "memory_budget_bytes": 50000000,
+        "memory_budget_cgroup_fraction": 0.05,
+        "agent_circuit_breaker_failures": 5,
+        "load_shedding": true,
+        "write_threshold_spans": 1000,
+        "write_threshold_bytes": 4000000,
+        "queue_drop_policy": "priority"
       }
     )"};
     std::string error = "";
@@ -72,6 +99,26 @@ TEST_CASE("tracer") {
     REQUIRE(tracer->opts.agent_port == 80);
     REQUIRE(tracer->opts.service == "my-service");
     REQUIRE(tracer->opts.type == "db");
+    REQUIRE(tracer->opts.span_buffer_shards == 64);
+    REQUIRE(tracer->opts.partial_flush_min_spans == 500);
+    REQUIRE(tracer->opts.partial_flush_max_age_ms == 5000);
+    REQUIRE(tracer->opts.pending_trace_ttl_ms == 600000);
+    REQUIRE(tracer->opts.flush_expired_traces == false);
+    REQUIRE(tracer->opts.agent_api_version == "v0.5");
+    REQUIRE(tracer->opts.payload_compression_level == 6);
+    REQUIRE(tracer->opts.payload_compression_min_bytes == 4096);
+    REQUIRE(tracer->opts.agent_socket_path == "/var/run/datadog/apm.socket");
+    REQUIRE(tracer->opts.agent_max_concurrent_requests == 4);
+    REQUIRE(tracer->opts.payload_max_bytes == 1000000);
+    REQUIRE(tracer->opts.spill_directory == "/var/spool/datadog");
+    REQUIRE(tracer->opts.spill_max_bytes == 1000000);
+    REQUIRE(tracer->opts.memory_budget_bytes == 50000000);
+    REQUIRE(tracer->opts.memory_budget_cgroup_fraction == 0.05);
+    REQUIRE(tracer->opts.agent_circuit_breaker_failures == 5);
+    REQUIRE(tracer->opts.load_shedding == true);
+    REQUIRE(tracer->opts.write_threshold_spans == 1000);
+    REQUIRE(tracer->opts.write_threshold_bytes == 4000000);
+    REQUIRE(tracer->opts.queue_drop_policy == "priority");
   }
 
   SECTION("can be created without optional fields") {
@@ -89,6 +136,26 @@ TEST_CASE("tracer") {
     REQUIRE(tracer->opts.agent_port == 8126);
     REQUIRE(tracer->opts.service == "my-service");
     REQUIRE(tracer->opts.type == "web");
+    REQUIRE(tracer->opts.span_buffer_shards == 0);
+    REQUIRE(tracer->opts.partial_flush_min_spans == 0);
+    REQUIRE(tracer->opts.partial_flush_max_age_ms == 0);
+    REQUIRE(tracer->opts.pending_trace_ttl_ms == 0);
+    REQUIRE(tracer->opts.flush_expired_traces == true);
+    REQUIRE(tracer->opts.agent_api_version == "v0.3");
+    REQUIRE(tracer->opts.payload_compression_level == 0);
+    REQUIRE(tracer->opts.payload_compression_min_bytes == 1024);
+    REQUIRE(tracer->opts.agent_socket_path == "");
+    REQUIRE(tracer->opts.agent_max_concurrent_requests == 1);
+    REQUIRE(tracer->opts.payload_max_bytes == 0);
+    REQUIRE(tracer->opts.spill_directory == "");
+    REQUIRE(tracer->opts.spill_max_bytes == 64 * 1024 * 1024);
+    REQUIRE(tracer->opts.memory_budget_bytes == 0);
+    REQUIRE(tracer->opts.memory_budget_cgroup_fraction == 0);
+    REQUIRE(tracer->opts.agent_circuit_breaker_failures == 0);
+    REQUIRE(tracer->opts.load_shedding == false);
+    REQUIRE(tracer->opts.write_threshold_spans == 0);
+    REQUIRE(tracer->opts.write_threshold_bytes == 0);
+    REQUIRE(tracer->opts.queue_drop_policy == "drop_newest");
   }
 
   SECTION("ignores extra fields") {
@@ -122,6 +189,59 @@ TEST_CASE("tracer") {
     REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
   }
 
+  SECTION("rejects unknown agent API versions") {
+    std::string input{R"(
+      {
+        "service": "my-service",
+        "agent_api_version": "v0.4"
+      }
+    )"};
+    std::string error = "";
+    auto result = factory.MakeTracer(input.c_str(), error);
+    REQUIRE(error == "configuration argument 'agent_api_version' must be \"v0.3\" or \"v0.5\"");
+    REQUIRE(!result);
+    REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
+  }
+
+  SECTION("rejects unknown queue drop policies") {
+    std::string input{R"(
+      {
+        "service": "my-service",
+        "queue_drop_policy": "drop_random"
+      }
+    )"};
+    std::string error = "";
+    auto result = factory.MakeTracer(input.c_str(), error);
+    REQUIRE(error ==
+            "configuration argument 'queue_drop_policy' must be \"drop_newest\", \"drop_oldest\" "
+            "or \"priority\"");
+    REQUIRE(!result);
+    REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
+  }
+
+  SECTION("reports tracers that can't be set up, rather than throwing") {
+    TracerFactory<UnusableTracer> unusable_factory;
+    std::string error = "";
+    auto result = unusable_factory.MakeTracer(R"({"service": "my-service"})", error);
+    REQUIRE(error == "Unable to create spill directory /no/such/directory");
+    REQUIRE(!result);
+    REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
+  }
+
+  SECTION("rejects invalid compression levels") {
+    std::string input{R"(
+      {
+        "service": "my-service",
+        "payload_compression_level": 10
+      }
+    )"};
+    std::string error = "";
+    auto result = factory.MakeTracer(input.c_str(), error);
+    REQUIRE(error == "configuration argument 'payload_compression_level' must be from 0 to 9");
+    REQUIRE(!result);
+    REQUIRE(result.error() == std::make_error_code(std::errc::invalid_argument));
+  }
+
   SECTION("handles invalid JSON") {
     std::string input{R"(
       When I wake up I like a pan of bacon;
@@ -27,7 +27,7 @@ TEST_CASE("tracer") {
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->type == "web");
     REQUIRE(result->service == "service_name");
     REQUIRE(result->name == "/what_up");
@@ -39,9 +39,58 @@ TEST_CASE("tracer") {
     const ot::FinishSpanOptions finish_options;
     span->FinishWithOptions(finish_options);
 
-    auto& result = buffer->traces[100].finished_spans->at(0);
+    auto& result = buffer->traces[100]->finished_spans->at(0);
     REQUIRE(result->span_id == 100);
     REQUIRE(result->trace_id == 100);
     REQUIRE(result->parent_id == 0);
   }
+
+  SECTION("child spans belong to the same trace as their local parent") {
+    auto parent = tracer->StartSpanWithOptions("parent", span_options);
+    auto child = tracer->StartSpan("child", {ot::ChildOf(&parent->context())});
+    auto parent_trace = dynamic_cast<const SpanContext&>(parent->context()).pendingTrace();
+    REQUIRE(parent_trace != nullptr);
+    REQUIRE(dynamic_cast<const SpanContext&>(child->context()).pendingTrace() == parent_trace);
+    REQUIRE(parent_trace->open_spans == 2);
+    child->Finish();
+    parent->Finish();
+    REQUIRE(parent_trace->open_spans == 0);
+    REQUIRE(parent_trace->finished_spans->size() == 2);
+  }
+
+  SECTION("load shedding") {
+    LoadSheddingOptions shedding_options;
+    shedding_options.min_keep_rate = 0.5;
+    auto shedder = std::make_shared<LoadShedder>(shedding_options);
+    auto shedding_buffer = new MockBuffer();
+    std::shared_ptr<Tracer> shedding_tracer{
+        new Tracer{tracer_options, std::shared_ptr<SpanBuffer>{shedding_buffer}, get_time, get_id,
+                   sampler, shedder}};
+    shedder->update(1.0, 0, 0);  // Keep half of new traces.
+    size_t kept = 0;
+    for (int i = 0; i < 100; i++) {
+      auto root = shedding_tracer->StartSpanWithOptions("root", span_options);
+      auto child = shedding_tracer->StartSpan("child", {ot::ChildOf(&root->context())});
+      bool root_kept = dynamic_cast<Span*>(root.get()) != nullptr;
+      // The whole trace is kept, or none of it.
+      REQUIRE((dynamic_cast<Span*>(child.get()) != nullptr) == root_kept);
+      kept += root_kept ? 1 : 0;
+    }
+    REQUIRE(kept > 20);
+    REQUIRE(kept < 80);
+  }
+
+  SECTION("counts spans started and sampled out") {
+    auto discarding_tracer = std::shared_ptr<Tracer>{
+        new Tracer{tracer_options, std::shared_ptr<SpanBuffer>{new MockBuffer()}, get_time, get_id,
+                   DiscardAllSampler()}};
+    auto kept = tracer->StartSpanWithOptions("kept", span_options);
+    auto discarded = discarding_tracer->StartSpanWithOptions("discarded", span_options);
+    auto telemetry = tracer->snapshot();
+    REQUIRE(telemetry.spans_started == 1);
+    REQUIRE(telemetry.spans_sampled_out == 0);
+    telemetry = discarding_tracer->snapshot();
+    REQUIRE(telemetry.spans_started == 1);
+    REQUIRE(telemetry.spans_sampled_out == 1);
+  }
 }
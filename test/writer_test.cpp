@@ -1,6 +1,7 @@
 #include "../src/writer.h"
 #include "../src/writer.cpp"  // Otherwise the compiler won't generate AgentWriter for us.
 #include "mocks.h"
+#include "stub_agent.h"
 
 #include <ctime>
 
@@ -68,7 +69,12 @@ TEST_CASE("writer") {
     REQUIRE(handle->options == std::unordered_map<CURLoption, std::string, EnumClassHash>{
                                    {CURLOPT_URL, "http://hostname:6319/v0.3/traces"},
                                    {CURLOPT_TIMEOUT_MS, "2000"},
-                                   {CURLOPT_POSTFIELDSIZE, "126"}});
+                                   {CURLOPT_POSTFIELDSIZE, "168"}});
+    TracerTelemetry telemetry;
+    writer.addTelemetry(telemetry);
+    REQUIRE(telemetry.bytes_encoded == 168);
+    REQUIRE(telemetry.posts_succeeded == 1);
+    REQUIRE(telemetry.queued_traces == 0);
     REQUIRE(handle->headers ==
             std::map<std::string, std::string>{{"Content-Type", "application/msgpack"},
                                                {"Datadog-Meta-Lang", "cpp"},
@@ -76,6 +82,32 @@ TEST_CASE("writer") {
                                                {"X-Datadog-Trace-Count", "1"}});
   }
 
+  SECTION("flush returns when there are no traces to send") {
+    writer.flush();  // Doesn't block forever. That's the test!
+    REQUIRE(handle->perform_call_count == 0);
+  }
+
+  SECTION("runs the periodic task on the worker thread") {
+    std::atomic<int> calls{0};
+    writer.setPeriodicTask([&]() {
+      if (calls++ == 0) {
+        // Traces written by the task are sent.
+        writer.write(make_trace(
+            {TestSpanData{"service.name", "service", "resource", "web", 1, 1, 0, 0, 69, 420}}));
+      }
+    });
+    // The worker wakes up once for each flush, and runs the task before it waits again.
+    writer.flush();
+    writer.flush();
+    REQUIRE(calls > 0);
+    REQUIRE(handle->getTraces()->size() == 1);
+    writer.setPeriodicTask(nullptr);
+    int calls_before = calls;
+    writer.flush();
+    writer.flush();
+    REQUIRE(calls == calls_before);
+  }
+
   SECTION("queue does not grow indefinitely") {
     for (uint64_t i = 0; i < 30; i++) {  // Only 25 actually get written.
       writer.write(make_trace(
@@ -240,6 +272,11 @@ TEST_CASE("writer") {
       handle->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK};
       writer.flush();
       REQUIRE(handle->perform_call_count == 2);
+      TracerTelemetry telemetry;
+      writer.addTelemetry(telemetry);
+      REQUIRE(telemetry.posts_failed == 1);
+      REQUIRE(telemetry.posts_succeeded == 1);
+      REQUIRE(telemetry.post_retries == 1);
     }
 
     SECTION("will eventually give up") {
@@ -248,9 +285,1015 @@ TEST_CASE("writer") {
       REQUIRE(handle->perform_call_count == 3);  // Once originally, and two retries.
     }
 
+    SECTION("will retry when the agent responds that it failed") {
+      handle->perform_result = std::vector<CURLcode>{CURLE_OK};
+      handle->response_code = 503;
+      writer.flush();
+      REQUIRE(handle->perform_call_count == 3);
+      TracerTelemetry telemetry;
+      writer.addTelemetry(telemetry);
+      REQUIRE(telemetry.posts_failed == 3);
+      REQUIRE(telemetry.posts_succeeded == 0);
+    }
+
     std::cerr.rdbuf(stderr);  // Restore stderr.
   }
 
+  SECTION("gives up on payloads that would be too old for the agent") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(10),
+                                                         std::chrono::seconds(10)};
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       retry_periods,
+                       "hostname",
+                       6319};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    handle->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "service.name", "resource", 1, 1, 0, 69, 420, 0}}));
+    writer.flush();
+    REQUIRE(handle->perform_call_count == 2);  // The second retry would be too late.
+    std::cerr.rdbuf(stderr);
+  }
+
+  SECTION("doesn't wait for retries") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(1000)};
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       std::chrono::milliseconds(50),
+                       max_queued_traces,
+                       retry_periods,
+                       "hostname",
+                       6319};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    // Waits for the handle to be given a request, and returns its traces.
+    auto waitForTraces = [&]() {
+      auto traces = handle->getTraces();
+      for (int i = 0; i < 500 && traces->empty(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        traces = handle->getTraces();
+      }
+      return traces;
+    };
+    handle->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK, CURLE_OK};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+    REQUIRE(waitForTraces()->size() == 1);
+    // The first payload failed, and is waiting to be retried, the next one goes out anyway.
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+    auto traces = waitForTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 2);
+    // Flushing waits for the retry.
+    writer.flush();
+    traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 1);
+    std::cerr.rdbuf(stderr);
+  }
+
+  SECTION("circuit breaker") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    AgentWriterOptions options;
+    options.circuit_breaker.failure_threshold = 2;
+    options.circuit_breaker.min_probe_interval = std::chrono::milliseconds(0);
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    // Two traces fail, then a probe, then a probe succeeds.
+    handle->perform_result =
+        std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OPERATION_TIMEDOUT,
+                              CURLE_OPERATION_TIMEDOUT, CURLE_OK, CURLE_OK};
+    for (uint64_t i = 1; i <= 2; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+      writer.flush();
+    }
+    REQUIRE(writer.circuitBreakerStats().state == CircuitBreakerState::open);
+    // Dropped without being sent.
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 3, 1, 0, 69, 420, 0}}));
+    REQUIRE(writer.circuitBreakerStats().dropped_traces == 1);
+    REQUIRE(handle->perform_call_count == 2);
+    TracerTelemetry telemetry;
+    writer.addTelemetry(telemetry);
+    REQUIRE(telemetry.agent_circuit_breaker_open);
+    REQUIRE(telemetry.agent_circuit_breaker_times_opened == 1);
+    REQUIRE(telemetry.traces_dropped_agent_down == 1);
+    // Probes are empty.
+    writer.flush();
+    REQUIRE(handle->perform_call_count == 3);
+    REQUIRE(handle->headers["X-Datadog-Trace-Count"] == "0");
+    REQUIRE(writer.circuitBreakerStats().state == CircuitBreakerState::open);
+    writer.flush();
+    REQUIRE(handle->perform_call_count == 4);
+    REQUIRE(writer.circuitBreakerStats().state == CircuitBreakerState::closed);
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 4, 1, 0, 69, 420, 0}}));
+    writer.flush();
+    auto traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 4);
+    REQUIRE(writer.circuitBreakerStats().times_opened == 1);
+    telemetry = TracerTelemetry{};
+    writer.addTelemetry(telemetry);
+    REQUIRE(!telemetry.agent_circuit_breaker_open);
+    std::cerr.rdbuf(stderr);
+  }
+
+  SECTION("doesn't count the prewarmed connection as a post") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    // The prewarm fails, the trace is sent.
+    handle->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK};
+    AgentWriterOptions options;
+    options.prewarm_connection = true;
+    options.circuit_breaker.failure_threshold = 1;
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+    writer.write(make_trace(
+        {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+    writer.flush();
+    REQUIRE(handle->perform_call_count == 2);
+    REQUIRE(writer.circuitBreakerStats().times_opened == 0);
+    auto traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 1);
+    TracerTelemetry telemetry;
+    writer.addTelemetry(telemetry);
+    REQUIRE(telemetry.posts_failed == 0);
+    REQUIRE(telemetry.posts_succeeded == 1);
+    std::cerr.rdbuf(stderr);
+  }
+
+  SECTION("reports its load to the load shedder") {
+    AgentWriterOptions options;
+    options.load_shedder = std::make_shared<LoadShedder>();
+    AgentWriter writer{std::unique_ptr<Handle>{new MockHandle{}},
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+    writer.flush();
+    REQUIRE(options.load_shedder->keepRate() == 1.0);
+    // The queue fills up, and traces are dropped.
+    for (uint64_t i = 1; i <= max_queued_traces + 5; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush();
+    REQUIRE(options.load_shedder->keepRate() == 0.5);
+  }
+
+  SECTION("v0.5 API") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    AgentWriterOptions options;
+    options.api_version = AgentApiVersion::v0_5;
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+    REQUIRE(handle->options[CURLOPT_URL] == "http://hostname:6319/v0.5/traces");
+
+    SECTION("sends string table payloads") {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      std::string body = handle->options[CURLOPT_POSTFIELDS];
+      auto traces = decodeStringTableTraces(body.data(), body.size());
+      REQUIRE(traces.size() == 1);
+      REQUIRE(traces[0].size() == 1);
+      REQUIRE(traces[0][0].name == "service.name");
+      REQUIRE(traces[0][0].service == "service");
+      REQUIRE(traces[0][0].resource == "resource");
+      REQUIRE(traces[0][0].type == "web");
+      REQUIRE(handle->perform_call_count == 1);
+    }
+
+    SECTION("falls back to v0.3 if the agent doesn't support v0.5") {
+      std::stringstream error_message;
+      std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+      handle->response_code = 404;
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      // Sent again straight away, to v0.3.
+      REQUIRE(handle->perform_call_count == 2);
+      REQUIRE(handle->options[CURLOPT_URL] == "http://hostname:6319/v0.3/traces");
+      auto traces = handle->getTraces();
+      REQUIRE(traces->size() == 1);
+      REQUIRE((*traces)[0][0].name == "service.name");
+      // And stays there.
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      REQUIRE(handle->perform_call_count == 3);
+      REQUIRE(handle->options[CURLOPT_URL] == "http://hostname:6319/v0.3/traces");
+      REQUIRE(handle->getTraces()->size() == 1);
+      std::cerr.rdbuf(stderr);
+    }
+  }
+
+  SECTION("compression") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    AgentWriterOptions options;
+    options.compression.level = 1;
+    options.compression.min_size = 500;
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+
+    SECTION("gzips payloads") {
+      for (uint64_t i = 1; i <= 10; i++) {
+        writer.write(make_trace(
+            {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+      }
+      writer.flush();
+      REQUIRE(handle->headers["Content-Encoding"] == "gzip");
+      std::string body;
+      REQUIRE(StubAgent::gunzip(handle->options[CURLOPT_POSTFIELDS], body));
+      std::vector<std::vector<TestSpanData>> traces;
+      msgpack::unpack(body.data(), body.size()).get().convert(traces);
+      REQUIRE(traces.size() == 10);
+      auto stats = writer.compressionStats();
+      REQUIRE(stats.compressed_payloads == 1);
+      REQUIRE(stats.input_bytes == body.size());
+      REQUIRE(stats.output_bytes == handle->options[CURLOPT_POSTFIELDS].size());
+      TracerTelemetry telemetry;
+      writer.addTelemetry(telemetry);
+      REQUIRE(telemetry.payloads_compressed == 1);
+      REQUIRE(telemetry.compression_input_bytes == stats.input_bytes);
+      REQUIRE(telemetry.compression_output_bytes == stats.output_bytes);
+      REQUIRE(telemetry.compression_time_ns == uint64_t(stats.cpu_time.count()));
+    }
+
+    SECTION("doesn't gzip small payloads") {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      REQUIRE(handle->headers["Content-Encoding"] == "");
+      REQUIRE(handle->getTraces()->size() == 1);
+      REQUIRE(writer.compressionStats().skipped_payloads == 1);
+      TracerTelemetry telemetry;
+      writer.addTelemetry(telemetry);
+      REQUIRE(telemetry.payloads_compression_skipped == 1);
+    }
+  }
+
+  SECTION("compressed payloads round-trip through an agent") {
+    StubAgent agent;
+    AgentWriterOptions options;
+    options.compression.level = 6;
+    options.compression.min_size = 0;
+    AgentWriter writer{std::unique_ptr<Handle>{new CurlHandle{}},
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "127.0.0.1",
+                       agent.port(),
+                       options};
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0},
+           TestSpanData{"web", "service", "resource", "service.name", i, 2, 1, 69, 420, 0}}));
+    }
+    writer.flush();
+    REQUIRE(agent.waitForTraces(3, std::chrono::seconds(5)));
+    REQUIRE(agent.spans() == 6);
+    REQUIRE(agent.decodeErrors() == 0);
+    REQUIRE(agent.lastRequest().headers["content-encoding"] == "gzip");
+  }
+
+  SECTION("payloads of a maximum size") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    AgentWriterOptions options;
+    options.max_payload_size = 1;  // Every trace is too big, so each has its own payload.
+    std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(10)};
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       retry_periods,
+                       "hostname",
+                       6319,
+                       options};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    // The second payload fails once.
+    handle->perform_result =
+        std::vector<CURLcode>{CURLE_OK, CURLE_OPERATION_TIMEDOUT, CURLE_OK, CURLE_OK, CURLE_OK};
+    for (uint64_t i = 1; i <= 3; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush();
+    std::cerr.rdbuf(stderr);
+    // Only the payload that failed was sent again, after the one that came after it.
+    REQUIRE(handle->perform_call_count == 4);
+    REQUIRE(handle->headers["X-Datadog-Trace-Count"] == "1");
+    auto traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 2);
+  }
+
+  SECTION("retried payloads that are split by falling back to v0.3 are sent whole") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    AgentWriterOptions options;
+    options.api_version = AgentApiVersion::v0_5;
+    // Two traces fit in a v0.5 payload, but only one in a v0.3 payload.
+    options.max_payload_size = 250;
+    std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(10)};
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       retry_periods,
+                       "hostname",
+                       6319,
+                       options};
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+    // The payload fails, then the retry finds that the agent doesn't support v0.5.
+    handle->response_code = 404;
+    handle->perform_result =
+        std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK, CURLE_OK, CURLE_OK, CURLE_OK};
+    for (uint64_t i = 1; i <= 2; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+    }
+    writer.flush();
+    std::cerr.rdbuf(stderr);
+    // Once to v0.5, again to v0.5, then each trace to v0.3.
+    REQUIRE(handle->perform_call_count == 4);
+    REQUIRE(handle->options[CURLOPT_URL] == "http://hostname:6319/v0.3/traces");
+    auto traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 2);
+  }
+
+  SECTION("payloads of a maximum size round-trip through an agent") {
+    StubAgent agent;
+    AgentWriterOptions options;
+    options.max_payload_size = 1024;
+    options.api_version = AgentApiVersion::v0_5;
+    std::vector<std::unique_ptr<Handle>> handles;
+    handles.emplace_back(new CurlHandle{});
+    handles.emplace_back(new CurlHandle{});
+    AgentWriter writer{std::unique_ptr<MultiHandle>{new CurlMultiHandle{}},
+                       std::move(handles),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "127.0.0.1",
+                       agent.port(),
+                       options};
+    for (uint64_t i = 1; i <= 20; i++) {
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0},
+           TestSpanData{"web", "service", "resource", "service.name", i, 2, 1, 69, 420, 0}}));
+    }
+    writer.flush();
+    REQUIRE(agent.waitForTraces(20, std::chrono::seconds(5)));
+    REQUIRE(agent.spans() == 40);
+    REQUIRE(agent.decodeErrors() == 0);
+    REQUIRE(agent.requests() > 1);
+  }
+
+  SECTION("spilled payloads") {
+    char directory_template[] = "/tmp/dd-opentracing-writer-test-XXXXXX";
+    AgentWriterOptions options;
+    options.spill.directory = mkdtemp(directory_template);
+    std::stringstream error_message;
+    std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+
+    SECTION("are sent once the agent is back") {
+      std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+      MockHandle* handle = handle_ptr.get();
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      handle->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK, CURLE_OK};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      REQUIRE(writer.spillStats().spilled_payloads == 1);
+      REQUIRE(writer.spillStats().queued_payloads == 1);
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      // The spilled payload went first.
+      REQUIRE(handle->perform_call_count == 3);
+      auto traces = handle->getTraces();
+      REQUIRE(traces->size() == 1);
+      REQUIRE((*traces)[0][0].trace_id == 2);
+      REQUIRE(writer.spillStats().replayed_payloads == 1);
+      REQUIRE(writer.spillStats().queued_payloads == 0);
+    }
+
+    SECTION("are kept for the next writer") {
+      StubAgent agent;
+      StubAgentBehaviour behaviour;
+      behaviour.hang_up = true;
+      agent.setBehaviour(behaviour);
+      options.api_version = AgentApiVersion::v0_5;
+      options.compression.level = 6;
+      options.compression.min_size = 0;
+      auto makeWriter = [&]() {
+        std::vector<std::unique_ptr<Handle>> handles;
+        handles.emplace_back(new CurlHandle{});
+        handles.emplace_back(new CurlHandle{});
+        return std::unique_ptr<AgentWriter>{
+            new AgentWriter{std::unique_ptr<MultiHandle>{new CurlMultiHandle{}},
+                            std::move(handles), "v0.1.0", only_send_traces_when_we_flush,
+                            max_queued_traces, disable_retry, "127.0.0.1", agent.port(), options}};
+      };
+      auto writer = makeWriter();
+      for (uint64_t i = 1; i <= 3; i++) {
+        writer->write(make_trace(
+            {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+        writer->flush();
+      }
+      REQUIRE(writer->spillStats().queued_payloads == 3);
+      writer->stop();
+      writer.reset();
+      agent.setBehaviour(StubAgentBehaviour{});
+      // The next writer sends what's on disk (with a different API version) once it's woken up.
+      options.api_version = AgentApiVersion::v0_3;
+      options.compression.level = 0;
+      writer = makeWriter();
+      writer->flush();
+      REQUIRE(agent.waitForTraces(3, std::chrono::seconds(5)));
+      REQUIRE(agent.decodeErrors() == 0);
+      for (int i = 0; i < 500 && writer->spillStats().replayed_payloads < 3; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      REQUIRE(writer->spillStats().replayed_payloads == 3);
+    }
+
+    SECTION("are dropped if the agent that's back rejects them") {
+      StubAgent agent;
+      StubAgentBehaviour behaviour;
+      behaviour.hang_up = true;
+      agent.setBehaviour(behaviour);
+      options.api_version = AgentApiVersion::v0_5;
+      auto makeWriter = [&]() {
+        return std::unique_ptr<AgentWriter>{new AgentWriter{
+            std::unique_ptr<Handle>{new CurlHandle{}}, "v0.1.0", only_send_traces_when_we_flush,
+            max_queued_traces, disable_retry, "127.0.0.1", agent.port(), options}};
+      };
+      auto writer = makeWriter();
+      for (uint64_t i = 1; i <= 2; i++) {
+        writer->write(make_trace(
+            {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+        writer->flush();
+      }
+      REQUIRE(writer->spillStats().queued_payloads == 2);
+      writer.reset();
+      // The agent that's back is older, and doesn't support v0.5.
+      behaviour = StubAgentBehaviour{};
+      behaviour.missing_path = "/v0.5/traces";
+      agent.setBehaviour(behaviour);
+      writer = makeWriter();
+      writer->write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 3, 1, 0, 69, 420, 0}}));
+      writer->flush();
+      auto stats = writer->spillStats();
+      REQUIRE(stats.rejected_payloads == 2);
+      REQUIRE(stats.replayed_payloads == 0);
+      REQUIRE(stats.queued_payloads == 0);
+      // Later traces go to v0.3.
+      REQUIRE(agent.waitForTraces(1, std::chrono::seconds(5)));
+      REQUIRE(agent.lastRequest().path == "/v0.3/traces");
+    }
+
+    SECTION("are kept when a writer with concurrent requests stops") {
+      std::unique_ptr<MockHandle> first_ptr{new MockHandle{}};
+      MockHandle* first = first_ptr.get();
+      std::vector<std::unique_ptr<Handle>> handles;
+      handles.push_back(std::move(first_ptr));
+      handles.emplace_back(new MockHandle{});
+      std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(10000)};
+      AgentWriter writer{std::unique_ptr<MultiHandle>{new MockMultiHandle{}},
+                         std::move(handles),
+                         "v0.1.0",
+                         std::chrono::milliseconds(50),
+                         max_queued_traces,
+                         retry_periods,
+                         "hostname",
+                         6319,
+                         options};
+      first->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      auto traces = first->getTraces();
+      for (int i = 0; i < 500 && traces->empty(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        traces = first->getTraces();
+      }
+      REQUIRE(traces->size() == 1);
+      // The payload failed, and is waiting to be retried (or still in flight) when it stops.
+      writer.stop();
+      REQUIRE(writer.spillStats().spilled_payloads == 1);
+      REQUIRE(writer.spillStats().queued_payloads == 1);
+    }
+
+    std::cerr.rdbuf(stderr);
+    for (auto& file : std::vector<std::string>{"segment-00000000000000000000.spill", ".lock"}) {
+      unlink((options.spill.directory + "/" + file).c_str());
+    }
+    rmdir(options.spill.directory.c_str());
+  }
+
+  SECTION("memory budget") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    auto makeTrace = [](uint64_t id) {
+      return make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", id, 1, 0, 69, 420, 0}});
+    };
+    AgentWriterOptions options;
+    options.memory_budget = std::make_shared<MemoryBudget>(estimatedSize(makeTrace(1)) * 3 / 2);
+    AgentWriter writer{std::move(handle_ptr),
+                       "v0.1.0",
+                       only_send_traces_when_we_flush,
+                       max_queued_traces,
+                       disable_retry,
+                       "hostname",
+                       6319,
+                       options};
+    writer.write(makeTrace(1));
+    writer.write(makeTrace(2));  // Dropped.
+    REQUIRE(options.memory_budget->rejections() == 1);
+    writer.flush();
+    REQUIRE(options.memory_budget->usedBytes() == 0);
+    auto traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 1);
+    // There's room again once it's sent.
+    writer.write(makeTrace(3));
+    writer.flush();
+    traces = handle->getTraces();
+    REQUIRE(traces->size() == 1);
+    REQUIRE((*traces)[0][0].trace_id == 3);
+    REQUIRE(options.memory_budget->usedBytes() == 0);
+  }
+
+  SECTION("drop policies") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    auto makeTrace = [](uint64_t id, int32_t error) {
+      return make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", id, 1, 0, 69, 420, error}});
+    };
+    // The trace ids sent on the next flush.
+    auto sentIds = [&](AgentWriter& writer) {
+      writer.flush();
+      std::vector<uint64_t> ids;
+      for (auto& trace : *handle->getTraces()) {
+        ids.push_back(trace[0].trace_id);
+      }
+      std::sort(ids.begin(), ids.end());
+      return ids;
+    };
+    auto idsBetween = [](uint64_t first, uint64_t last) {
+      std::vector<uint64_t> ids;
+      for (uint64_t id = first; id <= last; id++) {
+        ids.push_back(id);
+      }
+      return ids;
+    };
+    AgentWriterOptions options;
+
+    SECTION("drop the newest traces") {
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      for (uint64_t id = 1; id <= 30; id++) {
+        writer.write(makeTrace(id, 0));
+      }
+      REQUIRE(sentIds(writer) == idsBetween(1, 25));
+      REQUIRE(writer.dropStats().queue_full == 5);
+    }
+
+    SECTION("drop the oldest traces") {
+      options.drop_policy = DropPolicy::drop_oldest;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      for (uint64_t id = 1; id <= 30; id++) {
+        writer.write(makeTrace(id, 0));
+      }
+      REQUIRE(sentIds(writer) == idsBetween(6, 30));
+      auto stats = writer.dropStats();
+      REQUIRE(stats.evicted_oldest == 5);
+      REQUIRE(stats.queue_full == 0);
+    }
+
+    SECTION("drop traces without errors to make room for ones with them") {
+      options.drop_policy = DropPolicy::priority;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      for (uint64_t id = 1; id <= 25; id++) {
+        writer.write(makeTrace(id, 0));
+      }
+      writer.write(makeTrace(26, 1));
+      auto kept = makeTrace(27, 0);
+      (*kept)[0]->meta["sampling.priority"] = "2";
+      writer.write(std::move(kept));
+      writer.write(makeTrace(28, 0));  // Dropped, since it isn't worth more than the others.
+      REQUIRE(sentIds(writer) == idsBetween(3, 27));
+      auto stats = writer.dropStats();
+      REQUIRE(stats.evicted_low_priority == 2);
+      REQUIRE(stats.queue_full == 1);
+    }
+
+    SECTION("keep traces with errors when the queue is full of them") {
+      options.drop_policy = DropPolicy::priority;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      for (uint64_t id = 1; id <= 30; id++) {
+        writer.write(makeTrace(id, 1));
+      }
+      REQUIRE(sentIds(writer).size() == 25);
+      auto stats = writer.dropStats();
+      REQUIRE(stats.evicted_low_priority == 0);
+      REQUIRE(stats.queue_full == 5);
+    }
+
+    SECTION("only look at so many queued spans for a trace to drop") {
+      options.drop_policy = DropPolicy::priority;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      // Only the last of its spans has an error, so it takes a long time to tell.
+      auto big = makeTrace(1, 0);
+      for (uint64_t id = 2; id <= 100; id++) {
+        big->emplace_back(new TestSpanData{"web", "service", "resource", "service.name", 1, id, 0,
+                                           69, 420, id == 100 ? 1 : 0});
+      }
+      writer.write(std::move(big));
+      for (uint64_t id = 2; id <= 25; id++) {
+        writer.write(makeTrace(id, 0));
+      }
+      writer.write(makeTrace(26, 1));  // Dropped, since it gives up before finding one to drop.
+      REQUIRE(sentIds(writer) == idsBetween(1, 25));
+      auto stats = writer.dropStats();
+      REQUIRE(stats.evicted_low_priority == 0);
+      REQUIRE(stats.queue_full == 1);
+    }
+  }
+
+  SECTION("write thresholds") {
+    std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+    MockHandle* handle = handle_ptr.get();
+    auto makeTrace = [](uint64_t id) {
+      return make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", id, 1, 0, 69, 420, 0},
+           TestSpanData{"web", "service", "resource", "service.name", id + 1, 1, 0, 69, 420, 0}});
+    };
+    // Waits for the handle to be given a request, and returns its traces.
+    auto waitForTraces = [&]() {
+      auto traces = handle->getTraces();
+      for (int i = 0; i < 500 && traces->empty(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        traces = handle->getTraces();
+      }
+      return traces;
+    };
+    AgentWriterOptions options;
+
+    SECTION("send traces once there are enough spans") {
+      options.write_threshold_spans = 5;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      writer.write(makeTrace(1));
+      writer.write(makeTrace(3));
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      REQUIRE(handle->getTraces()->empty());
+      writer.write(makeTrace(5));
+      REQUIRE(waitForTraces()->size() == 3);
+      // And again, once there are enough of them again.
+      writer.write(makeTrace(7));
+      writer.write(makeTrace(9));
+      writer.write(makeTrace(11));
+      REQUIRE(waitForTraces()->size() == 3);
+    }
+
+    SECTION("send traces once they're big enough") {
+      options.write_threshold_bytes = estimatedSize(makeTrace(1)) * 3 / 2;
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      writer.write(makeTrace(1));
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      REQUIRE(handle->getTraces()->empty());
+      writer.write(makeTrace(3));
+      REQUIRE(waitForTraces()->size() == 2);
+    }
+
+    SECTION("send traces early with concurrent requests") {
+      options.write_threshold_spans = 4;
+      std::vector<std::unique_ptr<Handle>> handles;
+      handles.push_back(std::move(handle_ptr));
+      AgentWriter writer{std::unique_ptr<MultiHandle>{new MockMultiHandle{}},
+                         std::move(handles),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      writer.write(makeTrace(1));
+      writer.write(makeTrace(3));
+      REQUIRE(waitForTraces()->size() == 2);
+    }
+  }
+
+  SECTION("connections to the agent") {
+    StubAgent agent;
+    AgentWriterOptions options;
+
+    SECTION("are reused") {
+      AgentWriter writer{std::unique_ptr<Handle>{new CurlHandle{}},
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "127.0.0.1",
+                         agent.port(),
+                         options};
+      for (uint64_t i = 1; i <= 3; i++) {
+        for (uint64_t j = 0; j < i; j++) {
+          writer.write(make_trace(
+              {TestSpanData{"web", "service", "resource", "service.name", j, 1, 0, 69, 420, 0}}));
+        }
+        writer.flush();
+        // The trace count is updated for each request.
+        REQUIRE(agent.lastRequest().headers["x-datadog-trace-count"] == std::to_string(i));
+      }
+      REQUIRE(agent.requests() == 3);
+      REQUIRE(agent.connections() == 1);
+      auto headers = agent.lastRequest().headers;
+      REQUIRE(headers["content-type"] == "application/msgpack");
+      REQUIRE(headers["datadog-meta-tracer-version"] == "v0.1.0");
+      REQUIRE(headers.find("expect") == headers.end());
+    }
+
+    SECTION("can be opened before there are traces") {
+      options.prewarm_connection = true;
+      AgentWriter writer{std::unique_ptr<Handle>{new CurlHandle{}},
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "127.0.0.1",
+                         agent.port(),
+                         options};
+      for (int i = 0; i < 500 && agent.requests() == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      REQUIRE(agent.requests() == 1);
+      REQUIRE(agent.lastRequest().headers["x-datadog-trace-count"] == "0");
+      REQUIRE(agent.decodeErrors() == 0);
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      REQUIRE(agent.traces() == 1);
+      REQUIRE(agent.connections() == 1);
+    }
+  }
+
+  SECTION("unix domain sockets") {
+    AgentWriterOptions options;
+    options.socket_path = "/tmp/dd-opentracing-writer-test-" + std::to_string(getpid()) + ".sock";
+
+    SECTION("are set on the handle") {
+      std::unique_ptr<MockHandle> handle_ptr{new MockHandle{}};
+      MockHandle* handle = handle_ptr.get();
+      AgentWriter writer{std::move(handle_ptr),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      REQUIRE(handle->options == std::unordered_map<CURLoption, std::string, EnumClassHash>{
+                                     {CURLOPT_UNIX_SOCKET_PATH, options.socket_path},
+                                     {CURLOPT_URL, "http://localhost/v0.3/traces"},
+                                     {CURLOPT_TIMEOUT_MS, "2000"}});
+    }
+
+    SECTION("can be used to reach an agent") {
+      StubAgent agent{options.socket_path};
+      AgentWriter writer{std::unique_ptr<Handle>{new CurlHandle{}},
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319,
+                         options};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      REQUIRE(agent.waitForTraces(1, std::chrono::seconds(5)));
+      REQUIRE(agent.spans() == 1);
+      REQUIRE(agent.lastRequest().path == "/v0.3/traces");
+    }
+  }
+
+  SECTION("concurrent requests") {
+    std::unique_ptr<MockHandle> first_ptr{new MockHandle{}};
+    std::unique_ptr<MockHandle> second_ptr{new MockHandle{}};
+    MockHandle* first = first_ptr.get();
+    MockHandle* second = second_ptr.get();
+    std::vector<std::unique_ptr<Handle>> handles;
+    handles.push_back(std::move(first_ptr));
+    handles.push_back(std::move(second_ptr));
+    // Waits for the handle to be given a request, and returns its traces.
+    auto waitForTraces = [](MockHandle* handle) {
+      auto traces = handle->getTraces();
+      for (int i = 0; i < 500 && traces->empty(); i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        traces = handle->getTraces();
+      }
+      return traces;
+    };
+
+    SECTION("send traces") {
+      AgentWriter writer{std::unique_ptr<MultiHandle>{new MockMultiHandle{}},
+                         std::move(handles),
+                         "v0.1.0",
+                         only_send_traces_when_we_flush,
+                         max_queued_traces,
+                         disable_retry,
+                         "hostname",
+                         6319};
+      REQUIRE(second->options[CURLOPT_URL] == "http://hostname:6319/v0.3/traces");
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      writer.flush();
+      auto traces = first->getTraces();
+      REQUIRE(traces->size() == 1);
+      REQUIRE((*traces)[0][0].trace_id == 1);
+      REQUIRE(first->headers["X-Datadog-Trace-Count"] == "1");
+      REQUIRE(second->getTraces()->empty());
+    }
+
+    SECTION("don't wait for retries") {
+      std::vector<std::chrono::milliseconds> retry_periods{std::chrono::milliseconds(1000)};
+      AgentWriter writer{std::unique_ptr<MultiHandle>{new MockMultiHandle{}},
+                         std::move(handles),
+                         "v0.1.0",
+                         std::chrono::milliseconds(50),
+                         max_queued_traces,
+                         retry_periods,
+                         "hostname",
+                         6319};
+      std::stringstream error_message;
+      std::streambuf* stderr = std::cerr.rdbuf(error_message.rdbuf());
+      first->perform_result = std::vector<CURLcode>{CURLE_OPERATION_TIMEDOUT, CURLE_OK};
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 1, 1, 0, 69, 420, 0}}));
+      REQUIRE(waitForTraces(first)->size() == 1);
+      // The first request failed, and is waiting to be retried, the next one goes out anyway.
+      writer.write(make_trace(
+          {TestSpanData{"web", "service", "resource", "service.name", 2, 1, 0, 69, 420, 0}}));
+      auto traces = waitForTraces(second);
+      REQUIRE(traces->size() == 1);
+      REQUIRE((*traces)[0][0].trace_id == 2);
+      REQUIRE(first->getTraces()->empty());
+      // Flushing waits for the retry.
+      writer.flush();
+      traces = first->getTraces();
+      REQUIRE(traces->size() == 1);
+      REQUIRE((*traces)[0][0].trace_id == 1);
+      TracerTelemetry telemetry;
+      writer.addTelemetry(telemetry);
+      REQUIRE(telemetry.posts_failed == 1);
+      REQUIRE(telemetry.posts_succeeded == 2);
+      REQUIRE(telemetry.post_retries == 1);
+      std::cerr.rdbuf(stderr);
+    }
+
+    SECTION("to a slow agent are in flight at once") {
+      StubAgent agent;
+      StubAgentBehaviour behaviour;
+      behaviour.latency = std::chrono::milliseconds(1000);
+      agent.setBehaviour(behaviour);
+      std::vector<std::unique_ptr<Handle>> curl_handles;
+      for (int i = 0; i < 3; i++) {
+        curl_handles.emplace_back(new CurlHandle{});
+      }
+      AgentWriter writer{std::unique_ptr<MultiHandle>{new CurlMultiHandle{}},
+                         std::move(curl_handles),
+                         "v0.1.0",
+                         std::chrono::milliseconds(50),
+                         max_queued_traces,
+                         disable_retry,
+                         "127.0.0.1",
+                         agent.port()};
+      auto start = std::chrono::steady_clock::now();
+      for (uint64_t i = 1; i <= 3; i++) {
+        writer.write(make_trace(
+            {TestSpanData{"web", "service", "resource", "service.name", i, 1, 0, 69, 420, 0}}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }
+      REQUIRE(agent.waitForTraces(3, std::chrono::seconds(5)));
+      // One at a time, these would take at least 3s.
+      REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(2500));
+      REQUIRE(agent.connections() == 3);
+    }
+  }
+
   SECTION("multiple requests don't append headers") {
     // Regression test for an issue where CURL only allows appending headers, not changing them,
     // therefore leading to extraneous headers.